@@ -0,0 +1,466 @@
+/*
+ *   Persistent cache of encoded TPCL graphics for the Toshiba TEC filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   tpclCacheOpen()    - Open (and create) a cache directory.
+ *   tpclCacheClose()   - Close a cache, trimming it to its size limit.
+ *   tpclCacheKey()     - Compute the key of a page.
+ *   tpclCacheFind()    - Map the graphics stored for a key.
+ *   tpclCacheRelease() - Unmap graphics returned by tpclCacheFind().
+ *   tpclCacheStore()   - Store the graphics for a key.
+ *   tpclCacheStats()   - Get the hit and miss counts.
+ *
+ *   cache_filename()   - Build the file name of an entry.
+ *   cache_trim()       - Remove least recently used entries.
+ *   cache_compare()    - Sort entries by last use.
+ *   hash_round()       - Mix a word into a hash lane.
+ *
+ * Entry files start with a cache_entry_t header that repeats the key and
+ * length, so truncated or foreign files are never sent to the printer.
+ * The modification time of an entry is its last use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+
+/*
+ * Entry file header...
+ */
+#define CACHE_MAGIC       "TPCLSG01"    /* Changes with the encoder output */
+#define CACHE_SUFFIX      ".tpcl"
+
+typedef struct cache_entry_s
+{
+  char          magic[8];               /* CACHE_MAGIC */
+  uint64_t      hash[2];                /* Key */
+  uint64_t      length;                 /* Bytes of graphics */
+} cache_entry_t;
+
+
+/*
+ * Cache structure...
+ */
+struct tpcl_cache_s
+{
+  char            *directory;           /* Cache directory */
+  size_t          max_size;             /* Size limit */
+  pthread_mutex_t lock;                 /* Protects the counters */
+  int             hits,                 /* Entries found */
+                  misses,               /* Entries not found */
+                  stored;               /* Entries stored */
+  unsigned        temp;                 /* Temporary file counter */
+};
+
+
+/*
+ * Entry in cache_trim()...
+ */
+typedef struct cache_file_s
+{
+  char          name[64];               /* File name */
+  off_t         size;                   /* Size in bytes */
+  time_t        mtime;                  /* Last use */
+} cache_file_t;
+
+
+/*
+ * Local functions...
+ */
+static void     cache_filename(tpcl_cache_t *cache, const tpcl_cache_key_t *key,
+                               char *filename, size_t size);
+static void     cache_trim(tpcl_cache_t *cache);
+static int      cache_compare(const void *a, const void *b);
+static uint64_t hash_round(uint64_t lane, uint64_t word);
+
+
+/*
+ * 'tpclCacheOpen()' - Open (and create) a cache directory.
+ */
+tpcl_cache_t *                          /* O - Cache or NULL */
+tpclCacheOpen(const char *directory,    /* I - Directory */
+              size_t     max_size)      /* I - Size limit in bytes */
+{
+  tpcl_cache_t  *cache;                 /* New cache */
+  struct stat   st;                     /* Directory info */
+
+
+  if (mkdir(directory, 0700) && errno != EEXIST)
+    return (NULL);
+
+  if (stat(directory, &st) || !S_ISDIR(st.st_mode) ||
+      access(directory, R_OK | W_OK | X_OK))
+    return (NULL);
+
+  if ((cache = calloc(1, sizeof(tpcl_cache_t))) == NULL)
+    return (NULL);
+
+  if ((cache->directory = strdup(directory)) == NULL)
+  {
+    free(cache);
+    return (NULL);
+  }
+
+  cache->max_size = max_size;
+  pthread_mutex_init(&cache->lock, NULL);
+
+  return (cache);
+}
+
+
+/*
+ * 'tpclCacheClose()' - Close a cache, trimming it to its size limit.
+ */
+void
+tpclCacheClose(tpcl_cache_t *cache)     /* I - Cache */
+{
+  if (!cache)
+    return;
+
+  if (cache->stored)
+    cache_trim(cache);
+
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->directory);
+  free(cache);
+}
+
+
+/*
+ * 'tpclCacheKey()' - Compute the key of a page.
+ *
+ * Two lanes with different seeds and mixing run over the same words; the
+ * graphics only depend on the mode, the size and the bitmap.  The pixel
+ * width is part of the size since pages that differ only in their padding
+ * bits still print differently once rotated or mirrored.
+ */
+void
+tpclCacheKey(tpcl_cache_key_t    *key,  /* O - Key */
+             int                 gmode, /* I - Graphics mode */
+             int                 pwidth,/* I - Pixels per line */
+             int                 width, /* I - Bytes per line */
+             int                 height,/* I - Number of lines */
+             const unsigned char *pixels)/* I - Page bitmap */
+{
+  uint64_t      a, b;                   /* Hash lanes */
+  uint64_t      word;                   /* Current word */
+  size_t        len;                    /* Bytes left */
+
+
+  len = (size_t)width * (size_t)height;
+  a   = 0x9e3779b97f4a7c15ULL ^ (uint64_t)gmode;
+  b   = 0xcbf29ce484222325ULL ^ ((uint64_t)width << 32 | (uint32_t)height);
+
+  a = hash_round(a, (uint64_t)width << 32 | (uint32_t)height);
+  a = hash_round(a, (uint64_t)(uint32_t)pwidth);
+  b = hash_round(b, (uint64_t)gmode);
+  b = hash_round(b, (uint64_t)(uint32_t)pwidth << 32);
+
+  for (; len >= 8; len -= 8, pixels += 8)
+  {
+    memcpy(&word, pixels, 8);
+    a = hash_round(a, word);
+    b = (b ^ word) * 0x100000001b3ULL;
+    b ^= b >> 29;
+  }
+
+  if (len > 0)
+  {
+    word = 0;
+    memcpy(&word, pixels, len);
+    a = hash_round(a, word);
+    b = (b ^ word) * 0x100000001b3ULL;
+    b ^= b >> 29;
+  }
+
+  /*
+   * Final avalanche of both lanes...
+   */
+  a ^= a >> 33;
+  a *= 0xff51afd7ed558ccdULL;
+  a ^= a >> 33;
+  b ^= b >> 32;
+  b *= 0xc4ceb9fe1a85ec53ULL;
+  b ^= b >> 29;
+
+  key->hash[0] = a;
+  key->hash[1] = b;
+}
+
+
+/*
+ * 'tpclCacheFind()' - Map the graphics stored for a key.
+ *
+ * Returns NULL on a miss.  A hit must be released with tpclCacheRelease().
+ */
+const void *                            /* O - Graphics or NULL */
+tpclCacheFind(tpcl_cache_t           *cache,    /* I - Cache */
+              const tpcl_cache_key_t *key,      /* I - Key */
+              size_t                 *len)      /* O - Length of graphics */
+{
+  char          filename[1024];         /* Entry file */
+  int           fd;                     /* Entry file descriptor */
+  struct stat   st;                     /* Entry info */
+  void          *map = MAP_FAILED;      /* Mapped entry */
+  cache_entry_t *entry;                 /* Entry header */
+
+
+  cache_filename(cache, key, filename, sizeof(filename));
+
+  if ((fd = open(filename, O_RDONLY)) >= 0)
+  {
+    if (!fstat(fd, &st) && (size_t)st.st_size > sizeof(cache_entry_t))
+      map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (map != MAP_FAILED)
+    {
+      entry = (cache_entry_t *)map;
+
+      if (memcmp(entry->magic, CACHE_MAGIC, sizeof(entry->magic)) ||
+          entry->hash[0] != key->hash[0] || entry->hash[1] != key->hash[1] ||
+          entry->length != (uint64_t)st.st_size - sizeof(cache_entry_t))
+      {
+        munmap(map, (size_t)st.st_size);
+        map = MAP_FAILED;
+      }
+      else
+        futimens(fd, NULL);             /* Mark as recently used */
+    }
+
+    close(fd);
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  if (map != MAP_FAILED)
+    cache->hits ++;
+  else
+    cache->misses ++;
+  pthread_mutex_unlock(&cache->lock);
+
+  if (map == MAP_FAILED)
+    return (NULL);
+
+  *len = (size_t)st.st_size - sizeof(cache_entry_t);
+
+  return ((const char *)map + sizeof(cache_entry_t));
+}
+
+
+/*
+ * 'tpclCacheRelease()' - Unmap graphics returned by tpclCacheFind().
+ */
+void
+tpclCacheRelease(const void *data,      /* I - Graphics */
+                 size_t     len)        /* I - Length of graphics */
+{
+  if (data)
+    munmap((char *)data - sizeof(cache_entry_t), len + sizeof(cache_entry_t));
+}
+
+
+/*
+ * 'tpclCacheStore()' - Store the graphics for a key.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclCacheStore(tpcl_cache_t           *cache,   /* I - Cache */
+               const tpcl_cache_key_t *key,     /* I - Key */
+               const void             *data,    /* I - Graphics */
+               size_t                 len)      /* I - Length of graphics */
+{
+  char          filename[1024],         /* Entry file */
+                tempname[1024];         /* Temporary file */
+  cache_entry_t entry;                  /* Entry header */
+  unsigned      temp;                   /* Temporary file number */
+  FILE          *fp;                    /* Temporary file */
+  int           status;                 /* Write status */
+
+
+  if (len == 0 || (cache->max_size && len + sizeof(entry) > cache->max_size))
+    return (-1);
+
+  pthread_mutex_lock(&cache->lock);
+  temp = cache->temp ++;
+  pthread_mutex_unlock(&cache->lock);
+
+  cache_filename(cache, key, filename, sizeof(filename));
+  snprintf(tempname, sizeof(tempname), "%s/.tmp-%d-%u", cache->directory,
+           (int)getpid(), temp);
+
+  memset(&entry, 0, sizeof(entry));
+  memcpy(entry.magic, CACHE_MAGIC, sizeof(entry.magic));
+  entry.hash[0] = key->hash[0];
+  entry.hash[1] = key->hash[1];
+  entry.length  = len;
+
+  if ((fp = fopen(tempname, "wb")) == NULL)
+    return (-1);
+
+  status = fwrite(&entry, sizeof(entry), 1, fp) == 1 &&
+           fwrite(data, 1, len, fp) == len;
+
+  if (fclose(fp))
+    status = 0;
+
+  if (!status || rename(tempname, filename))
+  {
+    unlink(tempname);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  cache->stored ++;
+  pthread_mutex_unlock(&cache->lock);
+
+  return (0);
+}
+
+
+/*
+ * 'tpclCacheStats()' - Get the hit and miss counts.
+ */
+void
+tpclCacheStats(tpcl_cache_t *cache,     /* I - Cache */
+               int          *hits,      /* O - Entries found */
+               int          *misses)    /* O - Entries not found */
+{
+  pthread_mutex_lock(&cache->lock);
+  *hits   = cache->hits;
+  *misses = cache->misses;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+
+/*
+ * 'cache_filename()' - Build the file name of an entry.
+ */
+static void
+cache_filename(tpcl_cache_t           *cache,   /* I - Cache */
+               const tpcl_cache_key_t *key,     /* I - Key */
+               char                   *filename,/* O - File name */
+               size_t                 size)     /* I - Size of file name */
+{
+  snprintf(filename, size, "%s/%016llx%016llx" CACHE_SUFFIX, cache->directory,
+           (unsigned long long)key->hash[0], (unsigned long long)key->hash[1]);
+}
+
+
+/*
+ * 'cache_trim()' - Remove least recently used entries.
+ */
+static void
+cache_trim(tpcl_cache_t *cache)         /* I - Cache */
+{
+  DIR           *dir;                   /* Cache directory */
+  struct dirent *dent;                  /* Directory entry */
+  cache_file_t  *files = NULL,          /* Entry files */
+                *temp;                  /* New files array */
+  int           num_files = 0,          /* Number of files */
+                alloc_files = 0,        /* Allocated files */
+                i;                      /* Looping var */
+  size_t        total = 0,              /* Total size */
+                namelen;                /* Length of name */
+  char          filename[1024];         /* Entry file */
+  struct stat   st;                     /* Entry info */
+
+
+  if (!cache->max_size || (dir = opendir(cache->directory)) == NULL)
+    return;
+
+  while ((dent = readdir(dir)) != NULL)
+  {
+    namelen = strlen(dent->d_name);
+    if (namelen != 32 + sizeof(CACHE_SUFFIX) - 1 ||
+        strcmp(dent->d_name + 32, CACHE_SUFFIX))
+      continue;
+
+    snprintf(filename, sizeof(filename), "%s/%s", cache->directory,
+             dent->d_name);
+    if (stat(filename, &st))
+      continue;
+
+    if (num_files >= alloc_files)
+    {
+      alloc_files += 256;
+      if ((temp = realloc(files, (size_t)alloc_files * sizeof(cache_file_t))) == NULL)
+        break;
+      files = temp;
+    }
+
+    strcpy(files[num_files].name, dent->d_name);
+    files[num_files].size  = st.st_size;
+    files[num_files].mtime = st.st_mtime;
+    num_files ++;
+
+    total += (size_t)st.st_size;
+  }
+
+  closedir(dir);
+
+  if (total > cache->max_size)
+  {
+    qsort(files, (size_t)num_files, sizeof(cache_file_t), cache_compare);
+
+    for (i = 0; i < num_files && total > cache->max_size; i ++)
+    {
+      snprintf(filename, sizeof(filename), "%s/%s", cache->directory,
+               files[i].name);
+      if (!unlink(filename))
+        total -= (size_t)files[i].size;
+    }
+  }
+
+  free(files);
+}
+
+
+/*
+ * 'cache_compare()' - Sort entries by last use.
+ */
+static int                              /* O - Result of comparison */
+cache_compare(const void *a,            /* I - First entry */
+              const void *b)            /* I - Second entry */
+{
+  const cache_file_t *fa = (const cache_file_t *)a,
+                     *fb = (const cache_file_t *)b;
+
+  return (fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime);
+}
+
+
+/*
+ * 'hash_round()' - Mix a word into a hash lane.
+ */
+static uint64_t                         /* O - New lane value */
+hash_round(uint64_t lane,               /* I - Lane */
+           uint64_t word)               /* I - Word */
+{
+  lane += word * 0xc2b2ae3d27d4eb4fULL;
+  lane  = (lane << 31) | (lane >> 33);
+
+  return (lane * 0x9e3779b185ebca87ULL);
+}
@@ -0,0 +1,57 @@
+/*
+ *   Persistent cache of encoded TPCL graphics for the Toshiba TEC filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TPCL_CACHE_H_
+#define _TPCL_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The cache is a directory with one file per page, named after a 128 bit
+ * hash of the graphics mode, page size and bitmap.  Entries are mapped
+ * into memory when found, written to a temporary file and renamed when
+ * stored, so several filters can share a directory, and the least
+ * recently used ones are removed when a cache that was stored to is
+ * closed and the directory is larger than its limit.  A cache may be used
+ * from several threads.
+ */
+typedef struct tpcl_cache_s tpcl_cache_t;
+
+typedef struct tpcl_cache_key_s
+{
+  uint64_t      hash[2];                /* Content hash */
+} tpcl_cache_key_t;
+
+extern tpcl_cache_t *tpclCacheOpen(const char *directory, size_t max_size);
+extern void         tpclCacheClose(tpcl_cache_t *cache);
+
+extern void         tpclCacheKey(tpcl_cache_key_t *key, int gmode,
+                                 int pwidth, int width, int height,
+                                 const unsigned char *pixels);
+extern const void   *tpclCacheFind(tpcl_cache_t *cache,
+                                   const tpcl_cache_key_t *key, size_t *len);
+extern void         tpclCacheRelease(const void *data, size_t len);
+extern int          tpclCacheStore(tpcl_cache_t *cache,
+                                   const tpcl_cache_key_t *key,
+                                   const void *data, size_t len);
+extern void         tpclCacheStats(tpcl_cache_t *cache, int *hits,
+                                   int *misses);
+
+#endif /* !_TPCL_CACHE_H_ */
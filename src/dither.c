@@ -0,0 +1,384 @@
+/*
+ *   Grayscale to bitmap conversion for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   DITHERThresholds()   - Build the threshold rows for a method.
+ *   DITHERLine()         - Threshold one line against a row of thresholds.
+ *   DITHERDiffuse()      - Error diffuse one line.
+ *   DITHERSelectKernel() - Choose the fastest line kernel for this CPU.
+ *   DITHERKernelName()   - Name of the line kernel in use.
+ *
+ * Fixed threshold, ordered and line screen dithering all compare each
+ * pixel with a precomputed threshold, which the SIMD kernels do 16 or 32
+ * pixels at a time.  Error diffusion carries the error from pixel to
+ * pixel and is always done by the portable code.  All kernels produce
+ * exactly the same bits.  TOPIX_KERNEL=scalar|sse2|avx2 in the
+ * environment forces one, as for the TOPIX encoder.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "tpcl.h"
+#include "dither.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define DITHER_HAVE_X86 1
+#  include <immintrin.h>
+#endif /* __GNUC__ && x86 */
+
+
+/*
+ * Local functions...
+ */
+static void dither_line_scalar(const unsigned char *gray,
+                               const unsigned char *thresholds,
+                               int pixels, int invert, unsigned char *out);
+
+/*
+ * Globals...
+ */
+static pthread_once_t KernelOnce = PTHREAD_ONCE_INIT;
+static dither_kernel_t Kernel = dither_line_scalar;
+static const char   *KernelName = "scalar";
+
+/*
+ * 8x8 Bayer matrix, and the bit reversed order used for the line screen
+ * so that any run of columns gets an even spread of thresholds.
+ */
+static const unsigned char Bayer[DITHER_ROWS][8] =
+{
+  {  0, 32,  8, 40,  2, 34, 10, 42 },
+  { 48, 16, 56, 24, 50, 18, 58, 26 },
+  { 12, 44,  4, 36, 14, 46,  6, 38 },
+  { 60, 28, 52, 20, 62, 30, 54, 22 },
+  {  3, 35, 11, 43,  1, 33,  9, 41 },
+  { 51, 19, 59, 27, 49, 17, 57, 25 },
+  { 15, 47,  7, 39, 13, 45,  5, 37 },
+  { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+static const unsigned char Screen[16] =
+{
+  0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15
+};
+
+#ifdef DITHER_HAVE_X86
+static unsigned char BitReverse[256];   /* movemask order to MSB first */
+#endif /* DITHER_HAVE_X86 */
+
+
+/*
+ * 'DITHERThresholds()' - Build the threshold rows for a method.
+ *
+ * thresholds holds DITHER_ROWS rows of pixels bytes.  The line screen
+ * only varies across the line, so flat areas give identical lines that
+ * TOPIX sends as a single byte each.
+ */
+void
+DITHERThresholds(int           method,      /* I - TPCL_DITHER_xxx */
+                 int           pixels,      /* I - Pixels per line */
+                 unsigned char *thresholds) /* O - Threshold rows */
+{
+  int           x, y;                   /* Looping vars */
+  unsigned char *row;                   /* Current row */
+
+
+  for (y = 0, row = thresholds; y < DITHER_ROWS; y ++, row += pixels)
+    for (x = 0; x < pixels; x ++)
+      switch (method)
+      {
+        case TPCL_DITHER_ORDERED :
+            row[x] = (unsigned char)(Bayer[y][x & 7] * 4 + 2);
+            break;
+
+        case TPCL_DITHER_SCREEN :
+            row[x] = (unsigned char)(Screen[x & 15] * 16 + 8);
+            break;
+
+        default :
+            row[x] = 127;
+            break;
+      }
+}
+
+
+/*
+ * 'DITHERLine()' - Threshold one line against a row of thresholds.
+ */
+void
+DITHERLine(const unsigned char *gray,   /* I - 8-bit pixels */
+           const unsigned char *thresholds,     /* I - Threshold row */
+           int                 pixels,  /* I - Pixels per line */
+           int                 invert,  /* I - 1 if 255 is white */
+           unsigned char       *out)    /* O - (pixels + 7) / 8 bytes */
+{
+  (*Kernel)(gray, thresholds, pixels, invert, out);
+}
+
+
+/*
+ * 'DITHERDiffuse()' - Error diffuse one line.
+ *
+ * Floyd-Steinberg, alternating direction every line.  errors holds
+ * pixels + 2 sixteenths carried down from the line above, with one guard
+ * at each end, and must be zero for the first line of a page.
+ */
+void
+DITHERDiffuse(const unsigned char *gray,        /* I - 8-bit pixels */
+              int                 *errors,      /* IO - Carried errors */
+              int                 pixels,       /* I - Pixels per line */
+              int                 y,            /* I - Line number */
+              int                 invert,       /* I - 1 if 255 is white */
+              unsigned char       *out)         /* O - (pixels + 7) / 8 bytes */
+{
+  int           x, end, dir;            /* Looping vars */
+  int           *e;                     /* Error of pixel */
+  int           level;                  /* Ink level with error */
+  int           err;                    /* Error of this pixel */
+  int           right,                  /* Error for next pixel */
+                below;                  /* Error for next pixel below */
+  unsigned char mask;                   /* Ink level mask */
+
+
+  memset(out, 0, (size_t)(pixels + 7) / 8);
+
+  mask = invert ? 255 : 0;
+
+  if (y & 1)
+  {
+    x   = pixels - 1;
+    end = -1;
+    dir = -1;
+  }
+  else
+  {
+    x   = 0;
+    end = pixels;
+    dir = 1;
+  }
+
+  errors[0]          = 0;
+  errors[pixels + 1] = 0;
+
+  for (right = 0, below = 0; x != end; x += dir)
+  {
+    e     = errors + x + 1;
+    level = (gray[x] ^ mask) + ((*e + right) >> 4);
+
+    if (level > 127)
+    {
+      out[x >> 3] |= 0x80 >> (x & 7);
+      err = level - 255;
+    }
+    else
+      err = level;
+
+   /*
+    * 7/16 to the next pixel, 3/16, 5/16 and 1/16 to the line below.  The
+    * slot of this pixel now belongs to the line below...
+    */
+    right    = 7 * err;
+    *e       = below + 5 * err;
+    e[-dir] += 3 * err;
+    below    = err;
+  }
+}
+
+
+/*
+ * 'dither_line_scalar()' - Portable threshold kernel.
+ */
+static void
+dither_line_scalar(const unsigned char *gray,   /* I - 8-bit pixels */
+                   const unsigned char *thresholds, /* I - Threshold row */
+                   int                 pixels,  /* I - Pixels per line */
+                   int                 invert,  /* I - 1 if 255 is white */
+                   unsigned char       *out)    /* O - Packed bits */
+{
+  int           x;                      /* Looping var */
+  unsigned char mask;                   /* Ink level mask */
+  unsigned char bits;                   /* Current byte */
+
+
+  mask = invert ? 255 : 0;
+
+  for (x = 0, bits = 0; x < pixels; x ++)
+  {
+    bits = (unsigned char)(bits << 1) | ((gray[x] ^ mask) > thresholds[x]);
+
+    if ((x & 7) == 7)
+    {
+      *out++ = bits;
+      bits   = 0;
+    }
+  }
+
+  if (x & 7)
+    *out = (unsigned char)(bits << (8 - (x & 7)));
+}
+
+
+#ifdef DITHER_HAVE_X86
+/*
+ * 'dither_line_sse2()' - SSE2 threshold kernel.
+ *
+ * SSE2 has no unsigned byte compare, so both sides are biased by 0x80.
+ */
+__attribute__((target("sse2")))
+static void
+dither_line_sse2(const unsigned char *gray,     /* I - 8-bit pixels */
+                 const unsigned char *thresholds, /* I - Threshold row */
+                 int                 pixels,    /* I - Pixels per line */
+                 int                 invert,    /* I - 1 if 255 is white */
+                 unsigned char       *out)      /* O - Packed bits */
+{
+  int           x;                      /* Looping var */
+  unsigned      m;                      /* Compare mask */
+  __m128i       g, t, bias, mask;       /* Vectors */
+
+
+  bias = _mm_set1_epi8((char)0x80);
+  mask = _mm_set1_epi8(invert ? (char)0xff : 0);
+
+  for (x = 0; x + 16 <= pixels; x += 16, out += 2)
+  {
+    g = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(gray + x)),
+                      _mm_xor_si128(mask, bias));
+    t = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(thresholds + x)),
+                      bias);
+    m = (unsigned)_mm_movemask_epi8(_mm_cmpgt_epi8(g, t));
+
+    out[0] = BitReverse[m & 255];
+    out[1] = BitReverse[m >> 8];
+  }
+
+  if (x < pixels)
+    dither_line_scalar(gray + x, thresholds + x, pixels - x, invert, out);
+}
+
+
+/*
+ * 'dither_line_avx2()' - AVX2 threshold kernel.
+ *
+ * Each group of 8 pixels is reversed with pshufb so that movemask gives
+ * the packed bytes directly.
+ */
+__attribute__((target("avx2")))
+static void
+dither_line_avx2(const unsigned char *gray,     /* I - 8-bit pixels */
+                 const unsigned char *thresholds, /* I - Threshold row */
+                 int                 pixels,    /* I - Pixels per line */
+                 int                 invert,    /* I - 1 if 255 is white */
+                 unsigned char       *out)      /* O - Packed bits */
+{
+  int           x;                      /* Looping var */
+  uint32_t      m;                      /* Compare mask */
+  __m256i       g, t, bias, mask, rev;  /* Vectors */
+
+
+  bias = _mm256_set1_epi8((char)0x80);
+  mask = _mm256_set1_epi8(invert ? (char)0xff : 0);
+  rev  = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                          7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+
+  for (x = 0; x + 32 <= pixels; x += 32, out += 4)
+  {
+    g = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(gray + x)),
+                         _mm256_xor_si256(mask, bias));
+    t = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(thresholds + x)),
+                         bias);
+    m = (uint32_t)_mm256_movemask_epi8(
+            _mm256_shuffle_epi8(_mm256_cmpgt_epi8(g, t), rev));
+
+    memcpy(out, &m, 4);                 /* Little endian: pixel 0 first */
+  }
+
+  if (x < pixels)
+    dither_line_sse2(gray + x, thresholds + x, pixels - x, invert, out);
+}
+#endif /* DITHER_HAVE_X86 */
+
+
+/*
+ * 'dither_select_kernel()' - Fill in the table and choose the kernel.
+ */
+static void
+dither_select_kernel(void)
+{
+  const char        *force;         /* TOPIX_KERNEL environment variable */
+  dither_kernel_t   kernel;         /* Chosen kernel */
+#ifdef DITHER_HAVE_X86
+  int               m, b;           /* Mask, bit */
+#endif /* DITHER_HAVE_X86 */
+
+
+  force      = getenv("TOPIX_KERNEL");
+  kernel     = dither_line_scalar;
+  KernelName = "scalar";
+
+#ifdef DITHER_HAVE_X86
+  for (m = 0; m < 256; m++)
+    for (b = 0, BitReverse[m] = 0; b < 8; b++)
+      if (m & (1 << b))
+        BitReverse[m] |= 0x80 >> b;
+
+  __builtin_cpu_init();
+
+  if (force && !strcmp(force, "scalar"))
+    ;
+  else if (__builtin_cpu_supports("avx2") && (!force || !strcmp(force, "avx2")))
+  {
+    kernel     = dither_line_avx2;
+    KernelName = "avx2";
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    kernel     = dither_line_sse2;
+    KernelName = "sse2";
+  }
+#else
+  (void)force;
+#endif /* DITHER_HAVE_X86 */
+
+  Kernel = kernel;
+}
+
+
+/*
+ * 'DITHERSelectKernel()' - Choose the fastest line kernel for this CPU.
+ *
+ * The choice is made once per process; later calls do nothing.
+ */
+void
+DITHERSelectKernel(void)
+{
+  pthread_once(&KernelOnce, dither_select_kernel);
+}
+
+
+/*
+ * 'DITHERKernelName()' - Name of the line kernel in use.
+ */
+const char *
+DITHERKernelName(void)
+{
+  return (KernelName);
+}
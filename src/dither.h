@@ -0,0 +1,50 @@
+/*
+ *   Grayscale to bitmap conversion for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DITHER_H_
+#define _DITHER_H_
+
+/*
+ * Pixels are ink levels, 0 for none and 255 for black; invert flips
+ * them for white-is-255 color spaces.  A pixel is printed when its ink
+ * level is above its threshold.  Ordered thresholds repeat every
+ * DITHER_ROWS lines.
+ */
+#define DITHER_ROWS       8
+
+/*
+ * Line kernel: compare pixels against a row of thresholds and pack the
+ * result into out, most significant bit first.
+ */
+typedef void (*dither_kernel_t)(const unsigned char *gray,
+                                const unsigned char *thresholds,
+                                int pixels, int invert, unsigned char *out);
+
+extern void         DITHERThresholds(int method, int pixels,
+                                     unsigned char *thresholds);
+extern void         DITHERLine(const unsigned char *gray,
+                               const unsigned char *thresholds,
+                               int pixels, int invert, unsigned char *out);
+extern void         DITHERDiffuse(const unsigned char *gray, int *errors,
+                                  int pixels, int y, int invert,
+                                  unsigned char *out);
+extern void         DITHERSelectKernel(void);
+extern const char   *DITHERKernelName(void);
+
+#endif /* !_DITHER_H_ */
@@ -0,0 +1,225 @@
+/*
+ *   Status and debug messages for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   tpclLogSetDebug()     - Enable or disable DEBUG messages.
+ *   tpclLogDebugEnabled() - Return whether DEBUG messages are enabled.
+ *   tpclLogDebug()        - Queue a DEBUG message.
+ *   tpclLogProgress()     - Report the progress of a page.
+ *   tpclLogFlush()        - Write any queued messages.
+ *
+ *   log_write()           - Write the message buffer to stderr.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "log.h"
+
+
+/*
+ * Messages are queued until this many bytes are pending...
+ */
+#define LOG_BUFFER_SIZE  4096
+
+
+/*
+ * Local globals...
+ */
+static pthread_mutex_t  log_lock = PTHREAD_MUTEX_INITIALIZER;
+                                        /* Protects everything below */
+static int              log_debug = 0;  /* DEBUG messages enabled? */
+static size_t           log_used = 0;   /* Bytes in buffer */
+static char             log_buffer[LOG_BUFFER_SIZE];
+                                        /* Pending messages */
+static double           log_progress_time = 0.0;
+                                        /* Time of last progress message */
+static int              log_progress_page = 0;
+                                        /* Page of last progress message */
+static int              log_progress_percent = -1;
+                                        /* Percent of last progress message */
+
+
+/*
+ * Local functions...
+ */
+static void     log_write(void);
+
+
+/*
+ * 'tpclLogSetDebug()' - Enable or disable DEBUG messages.
+ */
+void
+tpclLogSetDebug(int debug)              /* I - 1 to enable, 0 to disable */
+{
+  pthread_mutex_lock(&log_lock);
+  log_debug = debug;
+  pthread_mutex_unlock(&log_lock);
+}
+
+
+/*
+ * 'tpclLogDebugEnabled()' - Return whether DEBUG messages are enabled.
+ *
+ * Callers use this to skip building expensive messages.
+ */
+int                                     /* O - 1 if enabled, 0 otherwise */
+tpclLogDebugEnabled(void)
+{
+  return (log_debug);
+}
+
+
+/*
+ * 'tpclLogDebug()' - Queue a DEBUG message.
+ */
+void
+tpclLogDebug(const char *format,        /* I - printf-style format */
+             ...)                       /* I - Additional arguments */
+{
+  va_list       ap;                     /* Argument pointer */
+  char          message[1024];          /* Formatted message */
+  int           len;                    /* Length of message */
+
+
+  if (!log_debug)
+    return;
+
+  memcpy(message, "DEBUG: ", 7);
+
+  va_start(ap, format);
+  len = vsnprintf(message + 7, sizeof(message) - 8, format, ap);
+  va_end(ap);
+
+  if (len < 0)
+    return;
+
+  len += 7;
+  if (len > (int)sizeof(message) - 2)
+    len = (int)sizeof(message) - 2;
+
+  message[len ++] = '\n';
+
+  pthread_mutex_lock(&log_lock);
+
+  if (log_used + (size_t)len > sizeof(log_buffer))
+    log_write();
+
+  memcpy(log_buffer + log_used, message, (size_t)len);
+  log_used += (size_t)len;
+
+  pthread_mutex_unlock(&log_lock);
+}
+
+
+/*
+ * 'tpclLogProgress()' - Report the progress of a page.
+ *
+ * The message is only written when the percentage has changed and at least
+ * TPCL_LOG_PROGRESS seconds have passed since the last one, so fast pages
+ * cost a handful of lines rather than one per band.
+ */
+void
+tpclLogProgress(int      page,          /* I - Page number */
+                unsigned y,             /* I - Current line */
+                unsigned height)        /* I - Lines on the page */
+{
+  struct timespec ts;                   /* Current time */
+  double        now;                    /* Current time in seconds */
+  int           percent;                /* Percent complete */
+  char          message[256];           /* Formatted message */
+  int           len;                    /* Length of message */
+
+
+  percent = height ? (int)(100 * (unsigned long)y / height) : 100;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = ts.tv_sec + ts.tv_nsec * 0.000000001;
+
+  pthread_mutex_lock(&log_lock);
+
+  if ((page != log_progress_page || percent != log_progress_percent) &&
+      now - log_progress_time >= TPCL_LOG_PROGRESS)
+  {
+    log_progress_time    = now;
+    log_progress_page    = page;
+    log_progress_percent = percent;
+
+    len = snprintf(message, sizeof(message),
+                   "INFO: Printing page %d, %d%% complete...\n", page,
+                   percent);
+
+    if (log_used + (size_t)len > sizeof(log_buffer))
+      log_write();
+
+    memcpy(log_buffer + log_used, message, (size_t)len);
+    log_used += (size_t)len;
+
+    log_write();
+  }
+
+  pthread_mutex_unlock(&log_lock);
+}
+
+
+/*
+ * 'tpclLogFlush()' - Write any queued messages.
+ */
+void
+tpclLogFlush(void)
+{
+  pthread_mutex_lock(&log_lock);
+  log_write();
+  pthread_mutex_unlock(&log_lock);
+}
+
+
+/*
+ * 'log_write()' - Write the message buffer to stderr.
+ *
+ * Called with log_lock held.  Messages are always whole lines, so cupsd
+ * never sees a partial one.
+ */
+static void
+log_write(void)
+{
+  const char    *ptr = log_buffer;      /* Pointer into buffer */
+  ssize_t       bytes;                  /* Bytes written */
+
+
+  while (log_used > 0)
+  {
+    if ((bytes = write(2, ptr, log_used)) < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+
+      break;
+    }
+
+    ptr      += bytes;
+    log_used -= (size_t)bytes;
+  }
+
+  log_used = 0;
+}
@@ -0,0 +1,39 @@
+/*
+ *   Status and debug messages for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TPCL_LOG_H_
+#define _TPCL_LOG_H_
+
+/*
+ * DEBUG messages are dropped unless enabled, and otherwise collected and
+ * written to stderr in batches; call tpclLogFlush() at page boundaries.
+ * Progress messages are written at most every TPCL_LOG_PROGRESS seconds.
+ * ERROR:, PAGE: and other messages cupsd acts on are still written
+ * directly.  All functions may be called from several threads.
+ */
+#define TPCL_LOG_PROGRESS 0.25
+
+extern void tpclLogSetDebug(int debug);
+extern int  tpclLogDebugEnabled(void);
+extern void tpclLogDebug(const char *format, ...)
+            __attribute__((format(printf, 1, 2)));
+extern void tpclLogProgress(int page, unsigned y, unsigned height);
+extern void tpclLogFlush(void);
+
+#endif /* !_TPCL_LOG_H_ */
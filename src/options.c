@@ -0,0 +1,314 @@
+/*
+ *   Compiled job options for the Toshiba TEC filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   tpclOptionsLoad()  - Get the stored options for a PPD and key.
+ *   tpclOptionsStore() - Store the options for a PPD and key.
+ *
+ *   options_filename() - Build the file name for a PPD.
+ *   options_read()     - Read the entries stored for a PPD.
+ *
+ * A file starts with an options_head_t holding the PPD's inode,
+ * modification time and size, followed by up to OPTIONS_ENTRIES entries, most recently
+ * stored first: the key length, the key and the options.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "options.h"
+
+
+/*
+ * File header and limits...
+ */
+#define OPTIONS_MAGIC     "TPCLOP01"    /* Changes with tpcl_options_t */
+#define OPTIONS_ENTRIES   16            /* Option strings kept per PPD */
+#define OPTIONS_MAX_KEY   4096          /* Longest key that is stored */
+#define OPTIONS_ENTRY(len) (sizeof(uint32_t) + (len) + sizeof(tpcl_options_t))
+
+typedef struct options_head_s
+{
+  char          magic[8];               /* OPTIONS_MAGIC */
+  uint32_t      size;                   /* sizeof(tpcl_options_t) */
+  uint32_t      count;                  /* Number of entries */
+  int64_t       mtime;                  /* Modification time of the PPD */
+  int64_t       length;                 /* Size of the PPD */
+  int64_t       inode;                  /* Inode of the PPD */
+} options_head_t;
+
+
+/*
+ * Local functions...
+ */
+static void     options_filename(const char *directory, const char *ppdfile,
+                                 char *filename, size_t size);
+static unsigned char *options_read(const char *filename,
+                                   const struct stat *ppdinfo,
+                                   size_t *len, int *count);
+
+
+/*
+ * 'tpclOptionsLoad()' - Get the stored options for a PPD and key.
+ *
+ * Returns -1 when nothing was stored for this key, or when the PPD
+ * changed since.
+ */
+int                                     /* O - 0 on success, -1 on miss */
+tpclOptionsLoad(const char     *directory,      /* I - Cache directory */
+                const char     *ppdfile,        /* I - PPD file */
+                const char     *key,            /* I - Option string */
+                tpcl_options_t *options)        /* O - Options */
+{
+  char          filename[1024];         /* Options file */
+  struct stat   ppdinfo;                /* PPD file info */
+  unsigned char *data, *ptr;            /* Entries */
+  size_t        len;                    /* Bytes of entries */
+  int           count;                  /* Number of entries */
+  uint32_t      keylen;                 /* Length of entry key */
+  int           status;                 /* Load status */
+
+
+  if (stat(ppdfile, &ppdinfo))
+    return (-1);
+
+  options_filename(directory, ppdfile, filename, sizeof(filename));
+
+  if ((data = options_read(filename, &ppdinfo, &len, &count)) == NULL)
+    return (-1);
+
+  for (ptr = data, status = -1; count > 0 && status; count --)
+  {
+    memcpy(&keylen, ptr, sizeof(keylen));
+
+    if (keylen == strlen(key) && !memcmp(ptr + sizeof(keylen), key, keylen))
+    {
+      memcpy(options, ptr + sizeof(keylen) + keylen, sizeof(tpcl_options_t));
+      status = 0;
+    }
+
+    ptr += OPTIONS_ENTRY(keylen);
+  }
+
+  free(data);
+
+  return (status);
+}
+
+
+/*
+ * 'tpclOptionsStore()' - Store the options for a PPD and key.
+ *
+ * The entry goes first, followed by the other entries that are still
+ * valid, and the file is replaced in one rename so that concurrent jobs
+ * only ever see a complete file.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclOptionsStore(const char           *directory,       /* I - Cache directory */
+                 const char           *ppdfile,         /* I - PPD file */
+                 const char           *key,             /* I - Option string */
+                 const tpcl_options_t *options)         /* I - Options */
+{
+  char          filename[1024],         /* Options file */
+                tempname[1024];         /* Temporary file */
+  struct stat   ppdinfo;                /* PPD file info */
+  options_head_t head;                  /* File header */
+  unsigned char *data, *ptr;            /* Old entries */
+  size_t        len;                    /* Bytes of old entries */
+  int           count;                  /* Number of old entries */
+  uint32_t      keylen, oldlen;         /* Length of keys */
+  FILE          *fp;                    /* Temporary file */
+  int           status;                 /* Write status */
+
+
+  if ((keylen = (uint32_t)strlen(key)) > OPTIONS_MAX_KEY ||
+      stat(ppdfile, &ppdinfo))
+    return (-1);
+
+  if (mkdir(directory, 0700) && errno != EEXIST)
+    return (-1);
+
+  options_filename(directory, ppdfile, filename, sizeof(filename));
+  snprintf(tempname, sizeof(tempname), "%s/.tmp-%d-options", directory,
+           (int)getpid());
+
+  count = 0;
+  data  = options_read(filename, &ppdinfo, &len, &count);
+
+  if ((fp = fopen(tempname, "wb")) == NULL)
+  {
+    free(data);
+    return (-1);
+  }
+
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, OPTIONS_MAGIC, sizeof(head.magic));
+  head.size   = sizeof(tpcl_options_t);
+  head.count  = 1;
+  head.mtime  = (int64_t)ppdinfo.st_mtime;
+  head.length = (int64_t)ppdinfo.st_size;
+  head.inode  = (int64_t)ppdinfo.st_ino;
+
+  for (ptr = data; count > 0 && head.count < OPTIONS_ENTRIES; count --)
+  {
+    memcpy(&oldlen, ptr, sizeof(oldlen));
+    if (oldlen != keylen || memcmp(ptr + sizeof(oldlen), key, keylen))
+      head.count ++;
+
+    ptr += OPTIONS_ENTRY(oldlen);
+  }
+
+  status = fwrite(&head, sizeof(head), 1, fp) == 1 &&
+           fwrite(&keylen, sizeof(keylen), 1, fp) == 1 &&
+           fwrite(key, 1, keylen, fp) == keylen &&
+           fwrite(options, sizeof(tpcl_options_t), 1, fp) == 1;
+
+  for (ptr = data, count = (int)head.count - 1; status && count > 0;
+       ptr += OPTIONS_ENTRY(oldlen))
+  {
+    memcpy(&oldlen, ptr, sizeof(oldlen));
+    if (oldlen == keylen && !memcmp(ptr + sizeof(oldlen), key, keylen))
+      continue;
+
+    status = fwrite(ptr, OPTIONS_ENTRY(oldlen), 1, fp) == 1;
+    count --;
+  }
+
+  free(data);
+
+  if (fclose(fp))
+    status = 0;
+
+  if (!status || rename(tempname, filename))
+  {
+    unlink(tempname);
+    return (-1);
+  }
+
+  return (0);
+}
+
+
+/*
+ * 'options_filename()' - Build the file name for a PPD.
+ *
+ * The name is a 64 bit FNV-1a hash of the PPD file name.  Two PPD files
+ * with the same hash would also need the same inode, time and size to be
+ * mistaken for each other.
+ */
+static void
+options_filename(const char *directory, /* I - Cache directory */
+                 const char *ppdfile,   /* I - PPD file */
+                 char       *filename,  /* O - Options file */
+                 size_t     size)       /* I - Size of filename */
+{
+  uint64_t      hash;                   /* Hash of the PPD file name */
+
+
+  for (hash = 0xcbf29ce484222325ULL; *ppdfile; ppdfile ++)
+    hash = (hash ^ (unsigned char)*ppdfile) * 0x100000001b3ULL;
+
+  snprintf(filename, size, "%s/options-%016llx", directory,
+           (unsigned long long)hash);
+}
+
+
+/*
+ * 'options_read()' - Read the entries stored for a PPD.
+ *
+ * Returns NULL if there is no file, or it is damaged, from another
+ * version or for an older copy of the PPD.
+ */
+static unsigned char *                  /* O - Entries or NULL */
+options_read(const char        *filename,       /* I - Options file */
+             const struct stat *ppdinfo,        /* I - PPD file info */
+             size_t            *len,            /* O - Bytes of entries */
+             int               *count)          /* O - Number of entries */
+{
+  FILE          *fp;                    /* Options file */
+  struct stat   st;                     /* Options file info */
+  options_head_t head;                  /* File header */
+  unsigned char *data;                  /* Entries */
+  size_t        used;                   /* Bytes checked */
+  uint32_t      keylen;                 /* Length of entry key */
+  uint32_t      i;                      /* Looping var */
+
+
+  if ((fp = fopen(filename, "rb")) == NULL)
+    return (NULL);
+
+  data = NULL;
+
+  if (fstat(fileno(fp), &st) ||
+      (size_t)st.st_size < sizeof(head) ||
+      (size_t)st.st_size > sizeof(head) +
+                           OPTIONS_ENTRIES * OPTIONS_ENTRY(OPTIONS_MAX_KEY) ||
+      fread(&head, sizeof(head), 1, fp) != 1 ||
+      memcmp(head.magic, OPTIONS_MAGIC, sizeof(head.magic)) ||
+      head.size != sizeof(tpcl_options_t) ||
+      head.count > OPTIONS_ENTRIES ||
+      head.mtime != (int64_t)ppdinfo->st_mtime ||
+      head.length != (int64_t)ppdinfo->st_size ||
+      head.inode != (int64_t)ppdinfo->st_ino)
+  {
+    fclose(fp);
+    return (NULL);
+  }
+
+  *len = (size_t)st.st_size - sizeof(head);
+
+  if ((data = malloc(*len + 1)) == NULL ||
+      fread(data, 1, *len, fp) != *len)
+  {
+    fclose(fp);
+    free(data);
+    return (NULL);
+  }
+
+  fclose(fp);
+
+  /*
+   * Check that every entry lies within the file...
+   */
+  for (i = 0, used = 0; i < head.count; i ++)
+  {
+    if (*len - used < sizeof(keylen))
+      break;
+
+    memcpy(&keylen, data + used, sizeof(keylen));
+    if (keylen > OPTIONS_MAX_KEY || *len - used < OPTIONS_ENTRY(keylen))
+      break;
+
+    used += OPTIONS_ENTRY(keylen);
+  }
+
+  if (i < head.count)
+  {
+    free(data);
+    return (NULL);
+  }
+
+  *count = (int)head.count;
+
+  return (data);
+}
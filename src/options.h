@@ -0,0 +1,48 @@
+/*
+ *   Compiled job options for the Toshiba TEC filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TPCL_OPTIONS_H_
+#define _TPCL_OPTIONS_H_
+
+#include "tpcl.h"
+
+/*
+ * All of the PPD options a job uses, resolved once.  The options of the
+ * last few option strings used with a PPD file are kept in one small file
+ * per PPD in a cache directory, and are only used while the PPD keeps the
+ * same modification time and size, so later jobs need not load the PPD.
+ */
+typedef struct tpcl_options_s
+{
+  tpcl_settings_t settings;             /* Library settings */
+  int           debug_log;              /* DEBUG messages (teDebugLog) */
+  int           threads;                /* Encoders, 0 per CPU (teThreads) */
+  int           memory_limit;           /* Encoder memory in MB (teMemoryLimit) */
+  int           page_cache;             /* Cache size in MB or 0 (tePageCache) */
+  int           merge_pages;            /* Merge identical labels (teMergePages) */
+  int           pipeline;               /* Pipelined processing (tePipeline) */
+} tpcl_options_t;
+
+extern int      tpclOptionsLoad(const char *directory, const char *ppdfile,
+                                const char *key, tpcl_options_t *options);
+extern int      tpclOptionsStore(const char *directory, const char *ppdfile,
+                                 const char *key,
+                                 const tpcl_options_t *options);
+
+#endif /* !_TPCL_OPTIONS_H_ */
@@ -0,0 +1,354 @@
+/*
+ *   Bitmap rotation and mirroring for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   ORIENTTranspose()    - Transpose a bitmap.
+ *   ORIENTMirrorLine()   - Reverse the pixels of a line.
+ *   ORIENTInvertLine()   - Invert the pixels of a line.
+ *   ORIENTSelectKernel() - Choose the fastest tile kernel for this CPU.
+ *   ORIENTKernelName()   - Name of the tile kernel in use.
+ *
+ * The scalar kernel transposes 8x8 bit blocks in a 64-bit word.  The SSE2
+ * kernel transposes the bytes of 16 lines with unpack instructions and
+ * then peels off one bit of every byte per movemask.  AVX2 does not help
+ * here, the kernel is bound by the two byte stores per column.  Tiles on
+ * the right and bottom edges are always done 8x8 by the portable code.
+ * Both kernels produce exactly the same bits; TOPIX_KERNEL=scalar in the
+ * environment forces the portable one, as for the TOPIX encoder.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "orient.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define ORIENT_HAVE_X86 1
+#  include <immintrin.h>
+#endif /* __GNUC__ && x86 */
+
+
+/*
+ * Local functions...
+ */
+static void orient_tile_scalar(const unsigned char *src, int src_bpl,
+                               unsigned char *dst, int dst_bpl);
+
+/*
+ * Globals...
+ */
+static pthread_once_t KernelOnce = PTHREAD_ONCE_INIT;
+static orient_kernel_t Kernel = orient_tile_scalar;
+static const char   *KernelName = "scalar";
+static unsigned char BitReverse[256];   /* Bits of each byte reversed */
+
+
+/*
+ * 'orient_block()' - Transpose one 8x8 block of bits.
+ *
+ * rows[0] is the top line; afterwards rows[i] holds column i, top pixel
+ * first.
+ */
+static inline void
+orient_block(unsigned char rows[8])     /* IO - Block */
+{
+  uint64_t      x, t;                   /* Block and swapped bits */
+  int           i;                      /* Looping var */
+
+
+  for (i = 0, x = 0; i < 8; i ++)
+    x = (x << 8) | rows[i];
+
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+  x = x ^ t ^ (t << 28);
+
+  for (i = 7; i >= 0; i --, x >>= 8)
+    rows[i] = (unsigned char)x;
+}
+
+
+/*
+ * 'orient_edge()' - Transpose a tile 8x8 block by block.
+ *
+ * Lines past the bottom are blank and columns past the right edge are not
+ * written.
+ */
+static void
+orient_edge(const unsigned char *src,   /* I - Top left of tile */
+            int                 src_bpl,/* I - Bytes per source line */
+            int                 pixels, /* I - Columns left in source */
+            int                 lines,  /* I - Lines left in source */
+            unsigned char       *dst,   /* O - Top left of tile in dst */
+            int                 dst_bpl)/* I - Bytes per dst line */
+{
+  unsigned char rows[8];                /* Current block */
+  int           x, y, i;                /* Looping vars */
+
+
+  for (y = 0; y < ORIENT_TILE && y < lines; y += 8)
+    for (x = 0; x < pixels; x += 8)
+    {
+      for (i = 0; i < 8; i ++)
+        rows[i] = y + i < lines ? src[(size_t)(y + i) * src_bpl + x / 8] : 0;
+
+      orient_block(rows);
+
+      for (i = 0; i < 8 && x + i < pixels; i ++)
+        dst[(size_t)(x + i) * dst_bpl + y / 8] = rows[i];
+    }
+}
+
+
+/*
+ * 'orient_tile_scalar()' - Portable tile kernel.
+ */
+static void
+orient_tile_scalar(const unsigned char *src,    /* I - Top left of tile */
+                   int                 src_bpl, /* I - Bytes per source line */
+                   unsigned char       *dst,    /* O - Top left in dst */
+                   int                 dst_bpl) /* I - Bytes per dst line */
+{
+  orient_edge(src, src_bpl, ORIENT_TILE * 8, ORIENT_TILE, dst, dst_bpl);
+}
+
+
+#ifdef ORIENT_HAVE_X86
+/*
+ * 'orient_tile_sse2()' - SSE2 tile kernel.
+ *
+ * After the four unpack stages v[k] holds byte k of all 16 lines; each
+ * movemask then gives one column of pixels, and adding the vector to
+ * itself moves the next column up to the sign bits.
+ */
+__attribute__((target("sse2")))
+static void
+orient_tile_sse2(const unsigned char *src,      /* I - Top left of tile */
+                 int                 src_bpl,   /* I - Bytes per source line */
+                 unsigned char       *dst,      /* O - Top left in dst */
+                 int                 dst_bpl)   /* I - Bytes per dst line */
+{
+  __m128i       v[16], a[16], b[16];    /* Tile, unpack stages */
+  unsigned      m;                      /* Column mask */
+  unsigned char *d;                     /* Output position */
+  int           i, g, bit;              /* Looping vars */
+
+
+  for (i = 0; i < 16; i ++)
+    v[i] = _mm_loadu_si128((const __m128i *)(src + (size_t)i * src_bpl));
+
+  for (i = 0; i < 8; i ++)
+  {
+    a[i]     = _mm_unpacklo_epi8(v[2 * i], v[2 * i + 1]);
+    a[i + 8] = _mm_unpackhi_epi8(v[2 * i], v[2 * i + 1]);
+  }
+
+  for (i = 0; i < 4; i ++)
+  {
+    b[i]      = _mm_unpacklo_epi16(a[2 * i], a[2 * i + 1]);
+    b[i + 4]  = _mm_unpackhi_epi16(a[2 * i], a[2 * i + 1]);
+    b[i + 8]  = _mm_unpacklo_epi16(a[8 + 2 * i], a[9 + 2 * i]);
+    b[i + 12] = _mm_unpackhi_epi16(a[8 + 2 * i], a[9 + 2 * i]);
+  }
+
+  for (g = 0; g < 4; g ++)
+  {
+    a[4 * g]     = _mm_unpacklo_epi32(b[4 * g], b[4 * g + 1]);
+    a[4 * g + 1] = _mm_unpackhi_epi32(b[4 * g], b[4 * g + 1]);
+    a[4 * g + 2] = _mm_unpacklo_epi32(b[4 * g + 2], b[4 * g + 3]);
+    a[4 * g + 3] = _mm_unpackhi_epi32(b[4 * g + 2], b[4 * g + 3]);
+  }
+
+  for (g = 0; g < 4; g ++)
+  {
+    v[4 * g]     = _mm_unpacklo_epi64(a[4 * g], a[4 * g + 2]);
+    v[4 * g + 1] = _mm_unpackhi_epi64(a[4 * g], a[4 * g + 2]);
+    v[4 * g + 2] = _mm_unpacklo_epi64(a[4 * g + 1], a[4 * g + 3]);
+    v[4 * g + 3] = _mm_unpackhi_epi64(a[4 * g + 1], a[4 * g + 3]);
+  }
+
+  for (i = 0; i < 16; i ++)
+    for (bit = 0; bit < 8; bit ++)
+    {
+      m    = (unsigned)_mm_movemask_epi8(v[i]);
+      d    = dst + (size_t)(8 * i + bit) * dst_bpl;
+      d[0] = BitReverse[m & 255];
+      d[1] = BitReverse[m >> 8];
+      v[i] = _mm_add_epi8(v[i], v[i]);
+    }
+}
+#endif /* ORIENT_HAVE_X86 */
+
+
+/*
+ * 'ORIENTTranspose()' - Transpose a bitmap.
+ *
+ * Row x of dst (pixels rows of (lines + 7) / 8 bytes) gets column x of
+ * src (lines rows).
+ */
+void
+ORIENTTranspose(const unsigned char *src,       /* I - Source bitmap */
+                int                 src_bpl,    /* I - Bytes per source line */
+                int                 pixels,     /* I - Pixels per source line */
+                int                 lines,      /* I - Source lines */
+                unsigned char       *dst,       /* O - Transposed bitmap */
+                int                 dst_bpl)    /* I - Bytes per dst line */
+{
+  int           x, y;                   /* Tile position */
+  int           edge;                   /* Pixels in column of tiles */
+  const unsigned char *s;               /* Tile in source */
+  unsigned char *d;                     /* Tile in dst */
+
+
+  for (x = 0; x < (pixels + 7) / 8; x += ORIENT_TILE)
+  {
+    edge = pixels - x * 8 < ORIENT_TILE * 8 ? pixels - x * 8 : ORIENT_TILE * 8;
+
+    for (y = 0; y < lines; y += ORIENT_TILE)
+    {
+      s = src + (size_t)y * src_bpl + x;
+      d = dst + (size_t)x * 8 * dst_bpl + y / 8;
+
+      if (y + ORIENT_TILE > lines || edge < ORIENT_TILE * 8)
+        orient_edge(s, src_bpl, edge, lines - y, d, dst_bpl);
+      else
+        (*Kernel)(s, src_bpl, d, dst_bpl);
+    }
+  }
+}
+
+
+/*
+ * 'ORIENTMirrorLine()' - Reverse the pixels of a line.
+ *
+ * in and out must not overlap.  Bits past the last pixel of in are
+ * ignored and cleared in out.
+ */
+void
+ORIENTMirrorLine(const unsigned char *in,       /* I - Line */
+                 int                 pixels,    /* I - Pixels per line */
+                 unsigned char       *out)      /* O - Mirrored line */
+{
+  int           bytes;                  /* Bytes per line */
+  int           shift;                  /* Unused bits in last byte */
+  int           i;                      /* Looping var */
+  unsigned      bits;                   /* Reversed bytes */
+
+
+  bytes = (pixels + 7) / 8;
+  shift = bytes * 8 - pixels;
+
+  if (!shift)
+  {
+    for (i = 0; i < bytes; i ++)
+      out[i] = BitReverse[in[bytes - 1 - i]];
+    return;
+  }
+
+ /*
+  * The reversed line starts with the padding bits, shift them out...
+  */
+  for (i = 0; i < bytes; i ++)
+  {
+    bits = (unsigned)BitReverse[in[bytes - 1 - i]] << 8;
+    if (i + 1 < bytes)
+      bits |= BitReverse[in[bytes - 2 - i]];
+
+    out[i] = (unsigned char)(bits >> (8 - shift));
+  }
+}
+
+
+/*
+ * 'ORIENTInvertLine()' - Invert the pixels of a line.
+ *
+ * Bits past the last pixel stay clear.
+ */
+void
+ORIENTInvertLine(unsigned char *line,   /* IO - Line */
+                 int           pixels)  /* I - Pixels per line */
+{
+  int           i;                      /* Looping var */
+
+
+  for (i = 0; i < pixels / 8; i ++)
+    line[i] ^= 0xff;
+
+  if (pixels & 7)
+    line[i] = (unsigned char)((line[i] ^ 0xff) & (0xff00 >> (pixels & 7)));
+}
+
+
+/*
+ * 'orient_select_kernel()' - Fill in the table and choose the kernel.
+ */
+static void
+orient_select_kernel(void)
+{
+  const char        *force;         /* TOPIX_KERNEL environment variable */
+  int               m, b;           /* Byte, bit */
+
+
+  for (m = 0; m < 256; m++)
+    for (b = 0, BitReverse[m] = 0; b < 8; b++)
+      if (m & (1 << b))
+        BitReverse[m] |= 0x80 >> b;
+
+  force      = getenv("TOPIX_KERNEL");
+  Kernel     = orient_tile_scalar;
+  KernelName = "scalar";
+
+#ifdef ORIENT_HAVE_X86
+  __builtin_cpu_init();
+
+  if ((!force || strcmp(force, "scalar")) && __builtin_cpu_supports("sse2"))
+  {
+    Kernel     = orient_tile_sse2;
+    KernelName = "sse2";
+  }
+#else
+  (void)force;
+#endif /* ORIENT_HAVE_X86 */
+}
+
+
+/*
+ * 'ORIENTSelectKernel()' - Choose the fastest tile kernel for this CPU.
+ *
+ * The choice is made once per process; later calls do nothing.
+ */
+void
+ORIENTSelectKernel(void)
+{
+  pthread_once(&KernelOnce, orient_select_kernel);
+}
+
+
+/*
+ * 'ORIENTKernelName()' - Name of the tile kernel in use.
+ */
+const char *
+ORIENTKernelName(void)
+{
+  return (KernelName);
+}
@@ -0,0 +1,51 @@
+/*
+ *   Bitmap rotation and mirroring for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ORIENT_H_
+#define _ORIENT_H_
+
+/*
+ * Bitmaps are 1 bit per pixel, most significant bit first.  Any rotation
+ * is a transpose followed by flipping the rows and/or their order.
+ * ORIENTSelectKernel() must be called before the other functions.
+ */
+
+/*
+ * Pages are transposed in tiles of ORIENT_TILE lines by ORIENT_TILE bytes,
+ * which stay in the L1 cache, working down a column of tiles at a time so
+ * that the lines being written stay cached too.
+ */
+#define ORIENT_TILE       16
+
+/*
+ * Tile kernel: transpose a whole tile, row x of dst gets column x of src.
+ */
+typedef void (*orient_kernel_t)(const unsigned char *src, int src_bpl,
+                                unsigned char *dst, int dst_bpl);
+
+extern void         ORIENTTranspose(const unsigned char *src, int src_bpl,
+                                    int pixels, int lines,
+                                    unsigned char *dst, int dst_bpl);
+extern void         ORIENTMirrorLine(const unsigned char *in, int pixels,
+                                     unsigned char *out);
+extern void         ORIENTInvertLine(unsigned char *line, int pixels);
+extern void         ORIENTSelectKernel(void);
+extern const char   *ORIENTKernelName(void);
+
+#endif /* !_ORIENT_H_ */
@@ -0,0 +1,217 @@
+/*
+ *   Buffered file descriptor output for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   tpclOutputNew()    - Create an output for a file descriptor.
+ *   tpclOutputDelete() - Flush and free an output.
+ *   tpclOutputWrite()  - Write data, buffering small writes.
+ *   tpclOutputFlush()  - Send any buffered data.
+ *   tpclOutputStats()  - Get the number of system calls and bytes.
+ *
+ *   output_writev()    - Write all of an I/O vector.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "output.h"
+
+
+/*
+ * Writes smaller than this are buffered...
+ */
+#define OUTPUT_BUFFER_SIZE  4096
+
+
+/*
+ * Output structure...
+ */
+struct tpcl_output_s
+{
+  int           fd;                     /* File descriptor */
+  int           error;                  /* Non-zero after a write error */
+  long          calls;                  /* write()/writev() calls */
+  long          bytes;                  /* Bytes written */
+  size_t        used;                   /* Bytes in buffer */
+  unsigned char buffer[OUTPUT_BUFFER_SIZE];
+                                        /* Pending small writes */
+};
+
+
+/*
+ * Local functions...
+ */
+static int      output_writev(tpcl_output_t *out, struct iovec *iov, int count);
+
+
+/*
+ * 'tpclOutputNew()' - Create an output for a file descriptor.
+ */
+tpcl_output_t *                         /* O - Output or NULL */
+tpclOutputNew(int fd)                   /* I - File descriptor */
+{
+  tpcl_output_t *out;                   /* New output */
+
+
+  if ((out = calloc(1, sizeof(tpcl_output_t))) != NULL)
+    out->fd = fd;
+
+  return (out);
+}
+
+
+/*
+ * 'tpclOutputDelete()' - Flush and free an output.
+ */
+void
+tpclOutputDelete(tpcl_output_t *out)    /* I - Output */
+{
+  if (!out)
+    return;
+
+  tpclOutputFlush(out);
+  free(out);
+}
+
+
+/*
+ * 'tpclOutputWrite()' - Write data, buffering small writes.
+ *
+ * A NULL data pointer flushes the buffer, as for any tpcl_write_cb_t.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclOutputWrite(void       *user_data,  /* I - Output */
+                const void *data,       /* I - Data or NULL to flush */
+                size_t     len)         /* I - Length of data */
+{
+  tpcl_output_t *out = (tpcl_output_t *)user_data;
+  struct iovec  iov[2];                 /* Buffered and new data */
+
+
+  if (!data)
+    return (tpclOutputFlush(out));
+
+  if (out->error)
+    return (-1);
+
+  if (out->used + len <= sizeof(out->buffer))
+  {
+    memcpy(out->buffer + out->used, data, len);
+    out->used += len;
+    return (0);
+  }
+
+  iov[0].iov_base = out->buffer;
+  iov[0].iov_len  = out->used;
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len  = len;
+
+  if (out->used)
+  {
+    out->used = 0;
+    return (output_writev(out, iov, 2));
+  }
+  else
+    return (output_writev(out, iov + 1, 1));
+}
+
+
+/*
+ * 'tpclOutputFlush()' - Send any buffered data.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclOutputFlush(tpcl_output_t *out)     /* I - Output */
+{
+  struct iovec  iov;                    /* Buffered data */
+
+
+  if (out->error)
+    return (-1);
+
+  if (!out->used)
+    return (0);
+
+  iov.iov_base = out->buffer;
+  iov.iov_len  = out->used;
+  out->used    = 0;
+
+  return (output_writev(out, &iov, 1));
+}
+
+
+/*
+ * 'tpclOutputStats()' - Get the number of system calls and bytes.
+ */
+void
+tpclOutputStats(tpcl_output_t *out,     /* I - Output */
+                long          *calls,   /* O - write()/writev() calls */
+                long          *bytes)   /* O - Bytes written */
+{
+  *calls = out->calls;
+  *bytes = out->bytes;
+}
+
+
+/*
+ * 'output_writev()' - Write all of an I/O vector.
+ */
+static int                              /* O - 0 on success, -1 on error */
+output_writev(tpcl_output_t *out,       /* I - Output */
+              struct iovec  *iov,       /* I - I/O vector */
+              int           count)      /* I - Number of entries */
+{
+  ssize_t       bytes;                  /* Bytes written */
+
+
+  while (count > 0)
+  {
+    out->calls ++;
+
+    if ((bytes = writev(out->fd, iov, count)) < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+
+      out->error = 1;
+      return (-1);
+    }
+
+    out->bytes += bytes;
+
+   /*
+    * Skip what was written, partial writes are rare...
+    */
+    while (count > 0 && (size_t)bytes >= iov->iov_len)
+    {
+      bytes -= (ssize_t)iov->iov_len;
+      iov ++;
+      count --;
+    }
+
+    if (count > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + bytes;
+      iov->iov_len  -= (size_t)bytes;
+    }
+  }
+
+  return (0);
+}
@@ -0,0 +1,40 @@
+/*
+ *   Buffered file descriptor output for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TPCL_OUTPUT_H_
+#define _TPCL_OUTPUT_H_
+
+#include <stddef.h>
+
+/*
+ * Small writes (commands) are collected in a buffer; a large write (a
+ * graphics object) is sent together with whatever is buffered in a single
+ * writev() call.  tpclOutputWrite() is a tpcl_write_cb_t.
+ */
+typedef struct tpcl_output_s tpcl_output_t;
+
+extern tpcl_output_t  *tpclOutputNew(int fd);
+extern void           tpclOutputDelete(tpcl_output_t *out);
+extern int            tpclOutputWrite(void *user_data, const void *data,
+                                      size_t len);
+extern int            tpclOutputFlush(tpcl_output_t *out);
+extern void           tpclOutputStats(tpcl_output_t *out, long *calls,
+                                      long *bytes);
+
+#endif /* !_TPCL_OUTPUT_H_ */
@@ -0,0 +1,555 @@
+/*
+ *   Native CUPS raster reader for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   tpclRasterOpen()       - Open a raster stream for reading.
+ *   tpclRasterClose()      - Close a raster stream.
+ *   tpclRasterMapped()     - Is the stream mapped into memory?
+ *   tpclRasterReadHeader() - Read the header of the next page.
+ *   tpclRasterReadLine()   - Get the next line of the page.
+ *   tpclRasterReadLines()  - Get the next line and its repeats.
+ *   tpclRasterReadPixels() - Copy pixels of the page, like libcups.
+ *
+ *   raster_need()          - Make bytes of the stream available.
+ *   raster_decode()        - Decode a run length compressed line.
+ *
+ * The stream is used through one window: the whole file when it is
+ * mapped, otherwise a buffer of at least RASTER_READAHEAD bytes that is
+ * refilled when a header or line reaches past its end.  Lines returned
+ * from the window stay valid until the next call.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "raster.h"
+
+
+/*
+ * Sync words, as read on this host...
+ */
+#define RASTER_SYNC_V1      0x52615374  /* "RaSt", uncompressed */
+#define RASTER_SYNC_V2      0x52615332  /* "RaS2", compressed */
+#define RASTER_SYNC_V3      0x52615333  /* "RaS3", uncompressed */
+#define RASTER_REVSYNC_V1   0x74536152  /* Same, other byte order */
+#define RASTER_REVSYNC_V2   0x32536152
+#define RASTER_REVSYNC_V3   0x33536152
+
+#define RASTER_READAHEAD    (4 * 1024 * 1024)
+
+
+/*
+ * Stream structure...
+ */
+struct tpcl_raster_s
+{
+  int                 fd;               /* File descriptor */
+  int                 swapped;          /* Other byte order? */
+  int                 compressed;       /* Version 2 stream? */
+  unsigned char       *map;             /* Mapped file or NULL */
+  size_t              map_size;         /* Size of mapping */
+  unsigned char       *buffer;          /* Read buffer */
+  size_t              bufsize;          /* Size of read buffer */
+  const unsigned char *data;            /* Window, map or buffer */
+  size_t              pos,              /* Position in window */
+                      len;              /* Bytes in window */
+  int                 eof;              /* No more bytes to read? */
+  cups_page_header2_t header;           /* Current page header */
+  unsigned            bpp;              /* Bytes per run length pixel */
+  unsigned            lines;            /* Lines left in the page */
+  unsigned            count;            /* Repeats left of line */
+  unsigned char       *line;            /* Decoded line */
+  const unsigned char *current;         /* Line being copied or NULL */
+  unsigned            offset;           /* Bytes of current copied */
+};
+
+
+/*
+ * Local functions...
+ */
+static const unsigned char *raster_need(tpcl_raster_t *ras, size_t bytes);
+static int  raster_decode(tpcl_raster_t *ras);
+
+
+/*
+ * 'tpclRasterOpen()' - Open a raster stream for reading.
+ *
+ * Returns NULL if the stream does not start with a CUPS raster sync word.
+ * The file descriptor is not closed by tpclRasterClose().
+ */
+tpcl_raster_t *                         /* O - Stream or NULL */
+tpclRasterOpen(int fd)                  /* I - File descriptor */
+{
+  tpcl_raster_t       *ras;             /* New stream */
+  struct stat         info;             /* File info */
+  off_t               offset;           /* Current position in file */
+  const unsigned char *ptr;             /* Sync word */
+  uint32_t            sync;             /* Sync word */
+  void                *map;             /* Mapping */
+
+
+  if ((ras = calloc(1, sizeof(tpcl_raster_t))) == NULL)
+    return (NULL);
+
+  ras->fd = fd;
+
+  /*
+   * Map regular files, starting where the descriptor is...
+   */
+  if (!fstat(fd, &info) && S_ISREG(info.st_mode) && info.st_size > 0 &&
+      (offset = lseek(fd, 0, SEEK_CUR)) >= 0 && offset < info.st_size &&
+      (map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd,
+                  0)) != MAP_FAILED)
+  {
+    madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+
+    ras->map      = map;
+    ras->map_size = (size_t)info.st_size;
+    ras->data     = ras->map;
+    ras->pos      = (size_t)offset;
+    ras->len      = ras->map_size;
+    ras->eof      = 1;
+  }
+
+  if ((ptr = raster_need(ras, sizeof(sync))) == NULL)
+  {
+    tpclRasterClose(ras);
+    return (NULL);
+  }
+
+  memcpy(&sync, ptr, sizeof(sync));
+  ras->pos += sizeof(sync);
+
+  switch (sync)
+  {
+    case RASTER_SYNC_V2 :
+        ras->compressed = 1;
+        /* Fall through */
+    case RASTER_SYNC_V1 :
+    case RASTER_SYNC_V3 :
+        break;
+
+    case RASTER_REVSYNC_V2 :
+        ras->compressed = 1;
+        /* Fall through */
+    case RASTER_REVSYNC_V1 :
+    case RASTER_REVSYNC_V3 :
+        ras->swapped = 1;
+        break;
+
+    default :
+        tpclRasterClose(ras);
+        return (NULL);
+  }
+
+  return (ras);
+}
+
+
+/*
+ * 'tpclRasterClose()' - Close a raster stream.
+ */
+void
+tpclRasterClose(tpcl_raster_t *ras)     /* I - Stream */
+{
+  if (!ras)
+    return;
+
+  if (ras->map)
+    munmap(ras->map, ras->map_size);
+
+  free(ras->buffer);
+  free(ras->line);
+  free(ras);
+}
+
+
+/*
+ * 'tpclRasterMapped()' - Is the stream mapped into memory?
+ */
+int                                     /* O - 1 if mapped, 0 if read */
+tpclRasterMapped(tpcl_raster_t *ras)    /* I - Stream */
+{
+  return (ras->map != NULL);
+}
+
+
+/*
+ * 'tpclRasterReadHeader()' - Read the header of the next page.
+ *
+ * Lines of the last page that were not read are skipped.
+ */
+unsigned                                /* O - 1 on success, 0 at end */
+tpclRasterReadHeader(tpcl_raster_t       *ras,    /* I - Stream */
+                     cups_page_header2_t *header) /* O - Page header */
+{
+  const unsigned char *ptr;             /* Header in window */
+  uint32_t            *word, temp;      /* Swapped words */
+  size_t              i;                /* Looping var */
+
+
+  if (!ras)
+    return (0);
+
+  while (ras->lines)
+    if (!tpclRasterReadLine(ras))
+      return (0);
+
+  if ((ptr = raster_need(ras, sizeof(cups_page_header2_t))) == NULL)
+    return (0);
+
+  memcpy(&ras->header, ptr, sizeof(cups_page_header2_t));
+  ras->pos += sizeof(cups_page_header2_t);
+
+  /*
+   * Every number from AdvanceDistance to the end of cupsReal is a 32 bit
+   * integer or float...
+   */
+  if (ras->swapped)
+  {
+    word = &ras->header.AdvanceDistance;
+
+    for (i = (offsetof(cups_page_header2_t, cupsString) -
+              offsetof(cups_page_header2_t, AdvanceDistance)) / 4;
+         i > 0; i --, word ++)
+    {
+      temp  = *word;
+      *word = (temp >> 24) | ((temp >> 8) & 0xff00) |
+              ((temp << 8) & 0xff0000) | (temp << 24);
+    }
+  }
+
+  if (ras->header.cupsColorOrder == CUPS_ORDER_CHUNKED)
+    ras->bpp = (ras->header.cupsBitsPerPixel + 7) / 8;
+  else
+    ras->bpp = (ras->header.cupsBitsPerColor + 7) / 8;
+
+  if (ras->header.cupsBitsPerPixel > 240 ||
+      ras->header.cupsBitsPerColor > 16 ||
+      ras->header.cupsBytesPerLine == 0 || ras->header.cupsHeight == 0 ||
+      ras->bpp == 0 || (ras->header.cupsBytesPerLine % ras->bpp))
+    return (0);
+
+  if (ras->compressed)
+  {
+    free(ras->line);
+    if ((ras->line = malloc(ras->header.cupsBytesPerLine)) == NULL)
+      return (0);
+  }
+
+  ras->lines   = ras->header.cupsHeight;
+  ras->count   = 0;
+  ras->current = NULL;
+
+  memcpy(header, &ras->header, sizeof(cups_page_header2_t));
+
+  return (1);
+}
+
+
+/*
+ * 'tpclRasterReadLine()' - Get the next line of the page.
+ *
+ * The line is cupsBytesPerLine bytes and stays valid until the next call
+ * for the stream.
+ */
+const unsigned char *                   /* O - Line or NULL at end of page */
+tpclRasterReadLine(tpcl_raster_t *ras)  /* I - Stream */
+{
+  const unsigned char *line;            /* Line */
+
+
+  if (!ras || !ras->lines)
+    return (NULL);
+
+  if (ras->compressed)
+  {
+    if (!ras->count && raster_decode(ras))
+    {
+      ras->lines = 0;
+      return (NULL);
+    }
+
+    ras->count --;
+    line = ras->line;
+  }
+  else
+  {
+    if ((line = raster_need(ras, ras->header.cupsBytesPerLine)) == NULL)
+    {
+      ras->lines = 0;
+      return (NULL);
+    }
+
+    ras->pos += ras->header.cupsBytesPerLine;
+  }
+
+  ras->lines --;
+
+  return (line);
+}
+
+
+/*
+ * 'tpclRasterReadLines()' - Get the next line and its repeats.
+ *
+ * Like tpclRasterReadLine(), but also consumes the repeats of a compressed
+ * line, so the line stands for *count lines of the page.
+ */
+const unsigned char *                   /* O - Line or NULL at end of page */
+tpclRasterReadLines(tpcl_raster_t *ras, /* I - Stream */
+                    unsigned      *count)       /* O - Number of lines */
+{
+  const unsigned char *line;            /* Line */
+  unsigned      repeats;                /* Repeats also consumed */
+
+
+  *count = 0;
+
+  if ((line = tpclRasterReadLine(ras)) == NULL)
+    return (NULL);
+
+  if (ras->compressed)
+  {
+    if ((repeats = ras->count) > ras->lines)
+      repeats = ras->lines;
+
+    ras->count -= repeats;
+    ras->lines -= repeats;
+    *count      = repeats;
+  }
+
+  *count += 1;
+
+  return (line);
+}
+
+
+/*
+ * 'tpclRasterReadPixels()' - Copy pixels of the page, like libcups.
+ *
+ * The length does not need to be a whole number of lines.
+ */
+unsigned                                /* O - Bytes copied or 0 on error */
+tpclRasterReadPixels(tpcl_raster_t *ras,        /* I - Stream */
+                     unsigned char *pixels,     /* O - Pixels */
+                     unsigned      len)         /* I - Bytes to copy */
+{
+  unsigned      done, bytes;            /* Bytes copied */
+
+
+  for (done = 0; done < len; done += bytes)
+  {
+    if (!ras->current)
+    {
+      if ((ras->current = tpclRasterReadLine(ras)) == NULL)
+        return (0);
+
+      ras->offset = 0;
+    }
+
+    if ((bytes = ras->header.cupsBytesPerLine - ras->offset) > len - done)
+      bytes = len - done;
+
+    memcpy(pixels + done, ras->current + ras->offset, bytes);
+
+    if ((ras->offset += bytes) == ras->header.cupsBytesPerLine)
+      ras->current = NULL;
+  }
+
+  return (len);
+}
+
+
+/*
+ * 'raster_need()' - Make bytes of the stream available.
+ *
+ * Mapped streams only check the length.  Otherwise what is left of the
+ * buffer is moved to its start and each read asks for as much as fits,
+ * so most calls find their bytes already there, but only waits for the
+ * bytes needed.
+ */
+static const unsigned char *            /* O - Bytes at pos or NULL */
+raster_need(tpcl_raster_t *ras,         /* I - Stream */
+            size_t        bytes)        /* I - Bytes needed */
+{
+  unsigned char *temp;                  /* New buffer */
+  size_t        size;                   /* New buffer size */
+  ssize_t       got;                    /* Bytes read */
+
+
+  if (ras->len - ras->pos >= bytes)
+    return (ras->data + ras->pos);
+
+  if (ras->eof)
+    return (NULL);
+
+  if (ras->pos)
+  {
+    memmove(ras->buffer, ras->buffer + ras->pos, ras->len - ras->pos);
+    ras->len -= ras->pos;
+    ras->pos  = 0;
+  }
+
+  if (bytes > ras->bufsize)
+  {
+    for (size = RASTER_READAHEAD; size < bytes; size *= 2);
+
+    if ((temp = realloc(ras->buffer, size)) == NULL)
+      return (NULL);
+
+    ras->buffer  = temp;
+    ras->bufsize = size;
+    ras->data    = temp;
+  }
+
+  while (ras->len < bytes)
+  {
+    if ((got = read(ras->fd, ras->buffer + ras->len,
+                    ras->bufsize - ras->len)) > 0)
+      ras->len += (size_t)got;
+    else if (got == 0)
+    {
+      ras->eof = 1;
+      break;
+    }
+    else if (errno != EINTR && errno != EAGAIN)
+    {
+      ras->eof = 1;
+      break;
+    }
+  }
+
+  return (ras->len >= bytes ? ras->data : NULL);
+}
+
+
+/*
+ * 'raster_decode()' - Decode a run length compressed line.
+ *
+ * A line starts with its repeat count less one, followed by runs: 0 to
+ * 127 repeats the next pixel 1 to 128 times, 129 to 255 copies 128 to 2
+ * literal pixels and 128 clears the rest of the line.  Runs are cut at
+ * the end of the line, as libcups does.
+ */
+static int                              /* O - 0 on success, -1 on error */
+raster_decode(tpcl_raster_t *ras)       /* I - Stream */
+{
+  const unsigned char *ptr;             /* Stream bytes */
+  unsigned char       *temp;            /* Position in line */
+  unsigned            bpp = ras->bpp;   /* Bytes per pixel */
+  unsigned            bytes,            /* Bytes left in line */
+                      count,            /* Bytes in run */
+                      i;                /* Looping var */
+  int                 white;            /* Fill byte for cleared pixels */
+
+
+  if ((ptr = raster_need(ras, 1)) == NULL)
+    return (-1);
+
+  ras->count = (unsigned)*ptr + 1;
+  ras->pos ++;
+
+  for (temp = ras->line, bytes = ras->header.cupsBytesPerLine; bytes > 0;)
+  {
+    if ((ptr = raster_need(ras, 1)) == NULL)
+      return (-1);
+
+    ras->pos ++;
+
+    if (*ptr == 128)
+    {
+      switch (ras->header.cupsColorSpace)
+      {
+        case CUPS_CSPACE_W :
+        case CUPS_CSPACE_RGB :
+        case CUPS_CSPACE_SW :
+        case CUPS_CSPACE_SRGB :
+        case CUPS_CSPACE_RGBW :
+        case CUPS_CSPACE_ADOBERGB :
+            white = 0xff;
+            break;
+        default :
+            white = 0x00;
+            break;
+      }
+
+      memset(temp, white, bytes);
+      bytes = 0;
+    }
+    else if (*ptr & 128)
+    {
+      if ((count = (257 - (unsigned)*ptr) * bpp) > bytes)
+        count = bytes;
+
+      if ((ptr = raster_need(ras, count)) == NULL)
+        return (-1);
+
+      memcpy(temp, ptr, count);
+      ras->pos += count;
+      temp     += count;
+      bytes    -= count;
+    }
+    else
+    {
+      if ((count = ((unsigned)*ptr + 1) * bpp) > bytes)
+        count = bytes;
+
+      if (count < bpp)
+        break;
+
+      if ((ptr = raster_need(ras, bpp)) == NULL)
+        return (-1);
+
+      if (bpp == 1)
+        memset(temp, *ptr, count);
+      else
+        for (i = 0; i < count; i += bpp)
+          memcpy(temp + i, ptr, bpp);
+
+      ras->pos += bpp;
+      temp     += count;
+      bytes    -= count;
+    }
+  }
+
+  /*
+   * 16 bit samples are in the byte order of the stream...
+   */
+  if (ras->swapped &&
+      (ras->header.cupsBitsPerColor == 16 ||
+       ras->header.cupsBitsPerPixel == 12 ||
+       ras->header.cupsBitsPerPixel == 16))
+  {
+    for (temp = ras->line, bytes = ras->header.cupsBytesPerLine / 2;
+         bytes > 0; bytes --, temp += 2)
+    {
+      count   = temp[0];
+      temp[0] = temp[1];
+      temp[1] = (unsigned char)count;
+    }
+  }
+
+  return (0);
+}
@@ -0,0 +1,48 @@
+/*
+ *   Native CUPS raster reader for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TPCL_RASTER_H_
+#define _TPCL_RASTER_H_
+
+#include <cups/raster.h>
+
+/*
+ * Reads version 1, 2 (run length compressed) and 3 CUPS raster streams in
+ * either byte order, like cupsRasterReadHeader2() and
+ * cupsRasterReadPixels().  Regular files are mapped into memory and other
+ * descriptors are read in large blocks.  Lines of uncompressed pages are
+ * returned where they lie in the mapping or the read buffer, without
+ * copying; compressed lines are decoded once for all of their repeats.
+ */
+typedef struct tpcl_raster_s tpcl_raster_t;
+
+extern tpcl_raster_t  *tpclRasterOpen(int fd);
+extern void           tpclRasterClose(tpcl_raster_t *ras);
+extern int            tpclRasterMapped(tpcl_raster_t *ras);
+
+extern unsigned       tpclRasterReadHeader(tpcl_raster_t *ras,
+                                           cups_page_header2_t *header);
+extern const unsigned char *tpclRasterReadLine(tpcl_raster_t *ras);
+extern const unsigned char *tpclRasterReadLines(tpcl_raster_t *ras,
+                                                unsigned *count);
+extern unsigned       tpclRasterReadPixels(tpcl_raster_t *ras,
+                                           unsigned char *pixels,
+                                           unsigned len);
+
+#endif /* !_TPCL_RASTER_H_ */
@@ -26,17 +26,52 @@
  *  Base version by Patrick Kong, 2009-07-21
  *  TOPIX Compression added by Sam Lown, 2010-05-24
  *
+ *  Encoding split out into libtpcl, 2010
+ *
  * Contents:
  *
- *   Setup()        - Prepare the printer for printing.
+ *   GetOptions()   - Resolve the PPD options into library settings and
+ *                    filter options.
+ *   OptionsKey()   - Build the key of the job's options in the options cache.
+ *   RasterOpen()   - Open the raster input.
+ *   RasterClose()  - Close the raster input.
+ *   RasterReadHeader() - Read the header of the next page.
+ *   RasterReadPixels() - Read pixels into a buffer.
+ *   RasterReadLine() - Get the next line, copied only when needed.
+ *   RasterReadLines() - Get the next line and the number of times it repeats.
+ *   Setup()        - Create the library job and prepare the printer.
  *   StartPage()    - Start a page of graphics.
+ *   ShowHeader()   - Show the page device dictionary.
  *   EndPage()      - Finish a page of graphics.
+ *   SetTermHandler() - Set the SIGTERM handler.
  *   CancelJob()    - Cancel the current job...
- *   OutputLine()   - Output a line of graphics.
+ *   WriteOutput()  - Library write callback, sends data to stdout.
+ *   LogOutput()    - Log the writes made for a page.
+ *   RecordPage()   - Record the telemetry of a page.
+ *   RecordSerial() - Record a page read, encoded and written in turn.
+ *   LogDebug()     - Library log callback, queues DEBUG messages.
+ *   PrintPages()   - Read, encode and send every page in turn.
+ *   PrintPagesMerged() - Print runs of identical pages as one issue.
+ *   PrintPagesPipelined() - Read, encode and send pages on three threads.
+ *   QueueOutput()  - Library write callback for the pipelined mode.
+ *   EncodeThread() - Pipeline stage turning raster lines into TPCL.
+ *   WriteThread()  - Pipeline stage writing TPCL to stdout.
+ *   PrintPagesParallel() - Read pages ahead and encode them on a worker pool.
+ *   PageOutput()   - Library write callback for the parallel mode.
+ *   PageEncodeThread() - Worker encoding whole pages.
+ *   PageWriteThread() - Write encoded pages to stdout in page order.
+ *   BatchAdd()     - Add a raster file to the batch.
+ *   BatchFile()    - Find or add a file seen in a spool directory.
+ *   BatchScan()    - Add the new raster files in a directory.
+ *   BatchOutputName() - Name the TPCL file for a raster file.
+ *   BatchOutput()  - Library write callback for the batch mode.
+ *   BatchConvert() - Convert one raster file of the batch.
+ *   BatchThread()  - Worker converting raster files of the batch.
+ *   PrintBatch()   - Convert many raster files, several at a time.
  *   main()         - Main entry and processing of driver.
  *
- *   TOPIXCompress() - Compress output into TEC's TOPIX format.
- *   TOPIXCompressOutputBuffer() - Send current contents of TOPIX data to stdout.
+ * All of the TPCL command generation and TOPIX compression is done by
+ * libtpcl (tpcl.c and topix.c); this filter only deals with CUPS.
  *
  * This driver should support all Toshiba TEC Label Printers with support for TPCL (TEC
  * Printer Command Language) and TOPIX Compression for graphics. 
@@ -46,757 +81,2407 @@
 #include <cups/cups.h>
 #include <cups/raster.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "tpcl.h"
+#include "ring.h"
+#include "cache.h"
+#include "output.h"
+#include "telemetry.h"
+#include "log.h"
+#include "options.h"
+#include "raster.h"
+
+
+/*
+ * Raster input, read by libtpcl or by libcups when $TPCL_RASTER is "cups".
+ */
+typedef struct raster_s
+{
+  tpcl_raster_t *native;        /* Native reader or NULL */
+  cups_raster_t *cups;          /* libcups reader or NULL */
+} raster_t;
+
+
+/*
+ * Pipeline slot types and sizes.  Line slots also carry the page header,
+ * lines wider than a slot are split across several.
+ */
+#define PIPE_HEADER       0     /* cups_page_header2_t */
+#define PIPE_LINE         1     /* Part of a raster line */
+#define PIPE_END          2     /* End of page */
+#define PIPE_DATA         3     /* TPCL output */
+#define PIPE_DONE         4     /* No more slots */
+#define PIPE_FLUSH        5     /* Flush output */
+
+#define PIPE_LINE_SLOTS   256
+#define PIPE_LINE_SIZE    4096
+#define PIPE_DATA_SLOTS   64
+#define PIPE_DATA_SIZE    16384
+
+typedef struct pipeline_s
+{
+  tpcl_ring_t   *lines;         /* Reader to encoder */
+  tpcl_ring_t   *blocks;        /* Encoder to writer */
+  int           write_error;    /* Non-zero if stdout failed */
+  double        queue_time;     /* Encoder time blocked on the writer */
+} pipeline_t;
+
+
+/*
+ * Largest page kept in memory to compare with the next one.
+ */
+#define MERGE_MAX_SIZE    (64 * 1024 * 1024)
+
+
+/*
+ * Parallel page encoding.  Pages are read ahead into a window of
+ * PAGES_PER_THREAD slots per worker, page n using slot n % window.
+ */
+#define PAGES_PER_THREAD  2
+#define PAGES_MAX_THREADS 64
+
+#define PAGE_EMPTY        0     /* Slot is free */
+#define PAGE_READY        1     /* Raster read, waiting for a worker */
+#define PAGE_ENCODING     2     /* Being encoded */
+#define PAGE_DONE         3     /* TPCL ready to write */
+
+typedef struct page_s
+{
+  int                 state;    /* PAGE_xxx */
+  cups_page_header2_t header;   /* Page header */
+  unsigned char       *raster;  /* Page bitmap */
+  unsigned            lines;    /* Lines read */
+  unsigned char       *data;    /* Encoded TPCL */
+  size_t              datalen,  /* Bytes of TPCL */
+                      datasize; /* Size of data buffer */
+  size_t              memory;   /* Bytes counted against the limit */
+  int                 canceled; /* Page ended with {WR} */
+  tpcl_page_metrics_t metrics;  /* Telemetry */
+} page_t;
+
+typedef struct pages_s
+{
+  pthread_mutex_t     lock;     /* Protects everything below */
+  pthread_cond_t      cond;     /* Signalled on any state change */
+  tpcl_settings_t     settings; /* Settings for worker jobs */
+  page_t              *pages;   /* Window of pages */
+  int                 window;   /* Number of slots */
+  int                 threads;  /* Number of workers */
+  int                 num_read, /* Pages read */
+                      num_workers, /* Workers started */
+                      num_started, /* Pages handed to workers */
+                      num_encoding, /* Pages being encoded */
+                      num_written; /* Pages written */
+  int                 eof;      /* No more pages will be read */
+  size_t              memory,   /* Bytes in the window */
+                      max_memory; /* Memory limit */
+  int                 write_error; /* Non-zero if stdout failed */
+  tpcl_cache_t        *cache;   /* Encoded page cache or NULL */
+} pages_t;
 
 
 /*
- * Model number constants...
+ * Batch conversion of many raster files.  Workers take the next file
+ * from the list, each with its own library job.  Files found in spool
+ * directories are remembered with their size and time so a watched
+ * directory only queues files that stopped changing, and retries the
+ * ones whose conversion failed.
  */
-#define INTSIZE		20 			/* MAXIMUM CHARACTERS INTEGER */
+typedef struct batch_file_s
+{
+  char                *name;    /* Raster file */
+  off_t               size;     /* Size at the last scan */
+  time_t              mtime;    /* Modification time at the last scan */
+  int                 queued;   /* Non-zero if in this round's inputs */
+} batch_file_t;
+
+typedef struct batch_s
+{
+  pthread_mutex_t     lock;     /* Protects everything below */
+  char                **inputs; /* Raster files */
+  int                 num_inputs, /* Number of files */
+                      alloc_inputs, /* Allocated files */
+                      next;     /* Next file to convert */
+  batch_file_t        *files;   /* Files seen in spool directories */
+  int                 num_files, /* Number of files seen */
+                      alloc_files; /* Allocated files seen */
+  int                 watch;    /* Seconds between scans or 0 */
+  const char          *outdir;  /* Output directory or NULL */
+  int                 converted, /* Files converted */
+                      failed,   /* Files that failed */
+                      pages;    /* Pages converted */
+  long                raster_bytes, /* Raster bytes read */
+                      output_bytes; /* TPCL bytes written */
+} batch_t;
+
+typedef struct batch_worker_s
+{
+  batch_t             *batch;   /* Batch */
+  tpcl_job_t          *job;     /* Library job, kept for every file */
+  tpcl_output_t       *output;  /* Output of the current file */
+  pthread_t           thread;   /* Worker thread */
+  int                 started;  /* Thread started? */
+} batch_worker_t;
+
 
 /*
- * TEC Graphics Modes
+ * Thread numbers in the trace...
  */
-#define TEC_GMODE_TOPIX   3
-#define TEC_GMODE_HEX_AND 1
-#define TEC_GMODE_HEX_OR  5
+#define TRACE_READ        1     /* Raster reading */
+#define TRACE_WRITE       2     /* Output */
+#define TRACE_ENCODE      3     /* First encoder */
 
 
 /*
  * Globals...
  */
-static unsigned char	*Buffer;		     /* Output buffer */
-static unsigned char	*LastBuffer;		 /* Last buffer */
-static unsigned char  *CompBuffer;     /* Byte array of whole image */
-unsigned char         *CompBufferPtr;  /* Pointer to current position in CompBuffer */
-int   CompLastLine;   /* Last line number sent to TOPIX output */
+tpcl_job_t  *Job;           /* Library job being printed */
+tpcl_output_t *Output;      /* Buffered stdout */
+long  OutputCalls,    /* Writes logged so far */
+      OutputBytes;    /* Bytes logged so far */
+tpcl_telemetry_t *Telemetry;  /* Telemetry or NULL */
+double WriteTime;     /* Seconds spent in write calls */
 int   Page,           /* Current page */
-      Feed,           /* Number of lines to skip */
-      Canceled,		    /* Non-zero if job is canceled */
-      Gmode; 			    /* Tec Graphics mode */
-
-int		ModelNumber; 		/* cupsModelNumber attribute (not currently in use) */
+      Canceled;		    /* Non-zero if job is canceled */
 
 /*
  * Prototypes...
  */
-void Setup(ppd_file_t *ppd);
-void StartPage(ppd_file_t *ppd, cups_page_header2_t *header);
-void EndPage(ppd_file_t *ppd, cups_page_header2_t *header);
+void GetOptions(ppd_file_t *ppd, tpcl_options_t *options);
+raster_t *RasterOpen(int fd);
+void RasterClose(raster_t *ras);
+unsigned RasterReadHeader(raster_t *ras, cups_page_header2_t *header);
+unsigned RasterReadPixels(raster_t *ras, unsigned char *pixels, unsigned len);
+const unsigned char *RasterReadLine(raster_t *ras, unsigned char *buffer,
+                                    unsigned len);
+const unsigned char *RasterReadLines(raster_t *ras, unsigned char *buffer,
+                                     unsigned len, unsigned *count);
+int  OptionsKey(int num_options, cups_option_t *options, char *key,
+                size_t keysize);
+tpcl_job_t *Setup(const tpcl_settings_t *settings, tpcl_write_cb_t cb,
+                  void *user_data);
+void StartPage(cups_page_header2_t *header);
+void ShowHeader(cups_page_header2_t *header);
+void EndPage(cups_page_header2_t *header);
+void SetTermHandler(void (*handler)(int));
 void CancelJob(int sig);
-void OutputLine(ppd_file_t *ppd, cups_page_header2_t *header, int y);
-
-void TOPIXCompress(ppd_file_t *ppd, cups_page_header2_t *header, int y);
-void TOPIXCompressOutputBuffer(ppd_file_t *ppd, cups_page_header2_t *header, int y);
+int  WriteOutput(void *user_data, const void *data, size_t len);
+void LogOutput(int page);
+void RecordPage(tpcl_job_t *job, int page, int copies, long raster_bytes,
+                double read_time, double encode_time, double write_time);
+double RecordSerial(tpcl_job_t *job, int page, int copies, long raster_bytes,
+                    double start, double read_time, double write_start);
+void LogDebug(void *user_data, const char *message);
+int  PrintPages(raster_t *ras, const tpcl_settings_t *settings);
+int  PrintPagesMerged(raster_t *ras, const tpcl_settings_t *settings);
+int  PrintPagesPipelined(raster_t *ras, const tpcl_settings_t *settings);
+int  QueueOutput(void *user_data, const void *data, size_t len);
+void *EncodeThread(void *data);
+void *WriteThread(void *data);
+int  PrintPagesParallel(raster_t *ras, const tpcl_settings_t *settings,
+                        int threads, size_t max_memory, tpcl_cache_t *cache);
+int  PageOutput(void *user_data, const void *data, size_t len);
+void *PageEncodeThread(void *data);
+void *PageWriteThread(void *data);
+int  BatchAdd(batch_t *batch, const char *filename);
+batch_file_t *BatchFile(batch_t *batch, const char *filename);
+int  BatchScan(batch_t *batch, const char *directory);
+void BatchOutputName(batch_t *batch, const char *input, char *filename,
+                     size_t size);
+int  BatchOutput(void *user_data, const void *data, size_t len);
+int  BatchConvert(batch_worker_t *worker, const char *input);
+void *BatchThread(void *data);
+int  PrintBatch(int num_files, char *files[], const tpcl_options_t *options);
 
 /*
- * 'Setup()' - Prepare the printer for printing.
+ * 'GetOptions()' - Resolve the PPD options into library settings and
+ *                  filter options.
  */
-void Setup(ppd_file_t *ppd)			/* I - PPD file */
+void
+GetOptions(ppd_file_t     *ppd,         /* I - PPD file */
+           tpcl_options_t *options)     /* O - Options */
 {
-  char		*Fadjm;			/* Fine adjust printing position */
-  char		*Radj;			/* Ribbon adjust parameter */
+  tpcl_settings_t *settings = &options->settings;
   ppd_choice_t	*choice;		/* Marked choice */
-  /* initialize Fadjm */
-  Fadjm = (char *) malloc(INTSIZE +2); /* Advanced parameters for printer */
-  Radj  = (char *) malloc(INTSIZE +2); /* Ribbon ajust parameter */
+  ppd_choice_t	*sign;		  /* Marked sign choice */
 
-  /*
-   * Get the model number from the PPD file.
-   * This is not yet used for anything.
-   */
-  ModelNumber = ppd->model_number;
-  
-  /*
-   * Always send a reset command. Helps with reliability on failed jobs.
-   */
-  puts("{WS|}");
 
-  /*  
-   * Modification to take in consideration feed ajust reverse feed etc
-   */
-  strcpy(Fadjm,"{AX;"); /* Place command start */
-  /* feed adjust */
-  choice = ppdFindMarkedChoice(ppd, "FAdjSgn");
-  switch (atoi(choice->choice))
+  memset(options, 0, sizeof(tpcl_options_t));
+  tpclDefaultSettings(settings);
+
+  if ((choice = ppdFindMarkedChoice(ppd, "Gap")) != NULL)
+    settings->gap = atoi(choice->choice);
+
+  if ((choice = ppdFindMarkedChoice(ppd, "teMediaTracking")) != NULL)
+    settings->media_tracking = atoi(choice->choice);
+
+  if ((choice = ppdFindMarkedChoice(ppd, "tePrintMode")) != NULL)
+    settings->print_mode = atoi(choice->choice);
+
+  if ((choice = ppdFindMarkedChoice(ppd, "tePrintRate")) != NULL)
+    settings->print_rate = atoi(choice->choice);
+
+  if ((choice = ppdFindMarkedChoice(ppd, "PrintOrient")) != NULL)
+    settings->print_orient = atoi(choice->choice);
+
+  /* Get graphics mode from ppd file for graphics drawing */
+  if ((choice = ppdFindMarkedChoice(ppd, "teGraphicsMode")) != NULL)
   {
-    case 0 :
-      strcat(Fadjm,"+");
-      break;
-    case 1 :
-      strcat(Fadjm,"-");
-      break;
-    default :
-      strcat(Fadjm,"+");
-      break;
+    switch (atoi(choice->choice)) {
+      case 4:
+        settings->graphics_mode = TEC_GMODE_AUTO; // TOPIX or raw per object
+        break;
+      case 3:
+        settings->graphics_mode = TEC_GMODE_HEX_OR; // OR drawing hex mode
+        break;
+      case 2:
+        settings->graphics_mode = TEC_GMODE_HEX_AND; // AND drawing hex mode
+        break;
+      case 1:
+      default:
+        settings->graphics_mode = TEC_GMODE_TOPIX;
+    }
   }
+
+  /* Dithering of grayscale pages (ColorModel Gray) */
+  if ((choice = ppdFindMarkedChoice(ppd, "teDither")) != NULL)
+    settings->dither = atoi(choice->choice);
+
+  /* Rotation of the labels in the filter */
+  if ((choice = ppdFindMarkedChoice(ppd, "teRotate")) != NULL)
+    settings->rotate = atoi(choice->choice);
+
+  /* Only send what changed since the last label */
+  if ((choice = ppdFindMarkedChoice(ppd, "teIncremental")) != NULL)
+    settings->incremental = atoi(choice->choice) == 1;
+
+  /*  
+   * Feed adjust, cut or peel adjust and back feed adjust, sign choice 1 is "-".
+   */
+  sign   = ppdFindMarkedChoice(ppd, "FAdjSgn");
   choice = ppdFindMarkedChoice(ppd, "FAdjV");
-  strcat(Fadjm,choice->choice);
-  
-  /* Cut adjust peel adjust */
-  choice = ppdFindMarkedChoice(ppd, "CAdjSgn");
-  switch (atoi(choice->choice))
-  {
-    case 0 :
-      strcat(Fadjm,",+");
-      break;
-    case 1 :
-      strcat(Fadjm,",-");
-      break;
-    default :
-      strcat(Fadjm,",+");
-      break;
-  }
+  if (choice)
+    snprintf(settings->feed_adjust, sizeof(settings->feed_adjust), "%c%s",
+             sign && atoi(sign->choice) == 1 ? '-' : '+', choice->choice);
+
+  sign   = ppdFindMarkedChoice(ppd, "CAdjSgn");
   choice = ppdFindMarkedChoice(ppd, "CAdjV");
-  strcat(Fadjm,choice->choice);
+  if (choice)
+    snprintf(settings->cut_adjust, sizeof(settings->cut_adjust), "%c%s",
+             sign && atoi(sign->choice) == 1 ? '-' : '+', choice->choice);
+
+  sign   = ppdFindMarkedChoice(ppd, "RAdjSgn");
+  choice = ppdFindMarkedChoice(ppd, "RAdjV");
+  if (choice)
+    snprintf(settings->back_adjust, sizeof(settings->back_adjust), "%c%s",
+             sign && atoi(sign->choice) == 1 ? '-' : '+', choice->choice);
+
+  /* Ribbon Motor setup parameters */
+  if ((choice = ppdFindMarkedChoice(ppd, "RbnAdjFwd")) != NULL)
+    snprintf(settings->ribbon_fwd, sizeof(settings->ribbon_fwd), "%s", choice->choice);
+  if ((choice = ppdFindMarkedChoice(ppd, "RbnAdjBck")) != NULL)
+    snprintf(settings->ribbon_back, sizeof(settings->ribbon_back), "%s", choice->choice);
+
+  /*
+   * Options of the filter itself...
+   */
+  if ((choice = ppdFindMarkedChoice(ppd, "teDebugLog")) != NULL)
+    options->debug_log = atoi(choice->choice) == 1;
+
+  options->threads = 1;
+  if ((choice = ppdFindMarkedChoice(ppd, "teThreads")) != NULL)
+    options->threads = atoi(choice->choice);
+
+  options->memory_limit = 256;
+  if ((choice = ppdFindMarkedChoice(ppd, "teMemoryLimit")) != NULL &&
+      atoi(choice->choice) > 0)
+    options->memory_limit = atoi(choice->choice);
+
+  if ((choice = ppdFindMarkedChoice(ppd, "tePageCache")) != NULL &&
+      atoi(choice->choice) > 0)
+    options->page_cache = atoi(choice->choice);
+
+  if ((choice = ppdFindMarkedChoice(ppd, "teMergePages")) != NULL)
+    options->merge_pages = atoi(choice->choice) == 1;
+
+  if ((choice = ppdFindMarkedChoice(ppd, "tePipeline")) != NULL)
+    options->pipeline = atoi(choice->choice) == 1;
+}
+
+
+/*
+ * 'OptionsKey()' - Build the key of the job's options in the options cache.
+ *
+ * Attributes that CUPS adds to every job, such as its UUID and times,
+ * cannot change the PPD options and are left out so that jobs with the
+ * same options share a key.
+ */
+int                                     /* O - 0 on success, -1 if too long */
+OptionsKey(int           num_options,   /* I - Number of options */
+           cups_option_t *options,      /* I - Options */
+           char          *key,          /* O - Key */
+           size_t        keysize)       /* I - Size of key */
+{
+  int           i;                      /* Looping var */
+  size_t        len;                    /* Length of key */
+  int           bytes;                  /* Length of option */
+
 
-  /* back feed adjust */
-  choice = ppdFindMarkedChoice(ppd, "RAdjSgn");
-  switch (atoi(choice->choice))
+  for (i = 0, len = 0, key[0] = '\0'; i < num_options; i ++)
   {
-    case 0 :
-      strcat(Fadjm,",+");
-      break;
-    case 1 :
-      strcat(Fadjm,",-");
-      break;
-    default :
-      strcat(Fadjm,",+");
-      break;
+    if (!strncmp(options[i].name, "job-", 4) ||
+        !strncmp(options[i].name, "time-at-", 8) ||
+        !strncmp(options[i].name, "date-time-at-", 13) ||
+        !strncmp(options[i].name, "document-", 9))
+      continue;
+
+    bytes = snprintf(key + len, keysize - len, "%s=%s\n", options[i].name,
+                     options[i].value);
+    if (bytes < 0 || (size_t)bytes >= keysize - len)
+      return (-1);
+
+    len += (size_t)bytes;
   }
 
-  choice = ppdFindMarkedChoice(ppd, "RAdjV");
-  strcat(Fadjm,choice->choice);
-  
-  /* close the command */
-  strcat(Fadjm,"|}");
-  /* send the command */
-  puts(Fadjm); /*send advanced parameters */
+  return (0);
+}
+
+
+/*
+ * 'RasterOpen()' - Open the raster input.
+ *
+ * The native reader is used unless $TPCL_RASTER is "cups".  Files it
+ * does not recognize are given to libcups instead.
+ */
+raster_t *                    /* O - Raster input or NULL */
+RasterOpen(int fd)            /* I - File descriptor */
+{
+  raster_t      *ras;         /* Raster input */
+  const char    *reader;      /* $TPCL_RASTER */
+  off_t         start;        /* Start of the raster in a file */
+
+
+  if ((ras = calloc(1, sizeof(raster_t))) == NULL)
+    return (NULL);
+
+  start = lseek(fd, 0, SEEK_CUR);
 
-  /* Send ribbon Motor setup parameters */
-  strcpy(Radj,"{RM;");	/* start command for ribbon */
-  choice = ppdFindMarkedChoice(ppd, "RbnAdjFwd");
-  strcat(Radj,choice->choice); /* value for take up motor */
-  choice = ppdFindMarkedChoice(ppd, "RbnAdjBck");
-  strcat(Radj,choice->choice);
-  strcat(Radj,"|}");
-  puts(Radj);
+  if ((reader = getenv("TPCL_RASTER")) == NULL || strcmp(reader, "cups"))
+  {
+    if ((ras->native = tpclRasterOpen(fd)) != NULL)
+    {
+      tpclLogDebug("Reading raster natively%s",
+                   tpclRasterMapped(ras->native) ? " from a mapped file" : "");
+      return (ras);
+    }
+
+    if (start < 0 || lseek(fd, start, SEEK_SET) < 0)
+      return (ras);
+  }
+
+  ras->cups = cupsRasterOpen(fd, CUPS_RASTER_READ);
+  tpclLogDebug("Reading raster with libcups");
 
+  return (ras);
 }
 
 
 /*
- * 'StartPage()' - Start a page of graphics.
+ * 'RasterClose()' - Close the raster input.
  */
 void
-StartPage(ppd_file_t         *ppd,	/* I - PPD file */
-          cups_page_header2_t *header)	/* I - Page header */
-{
-  ppd_choice_t  *choice;		/* Marked choice */
-  int           labelgap;		/* length of labelgap */
-  int           labelpitch; /* label pitch, distance from start of one label to the next */
-  int         	length;			/* Effective label length */
-  int 		      width;			/* Effective label width */
-  char		      *Fadjt;			/* Fine adjust temperature */
-  
-#if defined(HAVE_SIGACTION) && !defined(HAVE_SIGSET)
-  struct sigaction action;		/* Actions for POSIX signals */
-#endif /* HAVE_SIGACTION && !HAVE_SIGSET */
+RasterClose(raster_t *ras)    /* I - Raster input */
+{
+  if (!ras)
+    return;
+
+  if (ras->native)
+    tpclRasterClose(ras->native);
+  if (ras->cups)
+    cupsRasterClose(ras->cups);
+
+  free(ras);
+}
+
+
+/*
+ * 'RasterReadHeader()' - Read the header of the next page.
+ */
+unsigned                      /* O - 1 on success, 0 at end */
+RasterReadHeader(raster_t            *ras,    /* I - Raster input */
+                 cups_page_header2_t *header) /* O - Page header */
+{
+  if (ras && ras->native)
+    return (tpclRasterReadHeader(ras->native, header));
+  else if (ras && ras->cups)
+    return (cupsRasterReadHeader2(ras->cups, header));
+  else
+    return (0);
+}
+
+
+/*
+ * 'RasterReadPixels()' - Read pixels into a buffer.
+ */
+unsigned                      /* O - Bytes read or 0 on error */
+RasterReadPixels(raster_t      *ras,    /* I - Raster input */
+                 unsigned char *pixels, /* O - Pixels */
+                 unsigned      len)     /* I - Bytes to read */
+{
+  if (ras->native)
+    return (tpclRasterReadPixels(ras->native, pixels, len));
+  else
+    return (cupsRasterReadPixels(ras->cups, pixels, len));
+}
+
+
+/*
+ * 'RasterReadLine()' - Get the next line, copied only when needed.
+ *
+ * libcups copies the line into the buffer; the native reader returns it
+ * where it already is, in the mapped file, its read buffer or its
+ * decoded line.
+ */
+const unsigned char *         /* O - Line or NULL at end of page */
+RasterReadLine(raster_t      *ras,      /* I - Raster input */
+               unsigned char *buffer,   /* I - Buffer for a copy */
+               unsigned      len)       /* I - Bytes per line */
+{
+  if (ras->native)
+    return (tpclRasterReadLine(ras->native));
+  else if (cupsRasterReadPixels(ras->cups, buffer, len) < 1)
+    return (NULL);
+  else
+    return (buffer);
+}
+
+
+/*
+ * 'RasterReadLines()' - Get the next line and the number of times it repeats.
+ *
+ * The native reader hands over the repeats of a compressed line at once;
+ * libcups lines always count once.
+ */
+const unsigned char *         /* O - Line or NULL at end of page */
+RasterReadLines(raster_t      *ras,     /* I - Raster input */
+                unsigned char *buffer,  /* I - Buffer for a copy */
+                unsigned      len,      /* I - Bytes per line */
+                unsigned      *count)   /* O - Number of lines */
+{
+  if (ras->native)
+    return (tpclRasterReadLines(ras->native, count));
+
+  *count = 1;
+
+  return (RasterReadLine(ras, buffer, len));
+}
+
+
+/*
+ * 'Setup()' - Create the library job and prepare the printer.
+ */
+tpcl_job_t *                  /* O - New job */
+Setup(const tpcl_settings_t *settings,	/* I - Job settings */
+      tpcl_write_cb_t cb,       /* I - Output callback */
+      void            *user_data) /* I - Output callback data */
+{
+  tpcl_job_t    *job;         /* New job */
+
 
-  Fadjt = (char *) malloc(INTSIZE +2);
+  if ((job = tpclJobNew(settings, cb, user_data)) == NULL)
+    return (NULL);
+
+  if (tpclLogDebugEnabled())
+    tpclJobSetLog(job, LogDebug, NULL);
 
   /*
-   * Show page device dictionary...
+   * Send the reset, adjust and ribbon commands.
    */
-  fprintf(stderr, "DEBUG: StartPage...\n");
-  fprintf(stderr, "DEBUG: MediaClass = \"%s\"\n", header->MediaClass);
-  fprintf(stderr, "DEBUG: MediaColor = \"%s\"\n", header->MediaColor);
-  fprintf(stderr, "DEBUG: MediaType = \"%s\"\n", header->MediaType);
-  fprintf(stderr, "DEBUG: OutputType = \"%s\"\n", header->OutputType);
-
-  fprintf(stderr, "DEBUG: AdvanceDistance = %d\n", header->AdvanceDistance);
-  fprintf(stderr, "DEBUG: AdvanceMedia = %d\n", header->AdvanceMedia);
-  fprintf(stderr, "DEBUG: Collate = %d\n", header->Collate);
-  fprintf(stderr, "DEBUG: CutMedia = %d\n", header->CutMedia);
-  fprintf(stderr, "DEBUG: Duplex = %d\n", header->Duplex);
-  fprintf(stderr, "DEBUG: HWResolution = [ %d %d ]\n", header->HWResolution[0],
-          header->HWResolution[1]);
-  fprintf(stderr, "DEBUG: ImagingBoundingBox = [ %d %d %d %d ]\n",
-          header->ImagingBoundingBox[0], header->ImagingBoundingBox[1],
-          header->ImagingBoundingBox[2], header->ImagingBoundingBox[3]);
-  fprintf(stderr, "DEBUG: InsertSheet = %d\n", header->InsertSheet);
-  fprintf(stderr, "DEBUG: Jog = %d\n", header->Jog);
-  fprintf(stderr, "DEBUG: LeadingEdge = %d\n", header->LeadingEdge);
-  fprintf(stderr, "DEBUG: Margins = [ %d %d ]\n", header->Margins[0],
-          header->Margins[1]);
-  fprintf(stderr, "DEBUG: ManualFeed = %d\n", header->ManualFeed);
-  fprintf(stderr, "DEBUG: MediaPosition = %d\n", header->MediaPosition);
-  fprintf(stderr, "DEBUG: MediaWeight = %d\n", header->MediaWeight);
-  fprintf(stderr, "DEBUG: MirrorPrint = %d\n", header->MirrorPrint);
-  fprintf(stderr, "DEBUG: NegativePrint = %d\n", header->NegativePrint);
-  fprintf(stderr, "DEBUG: NumCopies = %d\n", header->NumCopies);
-  fprintf(stderr, "DEBUG: Orientation = %d\n", header->Orientation);
-  fprintf(stderr, "DEBUG: OutputFaceUp = %d\n", header->OutputFaceUp);
-  fprintf(stderr, "DEBUG: cupsPageSize = [ %f %f ]\n", header->cupsPageSize[0],
-          header->cupsPageSize[1]);
-  fprintf(stderr, "DEBUG: Separations = %d\n", header->Separations);
-  fprintf(stderr, "DEBUG: TraySwitch = %d\n", header->TraySwitch);
-  fprintf(stderr, "DEBUG: Tumble = %d\n", header->Tumble);
-  fprintf(stderr, "DEBUG: cupsWidth = %d\n", header->cupsWidth);
-  fprintf(stderr, "DEBUG: cupsHeight = %d\n", header->cupsHeight);
-  fprintf(stderr, "DEBUG: cupsMediaType = %d\n", header->cupsMediaType);
-  fprintf(stderr, "DEBUG: cupsBitsPerColor = %d\n", header->cupsBitsPerColor);
-  fprintf(stderr, "DEBUG: cupsBitsPerPixel = %d\n", header->cupsBitsPerPixel);
-  fprintf(stderr, "DEBUG: cupsBytesPerLine = %d\n", header->cupsBytesPerLine);
-  fprintf(stderr, "DEBUG: cupsColorOrder = %d\n", header->cupsColorOrder);
-  fprintf(stderr, "DEBUG: cupsColorSpace = %d\n", header->cupsColorSpace);
-  fprintf(stderr, "DEBUG: cupsCompression = %d\n", header->cupsCompression);
+  tpclJobSetup(job);
+
+  return (job);
+}
+
+
+/*
+ * 'StartPage()' - Start a page of graphics.
+ */
+void
+StartPage(cups_page_header2_t *header)	/* I - Page header */
+{
+  ShowHeader(header);
 
   /*
    * Register a signal handler to eject the current page if the
    * job is canceled.
    */
+  SetTermHandler(CancelJob);
+
+  /*
+   * Send the label size, temperature and graphics header.
+   */
+  if (tpclPageStart(Job, header))
+    fputs("ERROR: Unable to start page!\n", stderr);
+}
+
+
+/*
+ * 'ShowHeader()' - Show the page device dictionary.
+ */
+void
+ShowHeader(cups_page_header2_t *header)	/* I - Page header */
+{
+  if (!tpclLogDebugEnabled())
+    return;
+
+  tpclLogDebug("StartPage...");
+  tpclLogDebug("MediaClass = \"%s\"", header->MediaClass);
+  tpclLogDebug("MediaColor = \"%s\"", header->MediaColor);
+  tpclLogDebug("MediaType = \"%s\"", header->MediaType);
+  tpclLogDebug("OutputType = \"%s\"", header->OutputType);
+
+  tpclLogDebug("AdvanceDistance = %d", header->AdvanceDistance);
+  tpclLogDebug("AdvanceMedia = %d", header->AdvanceMedia);
+  tpclLogDebug("Collate = %d", header->Collate);
+  tpclLogDebug("CutMedia = %d", header->CutMedia);
+  tpclLogDebug("Duplex = %d", header->Duplex);
+  tpclLogDebug("HWResolution = [ %d %d ]", header->HWResolution[0],
+               header->HWResolution[1]);
+  tpclLogDebug("ImagingBoundingBox = [ %d %d %d %d ]",
+               header->ImagingBoundingBox[0], header->ImagingBoundingBox[1],
+               header->ImagingBoundingBox[2], header->ImagingBoundingBox[3]);
+  tpclLogDebug("InsertSheet = %d", header->InsertSheet);
+  tpclLogDebug("Jog = %d", header->Jog);
+  tpclLogDebug("LeadingEdge = %d", header->LeadingEdge);
+  tpclLogDebug("Margins = [ %d %d ]", header->Margins[0],
+               header->Margins[1]);
+  tpclLogDebug("ManualFeed = %d", header->ManualFeed);
+  tpclLogDebug("MediaPosition = %d", header->MediaPosition);
+  tpclLogDebug("MediaWeight = %d", header->MediaWeight);
+  tpclLogDebug("MirrorPrint = %d", header->MirrorPrint);
+  tpclLogDebug("NegativePrint = %d", header->NegativePrint);
+  tpclLogDebug("NumCopies = %d", header->NumCopies);
+  tpclLogDebug("Orientation = %d", header->Orientation);
+  tpclLogDebug("OutputFaceUp = %d", header->OutputFaceUp);
+  tpclLogDebug("cupsPageSize = [ %f %f ]", header->cupsPageSize[0],
+               header->cupsPageSize[1]);
+  tpclLogDebug("Separations = %d", header->Separations);
+  tpclLogDebug("TraySwitch = %d", header->TraySwitch);
+  tpclLogDebug("Tumble = %d", header->Tumble);
+  tpclLogDebug("cupsWidth = %d", header->cupsWidth);
+  tpclLogDebug("cupsHeight = %d", header->cupsHeight);
+  tpclLogDebug("cupsMediaType = %d", header->cupsMediaType);
+  tpclLogDebug("cupsBitsPerColor = %d", header->cupsBitsPerColor);
+  tpclLogDebug("cupsBitsPerPixel = %d", header->cupsBitsPerPixel);
+  tpclLogDebug("cupsBytesPerLine = %d", header->cupsBytesPerLine);
+  tpclLogDebug("cupsColorOrder = %d", header->cupsColorOrder);
+  tpclLogDebug("cupsColorSpace = %d", header->cupsColorSpace);
+  tpclLogDebug("cupsCompression = %d", header->cupsCompression);
+}
+
+
+/*
+ * 'EndPage()' - Finish a page of graphics.
+ */
+void
+EndPage(cups_page_header2_t *header)	/* I - Page header */
+{
+  (void)header;
+
+  /*
+   * Flush the graphics, then eject or clear the page if canceled.
+   */
+  if (tpclPageEnd(Job))
+    fputs("ERROR: Unable to send page!\n", stderr);
+
+  /*
+   * Unregister the signal handler...
+   */
+  SetTermHandler(SIG_IGN);
+
+  tpclLogFlush();
+}
+
+
+/*
+ * 'SetTermHandler()' - Set the SIGTERM handler.
+ */
+void
+SetTermHandler(void (*handler)(int))	/* I - Handler or SIG_IGN */
+{
+#if defined(HAVE_SIGACTION) && !defined(HAVE_SIGSET)
+  struct sigaction action;		/* Actions for POSIX signals */
+#endif /* HAVE_SIGACTION && !HAVE_SIGSET */
+
+
 #ifdef HAVE_SIGSET /* Use System V signals over POSIX to avoid bugs */
-  sigset(SIGTERM, CancelJob);
+  sigset(SIGTERM, handler);
 #elif defined(HAVE_SIGACTION)
   memset(&action, 0, sizeof(action));
 
   sigemptyset(&action.sa_mask);
-  action.sa_handler = CancelJob;
+  action.sa_handler = handler;
   sigaction(SIGTERM, &action, NULL);
 #else
-  signal(SIGTERM, CancelJob);
+  signal(SIGTERM, handler);
 #endif /* HAVE_SIGSET */
+}
 
-  // printf("{XJ;Page Start|}");
-  
-  /*
-   * First paper size Dxxxx,xxxx,xxxx
-   * 
-   *   100 == 10.0mm
-   */
 
-  /* Get labelgap for printing */
-  choice = ppdFindMarkedChoice(ppd, "Gap");
-  labelgap = atoi(choice->choice) * 10;
+/*
+ * 'CancelJob()' - Cancel the current job...
+ */
+void
+CancelJob(int sig)			/* I - Signal */
+{
+ /*
+  * Tell the main loop to stop...
+  */
+  (void)sig;
+  Canceled = 1;
+  if (Job)
+    tpclJobCancel(Job);
+}
 
-  /* Calculate page widths and heights */
-  length = (int) (header->cupsPageSize[1] * 254/72);
-  labelpitch = length + labelgap;
-  width = (int) (header->cupsPageSize[0] * 254/72);
 
-  /* Send label size, assume gap is same all the way round */
-  printf("{D%04d,%04d,%04d|}\n",labelpitch, width, length, width + labelgap); 
+/*
+ * 'WriteOutput()' - Library write callback, sends data to stdout.
+ */
+int                             /* O - 0 on success, -1 on error */
+WriteOutput(void       *user_data,  /* I - Output */
+            const void *data,       /* I - Data or NULL to flush */
+            size_t     len)         /* I - Length of data */
+{
+  long    before, calls, bytes;     /* Output statistics */
+  double  start, end;               /* Times */
+  int     status;                   /* Write status */
+
 
   /*
-   * Place the right command in the parameter AY temperature fine adjust
-   * Uses number from PPD less 11.
-   */
-  switch (header->cupsCompression)
-  {
-    case 1 :
-      strcpy(Fadjt,"{AY;-10,");
-      break;
-    case 2 :
-      strcpy(Fadjt,"{AY;-09,");
-      break;
-    case 3 :
-      strcpy(Fadjt,"{AY;-08,");
-      break;
-    case 4 :
-      strcpy(Fadjt,"{AY;-07,");
-      break;
-    case 5 :
-      strcpy(Fadjt,"{AY;-06,");
-      break;
-    case 6 :
-      strcpy(Fadjt,"{AY;-05,");
-      break;
-    case 7 :
-      strcpy(Fadjt,"{AY;-04,");
-      break;
-    case 8 :
-      strcpy(Fadjt,"{AY;-03,");
-      break;
-    case 9 :
-      strcpy(Fadjt,"{AY;-02,");
-      break;
-    case 10 :
-      strcpy(Fadjt,"{AY;-01,");
-      break;
-    case 11 :
-      strcpy(Fadjt,"{AY;+00,");
-      break;
-    case 12 :
-      strcpy(Fadjt,"{AY;+01,");
-      break;
-    case 13 :
-      strcpy(Fadjt,"{AY;+02,");
-      break;
-    case 14 :
-      strcpy(Fadjt,"{AY;+03,");
-      break;
-    case 15 :
-      strcpy(Fadjt,"{AY;+04,");
-      break;
-    case 16 :
-      strcpy(Fadjt,"{AY;+05,");
-      break;
-    case 17 :
-      strcpy(Fadjt,"{AY;+06,");
-      break;
-    case 18 :
-      strcpy(Fadjt,"{AY;+07,");
-      break;
-    case 19 :
-      strcpy(Fadjt,"{AY;+08,");
-      break;
-    case 20 :
-      strcpy(Fadjt,"{AY;+09,");
-      break;
-    case 21 :
-      strcpy(Fadjt,"{AY;+10,");
-      break;
-  }
-  
-  /*
-   * Completing fine adjust according to Thermal or direct printing
+   * Commands are buffered and each graphics object goes out together
+   * with them in a single writev(), see output.c.
    */
-  if (strcmp(header->MediaType, "Direct"))
-    strcat(Fadjt,"1|}");
-  else // Thermal transfer mode, with or without ribbon saving
-    strcat(Fadjt,"0|}");
-  
+  if (!Telemetry)
+    return (tpclOutputWrite(user_data, data, len));
+
   /*
-   * Send parameter to printer
+   * Time the calls that reach the backend...
    */
-  puts(Fadjt);
+  tpclOutputStats(user_data, &before, &bytes);
+  start  = tpclTelemetryTime();
+  status = tpclOutputWrite(user_data, data, len);
+  tpclOutputStats(user_data, &calls, &bytes);
+
+  if (calls != before)
+  {
+    end       = tpclTelemetryTime();
+    WriteTime += end - start;
+    tpclTelemetryTrace(Telemetry, "write", TRACE_WRITE, 0, start, end);
+  }
+
+  return (status);
+}
+
+
+/*
+ * 'LogOutput()' - Log the writes made for a page.
+ */
+void
+LogOutput(int page)                     /* I - Page number */
+{
+  long  calls, bytes;                   /* Output totals */
+
+
+  tpclOutputStats(Output, &calls, &bytes);
+
+  tpclLogDebug("Page %d sent %ld bytes in %ld write calls", page,
+               bytes - OutputBytes, calls - OutputCalls);
+
+  OutputCalls = calls;
+  OutputBytes = bytes;
+}
+
+
+/*
+ * 'RecordPage()' - Record the telemetry of a page.
+ */
+void
+RecordPage(tpcl_job_t *job,             /* I - Job that ended the page */
+           int        page,             /* I - Page number */
+           int        copies,           /* I - Issue quantity */
+           long       raster_bytes,     /* I - Raster bytes read */
+           double     read_time,        /* I - Seconds reading */
+           double     encode_time,      /* I - Seconds encoding */
+           double     write_time)       /* I - Seconds writing */
+{
+  tpcl_page_metrics_t m;                /* Page metrics */
+
+
+  if (!Telemetry)
+    return;
+
+  m.page         = page;
+  m.copies       = copies;
+  m.raster_bytes = raster_bytes;
+  m.read_time    = read_time;
+  m.encode_time  = encode_time > 0.0 ? encode_time : 0.0;
+  m.write_time   = write_time;
+
+  tpclPageStats(job, &m.stats);
+  tpclTelemetryPage(Telemetry, &m);
+}
+
+
+/*
+ * 'RecordSerial()' - Record a page read, encoded and written in turn.
+ *
+ * The encode time is what is left of the page time after reading and
+ * writing.
+ */
+double                                  /* O - End time of the page */
+RecordSerial(tpcl_job_t *job,           /* I - Job that ended the page */
+             int        page,           /* I - Page number */
+             int        copies,         /* I - Issue quantity */
+             long       raster_bytes,   /* I - Raster bytes read */
+             double     start,          /* I - Start time of the page */
+             double     read_time,      /* I - Seconds reading */
+             double     write_start)    /* I - WriteTime at the start */
+{
+  double  end;                          /* End time */
+
+
+  if (!Telemetry)
+    return (0.0);
+
+  end = tpclTelemetryTime();
+
+  RecordPage(job, page, copies, raster_bytes, read_time,
+             end - start - read_time - (WriteTime - write_start),
+             WriteTime - write_start);
+  tpclTelemetryTrace(Telemetry, "page", TRACE_READ, page, start, end);
+
+  return (end);
+}
+
+
+/*
+ * 'LogDebug()' - Library log callback, sends DEBUG messages to stderr.
+ */
+void
+LogDebug(void       *user_data,   /* I - Unused */
+         const char *message)     /* I - Message */
+{
+  (void)user_data;
+  tpclLogDebug("%s", message);
+}
+
+
+/*
+ * 'PrintPages()' - Read, encode and send every page in turn.
+ *
+ * A threaded mode that cannot start its threads falls back to this with
+ * the job it already set up in Job.
+ */
+int                           /* O - 0 on success, -1 on error */
+PrintPages(raster_t              *ras,      /* I - Raster stream */
+           const tpcl_settings_t *settings) /* I - Job settings */
+{
+  cups_page_header2_t	header;	/* Page header from file */
+  unsigned            y,      /* Current line */
+                      count,  /* Lines read at once */
+                      progress; /* Line of the next progress message */
+  unsigned char       *buffer;  /* Line buffer */
+  const unsigned char *line;  /* Line read */
+  double              start,  /* Page start time */
+                      t,      /* Read start time */
+                      read_time,  /* Seconds reading */
+                      write_start;  /* WriteTime at page start */
+
+
+  if (!Job && (Job = Setup(settings, WriteOutput, Output)) == NULL)
+  {
+    fputs("ERROR: Unable to create job!\n", stderr);
+    return (-1);
+  }
+
+  while (RasterReadHeader(ras, &header))
+  {
+    start       = tpclTelemetryTime();
+    read_time   = 0.0;
+    write_start = WriteTime;
+
+    /*
+     * Write a status message with the page number and number of copies.
+     */
+    Page++;
+    fprintf(stderr, "PAGE: %d 1\n", Page);
+
+    /*
+     * Start the page...
+     */
+    StartPage(&header);
+
+    /*
+     * Loop for each line on the page...
+     */
+    for (y = 0, progress = 0; y < header.cupsHeight && !Canceled;
+         y += count)
+    {
+      /*
+       * Let the user know how far we have progressed...
+       */
+      if (y >= progress)
+      {
+        tpclLogProgress(Page, y, header.cupsHeight);
+        progress = (y | 15) + 1;
+      }
+
+      /*
+       * Read a line of graphics straight into the library's buffer, or
+       * use it where the native reader has it, together with the number
+       * of times a compressed raster repeats it...
+       */
+      buffer = tpclPageBuffer(Job);
+      t      = Telemetry ? tpclTelemetryTime() : 0.0;
+      if ((line = RasterReadLines(ras, buffer, header.cupsBytesPerLine,
+                                  &count)) == NULL)
+        break;
+      if (Telemetry)
+        read_time += tpclTelemetryTime() - t;
+
+      /*
+       * Write it to the printer...
+       */
+      if (tpclPageWriteRepeat(Job, line, (int)count))
+        break;
+    }
+
+    /*
+     * Eject the page...
+     */
+    EndPage(&header);
+    LogOutput(Page);
+    RecordSerial(Job, Page, (int)header.NumCopies,
+                 (long)y * header.cupsBytesPerLine, start, read_time,
+                 write_start);
+
+    if (Canceled)
+      break;
+  }
+
+  tpclJobDelete(Job);
+  Job = NULL;
+
+  return (0);
+}
+
+
+/*
+ * 'PrintPagesMerged()' - Print runs of identical pages as one issue.
+ *
+ * Applications often send the same label many times instead of asking
+ * for copies.  The last page is kept in memory and only issued once the
+ * next page is known: each following page is compared line by line while
+ * it is read, and if its header and every line match it just adds to the
+ * run, so nothing is encoded or sent.  Otherwise the run is issued with
+ * its total quantity and the new page is encoded, starting with the lines
+ * that did match.  Pages that tpclPageRepeatable() rejects (cutting only
+ * at the end of a batch) are issued on their own.
+ */
+int                           /* O - 0 on success, -1 on error */
+PrintPagesMerged(raster_t              *ras,        /* I - Raster stream */
+                 const tpcl_settings_t *settings)   /* I - Job settings */
+{
+  cups_page_header2_t	header,	/* Page header from file */
+                      held;   /* Header of the held run */
+  int                 run;    /* Pages in the held run, 0 if none */
+  unsigned            y;      /* Current line */
+  unsigned            same;   /* Lines matching the held page */
+  int                 differs;  /* Line "same" was read and differs */
+  int                 keep;   /* Keep this page for comparison? */
+  size_t              size;   /* Size of page bitmap */
+  unsigned char       *last = NULL;   /* Lines of the held page */
+  unsigned char       *line = NULL;   /* Line being compared */
+  unsigned char       *buffer;  /* Line buffer */
+  const unsigned char *pixels;  /* Line read */
+  void                *temp;  /* New buffer */
+  int                 held_page;  /* First page of the held run */
+  double              start,  /* Start time of the held run or page */
+                      t,      /* Read start time */
+                      read_time,  /* Seconds reading */
+                      write_start;  /* WriteTime at start */
+
+
+  if ((Job = Setup(settings, WriteOutput, Output)) == NULL)
+  {
+    fputs("ERROR: Unable to create job!\n", stderr);
+    return (-1);
+  }
+
+  /*
+   * A run may be held between pages, so stay cancelable throughout...
+   */
+  SetTermHandler(CancelJob);
+
+  run         = 0;
+  held_page   = 0;
+  start       = tpclTelemetryTime();
+  read_time   = 0.0;
+  write_start = WriteTime;
+
+  while (!Canceled && RasterReadHeader(ras, &header))
+  {
+    Page++;
+    fprintf(stderr, "PAGE: %d 1\n", Page);
+
+    size    = (size_t)header.cupsBytesPerLine * header.cupsHeight;
+    same    = 0;
+    differs = 0;
+
+    /*
+     * Compare with the held page...
+     */
+    if (run && !memcmp(&header, &held, sizeof(header)) &&
+        (run + 1) * (int)header.NumCopies <= TPCL_MAX_COPIES)
+    {
+      for (; same < header.cupsHeight && !Canceled; same++)
+      {
+        if ((same & 15) == 0)
+          tpclLogProgress(Page, same, header.cupsHeight);
+
+        t = Telemetry ? tpclTelemetryTime() : 0.0;
+        if (RasterReadPixels(ras, line, header.cupsBytesPerLine) < 1)
+          break;
+        if (Telemetry)
+          read_time += tpclTelemetryTime() - t;
+
+        if (memcmp(line, last + (size_t)same * header.cupsBytesPerLine,
+                   header.cupsBytesPerLine))
+        {
+          differs = 1;
+          break;
+        }
+      }
+
+      if (same == header.cupsHeight)
+      {
+        run ++;
+        continue;
+      }
+    }
+
+    /*
+     * Issue the held run...
+     */
+    if (run)
+    {
+      if (run > 1)
+        tpclLogDebug("Issuing %d identical pages as one label", run);
+
+      if (tpclPageEndCopies(Job, run * (int)held.NumCopies))
+        fputs("ERROR: Unable to send page!\n", stderr);
+      LogOutput(Page - 1);
+
+      start = RecordSerial(Job, held_page, run * (int)held.NumCopies,
+                           (long)run * held.cupsBytesPerLine * held.cupsHeight,
+                           start, read_time, write_start);
+      read_time   = 0.0;
+      write_start = WriteTime;
+
+      run = 0;
+    }
+
+    if (Canceled)
+      break;
+
+    /*
+     * Make room to keep this page, lines that matched are already there...
+     */
+    if (!same && !differs)
+    {
+      keep = size > 0 && size <= MERGE_MAX_SIZE;
+
+      if (keep && (temp = realloc(last, size)) != NULL)
+        last = temp;
+      else
+        keep = 0;
+
+      if (keep && (temp = realloc(line, header.cupsBytesPerLine)) != NULL)
+        line = temp;
+      else
+        keep = 0;
+    }
+    else
+      keep = 1;
+
+    StartPage(&header);
+
+    for (y = 0; y < same + differs; y++)
+    {
+      buffer = tpclPageBuffer(Job);
+      memcpy(buffer, y < same ? last + (size_t)y * header.cupsBytesPerLine :
+                                line, header.cupsBytesPerLine);
+      if (y == same)
+        memcpy(last + (size_t)y * header.cupsBytesPerLine, line,
+               header.cupsBytesPerLine);
+      tpclPageWriteLine(Job, buffer);
+    }
+
+    /*
+     * Read the rest of the page, keeping a copy of each line...
+     */
+    for (; y < header.cupsHeight && !Canceled; y++)
+    {
+      if ((y & 15) == 0)
+        tpclLogProgress(Page, (unsigned)y, header.cupsHeight);
+
+      buffer = tpclPageBuffer(Job);
+      t      = Telemetry ? tpclTelemetryTime() : 0.0;
+      if ((pixels = RasterReadLine(ras, buffer,
+                                   header.cupsBytesPerLine)) == NULL)
+        break;
+      if (Telemetry)
+        read_time += tpclTelemetryTime() - t;
+
+      if (keep)
+        memcpy(last + (size_t)y * header.cupsBytesPerLine, pixels,
+               header.cupsBytesPerLine);
+
+      if (tpclPageWriteLine(Job, pixels))
+        break;
+    }
+
+    /*
+     * Hold a complete page as the start of a new run, otherwise eject it...
+     */
+    if (keep && y == header.cupsHeight && !Canceled && tpclPageRepeatable(Job))
+    {
+      held      = header;
+      held_page = Page;
+      run       = 1;
+    }
+    else
+    {
+      EndPage(&header);
+      LogOutput(Page);
+      SetTermHandler(CancelJob);
+
+      start = RecordSerial(Job, Page, (int)header.NumCopies,
+                           (long)y * header.cupsBytesPerLine, start,
+                           read_time, write_start);
+      read_time   = 0.0;
+      write_start = WriteTime;
+    }
+  }
+
+  if (run)
+  {
+    if (run > 1)
+      tpclLogDebug("Issuing %d identical pages as one label", run);
+
+    if (tpclPageEndCopies(Job, run * (int)held.NumCopies))
+      fputs("ERROR: Unable to send page!\n", stderr);
+    LogOutput(Page);
+
+    RecordSerial(Job, held_page, run * (int)held.NumCopies,
+                 (long)run * held.cupsBytesPerLine * held.cupsHeight,
+                 start, read_time, write_start);
+  }
+
+  SetTermHandler(SIG_IGN);
+
+  free(last);
+  free(line);
+
+  tpclJobDelete(Job);
+  Job = NULL;
+
+  return (0);
+}
+
+
+/*
+ * 'PrintPagesPipelined()' - Read, encode and send pages on three threads.
+ *
+ * This thread decodes the raster into line slots, EncodeThread() turns
+ * them into TPCL in output slots and WriteThread() sends those to stdout,
+ * so a slow backend does not hold up decoding and a slow upstream does
+ * not leave the printer link idle.  Both rings have a fixed number of
+ * slots, which bounds the memory used.  SIGTERM is only delivered to this
+ * thread; on cancel it stops reading and ends the page, the encoder then
+ * sends the usual {WR} and both stages drain.
+ */
+int                           /* O - 0 on success, -1 on error */
+PrintPagesPipelined(raster_t              *ras,     /* I - Raster stream */
+                    const tpcl_settings_t *settings) /* I - Job settings */
+{
+  pipeline_t          pipe;   /* Pipeline state */
+  pthread_t           encoder, writer;  /* Stage threads */
+  sigset_t            mask, oldmask;    /* Signal masks */
+  cups_page_header2_t	header;	/* Page header from file */
+  unsigned            y;      /* Current line */
+  unsigned            offset; /* Offset in line */
+  unsigned            count;  /* Bytes in slot */
+  void                *slot;  /* Ring slot */
+  tpcl_page_metrics_t metrics;  /* Telemetry of the page read */
+  double              start,  /* Page start time */
+                      t;      /* Read start time */
+
+
+  memset(&pipe, 0, sizeof(pipe));
+  pipe.lines  = tpclRingNew(PIPE_LINE_SLOTS, PIPE_LINE_SIZE);
+  pipe.blocks = tpclRingNew(PIPE_DATA_SLOTS, PIPE_DATA_SIZE);
+
+  if (!pipe.lines || !pipe.blocks ||
+      (Job = Setup(settings, QueueOutput, &pipe)) == NULL)
+  {
+    fputs("ERROR: Unable to create job!\n", stderr);
+    tpclRingDelete(pipe.lines);
+    tpclRingDelete(pipe.blocks);
+    return (-1);
+  }
+
+  /*
+   * Start the stages with SIGTERM blocked so that it interrupts us.
+   */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+
+  if (pthread_create(&writer, NULL, WriteThread, &pipe))
+  {
+    /*
+     * Nothing was written, the queued job setup is dropped with the job...
+     */
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+    tpclLogDebug("Unable to start pipeline threads, printing serially");
+
+    tpclJobDelete(Job);
+    Job = NULL;
+
+    tpclRingDelete(pipe.lines);
+    tpclRingDelete(pipe.blocks);
+
+    return (PrintPages(ras, settings));
+  }
+
+  if (pthread_create(&encoder, NULL, EncodeThread, &pipe))
+  {
+    /*
+     * Encode on this thread instead, still sending through the writer...
+     */
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+    tpclLogDebug("Unable to start encoder thread, printing serially");
+
+    PrintPages(ras, settings);
+
+    tpclRingWriteSlot(pipe.blocks);
+    tpclRingPush(pipe.blocks, PIPE_DONE, 0);
+    pthread_join(writer, NULL);
+
+    if (pipe.write_error)
+      fputs("ERROR: Unable to write print data!\n", stderr);
+
+    tpclRingDelete(pipe.lines);
+    tpclRingDelete(pipe.blocks);
+
+    return (pipe.write_error ? -1 : 0);
+  }
+
+  pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+  SetTermHandler(CancelJob);
+
+  while (!Canceled && RasterReadHeader(ras, &header))
+  {
+    Page++;
+    fprintf(stderr, "PAGE: %d 1\n", Page);
+
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.page = Page;
+    start        = tpclTelemetryTime();
+
+    slot = tpclRingWriteSlot(pipe.lines);
+    memcpy(slot, &header, sizeof(header));
+    tpclRingPush(pipe.lines, PIPE_HEADER, sizeof(header));
+
+    for (y = 0; y < header.cupsHeight && !Canceled; y++)
+    {
+      if ((y & 15) == 0)
+        tpclLogProgress(Page, (unsigned)y, header.cupsHeight);
+
+      for (offset = 0; offset < header.cupsBytesPerLine; offset += count)
+      {
+        count = header.cupsBytesPerLine - offset;
+        if (count > PIPE_LINE_SIZE)
+          count = PIPE_LINE_SIZE;
+
+        slot = tpclRingWriteSlot(pipe.lines);
+        t    = Telemetry ? tpclTelemetryTime() : 0.0;
+        if (RasterReadPixels(ras, slot, count) < 1)
+          break;
+        if (Telemetry)
+          metrics.read_time += tpclTelemetryTime() - t;
+        metrics.raster_bytes += count;
+        tpclRingPush(pipe.lines, PIPE_LINE, count);
+      }
+
+      if (offset < header.cupsBytesPerLine)
+        break;
+    }
+
+    tpclTelemetryTrace(Telemetry, "read", TRACE_READ, Page, start,
+                       tpclTelemetryTime());
+
+    slot = tpclRingWriteSlot(pipe.lines);
+    memcpy(slot, &metrics, sizeof(metrics));
+    tpclRingPush(pipe.lines, PIPE_END, sizeof(metrics));
+  }
+
+  tpclRingWriteSlot(pipe.lines);
+  tpclRingPush(pipe.lines, PIPE_DONE, 0);
+
+  pthread_join(encoder, NULL);
+  pthread_join(writer, NULL);
+
+  SetTermHandler(SIG_IGN);
+
+  if (pipe.write_error)
+    fputs("ERROR: Unable to write print data!\n", stderr);
+
+  tpclJobDelete(Job);
+  Job = NULL;
+
+  tpclRingDelete(pipe.lines);
+  tpclRingDelete(pipe.blocks);
+
+  return (pipe.write_error ? -1 : 0);
+}
+
+
+/*
+ * 'QueueOutput()' - Library write callback for the pipelined mode.
+ */
+int                             /* O - 0 on success, -1 on error */
+QueueOutput(void       *user_data,  /* I - Pipeline */
+            const void *data,       /* I - Data or NULL to flush */
+            size_t     len)         /* I - Length of data */
+{
+  pipeline_t  *pipe = (pipeline_t *)user_data;
+  size_t      count;                /* Bytes in slot */
+  void        *slot;                /* Ring slot */
+  double      start;                /* Start time */
+
+
+  start = Telemetry ? tpclTelemetryTime() : 0.0;
+
+  if (!data)
+  {
+    tpclRingWriteSlot(pipe->blocks);
+    tpclRingPush(pipe->blocks, PIPE_FLUSH, 0);
+  }
+
+  for (; data && len > 0; len -= count, data = (const char *)data + count)
+  {
+    count = len > PIPE_DATA_SIZE ? PIPE_DATA_SIZE : len;
+    slot  = tpclRingWriteSlot(pipe->blocks);
+    memcpy(slot, data, count);
+    tpclRingPush(pipe->blocks, PIPE_DATA, count);
+  }
+
+  if (Telemetry)
+    pipe->queue_time += tpclTelemetryTime() - start;
+
+  return (pipe->write_error ? -1 : 0);
+}
+
+
+/*
+ * 'EncodeThread()' - Pipeline stage turning raster lines into TPCL.
+ */
+void *                          /* O - Unused */
+EncodeThread(void *data)        /* I - Pipeline */
+{
+  pipeline_t          *pipe = (pipeline_t *)data;
+  cups_page_header2_t header;   /* Current page header */
+  unsigned            offset;   /* Offset in current line */
+  int                 type;     /* Slot type */
+  size_t              len;      /* Slot length */
+  void                *slot;    /* Ring slot */
+  tpcl_page_metrics_t metrics;  /* Telemetry of the page */
+  double              start,    /* Page start time */
+                      t,        /* Call start time */
+                      encode_time,  /* Seconds in the library */
+                      queue_start;  /* queue_time at page start */
+
+
+  offset      = 0;
+  start       = 0.0;
+  encode_time = 0.0;
+  queue_start = 0.0;
+
+  for (;;)
+  {
+    slot = tpclRingReadSlot(pipe->lines, &type, &len);
+    t    = Telemetry ? tpclTelemetryTime() : 0.0;
+
+    switch (type)
+    {
+      case PIPE_HEADER :
+          memcpy(&header, slot, sizeof(header));
+          start       = t;
+          encode_time = 0.0;
+          queue_start = pipe->queue_time;
+          offset      = 0;
+
+          ShowHeader(&header);
+
+          if (tpclPageStart(Job, &header))
+            fputs("ERROR: Unable to start page!\n", stderr);
+          break;
+
+      case PIPE_LINE :
+          memcpy(tpclPageBuffer(Job) + offset, slot, len);
+          offset += len;
+          if (offset >= header.cupsBytesPerLine)
+          {
+            tpclPageWriteLine(Job, tpclPageBuffer(Job));
+            offset = 0;
+          }
+          break;
+
+      case PIPE_END :
+          memcpy(&metrics, slot, sizeof(metrics));
+
+          if (tpclPageEnd(Job))
+            fputs("ERROR: Unable to send page!\n", stderr);
+
+          tpclLogFlush();
+          break;
+
+      case PIPE_DONE :
+          tpclRingPop(pipe->lines);
+          tpclRingWriteSlot(pipe->blocks);
+          tpclRingPush(pipe->blocks, PIPE_DONE, 0);
+          return (NULL);
+    }
+
+    if (Telemetry)
+    {
+      encode_time += tpclTelemetryTime() - t;
+
+      if (type == PIPE_END)
+      {
+        RecordPage(Job, metrics.page, (int)header.NumCopies,
+                   metrics.raster_bytes, metrics.read_time,
+                   encode_time - (pipe->queue_time - queue_start),
+                   pipe->queue_time - queue_start);
+        tpclTelemetryTrace(Telemetry, "encode", TRACE_ENCODE, metrics.page,
+                           start, tpclTelemetryTime());
+      }
+    }
+
+    tpclRingPop(pipe->lines);
+  }
+}
+
+
+/*
+ * 'WriteThread()' - Pipeline stage writing TPCL to stdout.
+ *
+ * After a write error the remaining slots are still drained so the
+ * other stages never block.
+ */
+void *                          /* O - Unused */
+WriteThread(void *data)         /* I - Pipeline */
+{
+  pipeline_t          *pipe = (pipeline_t *)data;
+  const char          *ptr;     /* Data to write */
+  int                 type;     /* Slot type */
+  size_t              len;      /* Slot length */
+
+
+  for (;;)
+  {
+    ptr = tpclRingReadSlot(pipe->blocks, &type, &len);
+
+    if (type == PIPE_DONE)
+    {
+      tpclRingPop(pipe->blocks);
+      return (NULL);
+    }
+
+    if (!pipe->write_error &&
+        WriteOutput(Output, type == PIPE_FLUSH ? NULL : ptr, len))
+      pipe->write_error = 1;
+
+    tpclRingPop(pipe->blocks);
+  }
+}
+
+
+/*
+ * 'PrintPagesParallel()' - Read pages ahead and encode them on a worker pool.
+ *
+ * Every page is encoded from scratch (fresh last line and graphics
+ * buffers), so whole pages can be encoded by separate library jobs at the
+ * same time.  This thread reads pages into a window of slots, the workers
+ * encode them into memory and PageWriteThread() sends the TPCL of each
+ * page in order.  Reading blocks while the window is full or the pages
+ * held would exceed max_memory; a single page larger than the limit is
+ * still printed on its own.  With a cache, complete pages whose graphics
+ * were encoded before (in any job) are sent from the cache.
+ */
+int                           /* O - 0 on success, -1 on error */
+PrintPagesParallel(raster_t      *ras,      /* I - Raster stream */
+                   const tpcl_settings_t *settings, /* I - Job settings */
+                   int           threads,   /* I - Number of workers */
+                   size_t        max_memory,/* I - Memory limit in bytes */
+                   tpcl_cache_t  *cache)    /* I - Page cache or NULL */
+{
+  pages_t             pages;    /* Shared state */
+  pthread_t           workers[PAGES_MAX_THREADS], /* Worker threads */
+                      writer;   /* Writer thread */
+  sigset_t            mask, oldmask;    /* Signal masks */
+  cups_page_header2_t	header;	/* Page header from file */
+  page_t              *page;    /* Current page */
+  size_t              size;     /* Size of page bitmap */
+  unsigned            y;        /* Current line */
+  int                 i;        /* Looping var */
+  int                 writing,  /* Writer thread started? */
+                      started;  /* Worker threads started */
+  double              start,    /* Read start time */
+                      t;        /* Line start time */
+
+
+  if (threads > PAGES_MAX_THREADS)
+    threads = PAGES_MAX_THREADS;
+
+  memset(&pages, 0, sizeof(pages));
+  pthread_mutex_init(&pages.lock, NULL);
+  pthread_cond_init(&pages.cond, NULL);
+  pages.settings   = *settings;
+  pages.threads    = threads;
+  pages.window     = threads * PAGES_PER_THREAD;
+  pages.max_memory = max_memory;
+  pages.cache      = cache;
+
+  if ((pages.pages = calloc((size_t)pages.window, sizeof(page_t))) == NULL ||
+      (Job = Setup(settings, WriteOutput, Output)) == NULL)
+  {
+    fputs("ERROR: Unable to create job!\n", stderr);
+    free(pages.pages);
+    return (-1);
+  }
+
+  WriteOutput(Output, NULL, 0);
+
+  tpclLogDebug("Encoding pages on %d threads, %d page window, %lu MB limit",
+               threads, pages.window, (unsigned long)(max_memory >> 20));
+
+  /*
+   * Only this thread handles SIGTERM, it stops reading and the workers
+   * finish the page that was interrupted with {WR}.
+   */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+
+  writing = !pthread_create(&writer, NULL, PageWriteThread, &pages);
+
+  for (started = 0; writing && started < threads; started ++)
+    if (pthread_create(workers + started, NULL, PageEncodeThread, &pages))
+      break;
+
+  pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+  if (!started)
+  {
+    /*
+     * Without a writer or any worker, stop what did start and print with
+     * the job that already sent the setup...
+     */
+    tpclLogDebug("Unable to start encoder threads, printing serially");
+
+    if (writing)
+    {
+      pthread_mutex_lock(&pages.lock);
+      pages.eof = 1;
+      pthread_cond_broadcast(&pages.cond);
+      pthread_mutex_unlock(&pages.lock);
+
+      pthread_join(writer, NULL);
+    }
+
+    free(pages.pages);
+    pthread_cond_destroy(&pages.cond);
+    pthread_mutex_destroy(&pages.lock);
+
+    return (PrintPages(ras, settings));
+  }
+
+  if (started < threads)
+    tpclLogDebug("Only started %d of %d encoder threads", started, threads);
+
+  SetTermHandler(CancelJob);
+
+  while (!Canceled && RasterReadHeader(ras, &header))
+  {
+    Page++;
+    fprintf(stderr, "PAGE: %d 1\n", Page);
+
+    ShowHeader(&header);
+
+    size = (size_t)header.cupsBytesPerLine * header.cupsHeight;
+
+    /*
+     * Wait for a free slot and room in the memory budget...
+     */
+    pthread_mutex_lock(&pages.lock);
+    while (!pages.write_error &&
+           (pages.num_read - pages.num_written >= pages.window ||
+            (pages.num_read > pages.num_written &&
+             pages.memory + size > pages.max_memory)))
+      pthread_cond_wait(&pages.cond, &pages.lock);
+    i = pages.write_error;
+    pthread_mutex_unlock(&pages.lock);
+
+    if (i)
+      break;
+
+    page = pages.pages + pages.num_read % pages.window;
+
+    page->header   = header;
+    page->lines    = 0;
+    page->datalen  = 0;
+    page->canceled = 0;
+
+    memset(&page->metrics, 0, sizeof(page->metrics));
+    page->metrics.page   = Page;
+    page->metrics.copies = (int)header.NumCopies;
+    start                = tpclTelemetryTime();
+
+    if ((page->raster = malloc(size ? size : 1)) == NULL)
+    {
+      fputs("ERROR: Unable to allocate memory for page!\n", stderr);
+      break;
+    }
+
+    for (y = 0; y < header.cupsHeight && !Canceled; y++)
+    {
+      if ((y & 15) == 0)
+        tpclLogProgress(Page, (unsigned)y, header.cupsHeight);
+
+      t = Telemetry ? tpclTelemetryTime() : 0.0;
+      if (RasterReadPixels(ras, page->raster +
+                           (size_t)y * header.cupsBytesPerLine,
+                           header.cupsBytesPerLine) < 1)
+        break;
+      if (Telemetry)
+        page->metrics.read_time += tpclTelemetryTime() - t;
+    }
+
+    page->lines                = y;
+    page->metrics.raster_bytes = (long)y * header.cupsBytesPerLine;
+
+    tpclTelemetryTrace(Telemetry, "read", TRACE_READ, Page, start,
+                       tpclTelemetryTime());
+
+    pthread_mutex_lock(&pages.lock);
+    page->state  = PAGE_READY;
+    page->memory = size;
+    pages.memory += size;
+    pages.num_read ++;
+    pthread_cond_broadcast(&pages.cond);
+    pthread_mutex_unlock(&pages.lock);
+  }
+
+  pthread_mutex_lock(&pages.lock);
+  pages.eof = 1;
+  pthread_cond_broadcast(&pages.cond);
+  pthread_mutex_unlock(&pages.lock);
+
+  for (i = 0; i < started; i ++)
+    pthread_join(workers[i], NULL);
+  pthread_join(writer, NULL);
+
+  SetTermHandler(SIG_IGN);
+
+  if (pages.write_error)
+    fputs("ERROR: Unable to write print data!\n", stderr);
+
+  /*
+   * Free anything left over after a write error...
+   */
+  for (i = 0; i < pages.window; i ++)
+  {
+    free(pages.pages[i].raster);
+    free(pages.pages[i].data);
+  }
+
+  free(pages.pages);
+  pthread_cond_destroy(&pages.cond);
+  pthread_mutex_destroy(&pages.lock);
+
+  tpclJobDelete(Job);
+  Job = NULL;
+
+  return (pages.write_error ? -1 : 0);
+}
+
+
+/*
+ * 'PageOutput()' - Library write callback for the parallel mode.
+ */
+int                             /* O - 0 on success, -1 on error */
+PageOutput(void       *user_data,   /* I - Pointer to current page */
+           const void *data,        /* I - Data or NULL to flush */
+           size_t     len)          /* I - Length of data */
+{
+  page_t        *page = *(page_t **)user_data;
+  unsigned char *temp;              /* New data buffer */
+  size_t        size;               /* New size */
+
+
+  if (!data)
+    return (0);
+
+  if (page->datalen + len > page->datasize)
+  {
+    for (size = page->datasize ? page->datasize : 65536;
+         size < page->datalen + len;
+         size *= 2);
+
+    if ((temp = realloc(page->data, size)) == NULL)
+      return (-1);
+
+    page->data     = temp;
+    page->datasize = size;
+  }
+
+  memcpy(page->data + page->datalen, data, len);
+  page->datalen += len;
+
+  return (0);
+}
+
+
+/*
+ * 'PageEncodeThread()' - Worker encoding whole pages.
+ */
+void *                          /* O - Unused */
+PageEncodeThread(void *data)    /* I - Shared state */
+{
+  pages_t             *pages = (pages_t *)data;
+  page_t              *page;    /* Page being encoded */
+  tpcl_job_t          *job;     /* Library job for this worker */
+  tpcl_cache_key_t    key;      /* Cache key of page */
+  int                 mode;     /* Graphics and dither mode of page */
+  const void          *cached;  /* Cached graphics */
+  size_t              cachedlen;  /* Length of cached graphics */
+  size_t              start;    /* Start of graphics in page data */
+  int                 full;     /* Page was read completely? */
+  int                 worker;   /* Worker number */
+  int                 bands;    /* Band threads for this page */
+  double              t;        /* Encode start time */
+
+
+  if ((job = tpclJobNew(&pages->settings, PageOutput, &page)) == NULL)
+  {
+    fputs("ERROR: Unable to create job!\n", stderr);
+    return (NULL);
+  }
+
+  if (tpclLogDebugEnabled())
+    tpclJobSetLog(job, LogDebug, NULL);
+
+  pthread_mutex_lock(&pages->lock);
+
+  worker = pages->num_workers ++;
+
+  for (;;)
+  {
+    while (pages->num_started == pages->num_read && !pages->eof)
+      pthread_cond_wait(&pages->cond, &pages->lock);
+
+    if (pages->num_started == pages->num_read)
+      break;
+
+    page        = pages->pages + pages->num_started % pages->window;
+    page->state = PAGE_ENCODING;
+    pages->num_started ++;
+    pages->num_encoding ++;
+
+    /*
+     * The threads are shared by the pages being encoded and the ones
+     * waiting for a worker, so a lone tall page gets all of them for its
+     * bands while a full window encodes each page on its worker alone...
+     */
+    bands = pages->threads /
+            (pages->num_encoding + pages->num_read - pages->num_started);
+
+    pthread_mutex_unlock(&pages->lock);
+
+    /*
+     * Encode the page, tall pages are split into bands encoded by up to
+     * "bands" threads.  A canceled page ends with {WR} just like in the
+     * serial filter.
+     */
+    tpclJobSetThreads(job, bands);
+
+    t = tpclTelemetryTime();
+
+    if (tpclPageStart(job, &page->header))
+      fputs("ERROR: Unable to start page!\n", stderr);
+
+    cached = NULL;
+    full   = page->lines == page->header.cupsHeight;
+
+    if (pages->cache && full && !Canceled)
+    {
+      /*
+       * Grayscale pages print differently for each dither method, and
+       * all pages for each orientation; MirrorPrint only mirrors the
+       * graphics when PrintOrient does not mirror the label already...
+       */
+      mode = pages->settings.graphics_mode;
+      if (page->header.cupsBitsPerPixel == 8)
+        mode |= (pages->settings.dither + 1) << 4 |
+                (int)page->header.cupsColorSpace << 8;
+
+      mode |= (pages->settings.rotate / 90 & 3) << 12 |
+              (page->header.MirrorPrint &&
+               pages->settings.print_orient < 2 ? 1 : 0) << 14 |
+              (page->header.NegativePrint ? 1 : 0) << 15;
+
+      tpclCacheKey(&key, mode, (int)page->header.cupsWidth,
+                   (int)page->header.cupsBytesPerLine,
+                   (int)page->header.cupsHeight, page->raster);
+      cached = tpclCacheFind(pages->cache, &key, &cachedlen);
+    }
+
+    if (cached)
+    {
+      tpclPageWriteGraphics(job, cached, cachedlen);
+      tpclCacheRelease(cached, cachedlen);
+    }
+    else if (!Canceled)
+    {
+      start = page->datalen;
+
+      tpclPageWriteLines(job, page->raster, (int)page->lines);
+
+      if (pages->cache && full && !Canceled && !tpclPageEndGraphics(job))
+        tpclCacheStore(pages->cache, &key, page->data + start,
+                       page->datalen - start);
+    }
+
+    if (Canceled)
+    {
+      tpclJobCancel(job);
+      page->canceled = 1;
+    }
+
+    if (tpclPageEnd(job))
+      fputs("ERROR: Unable to send page!\n", stderr);
+
+    tpclPageStats(job, &page->metrics.stats);
+    page->metrics.encode_time = tpclTelemetryTime() - t;
+    tpclTelemetryTrace(Telemetry, "encode", TRACE_ENCODE + worker,
+                       page->metrics.page, t,
+                       t + page->metrics.encode_time);
+
+    free(page->raster);
+    page->raster = NULL;
+
+    pthread_mutex_lock(&pages->lock);
+    pages->memory -= page->memory;
+    page->memory  = page->datalen;
+    pages->memory += page->memory;
+    page->state   = PAGE_DONE;
+    pages->num_encoding --;
+    pthread_cond_broadcast(&pages->cond);
+  }
+
+  pthread_mutex_unlock(&pages->lock);
+
+  tpclJobDelete(job);
+
+  return (NULL);
+}
+
+
+/*
+ * 'PageWriteThread()' - Write encoded pages to stdout in page order.
+ *
+ * Nothing is written after a page that ended with {WR}; after a write
+ * error pages are still taken off the window so the other threads finish.
+ */
+void *                          /* O - Unused */
+PageWriteThread(void *data)     /* I - Shared state */
+{
+  pages_t             *pages = (pages_t *)data;
+  page_t              *page;    /* Page being written */
+  int                 stop = 0, /* Discard remaining pages */
+                      error = 0;/* Write error */
+  double              write_start;  /* WriteTime before the page */
+
+
+  pthread_mutex_lock(&pages->lock);
+
+  for (;;)
+  {
+    page = pages->pages + pages->num_written % pages->window;
+
+    while (!(pages->num_written < pages->num_read &&
+             page->state == PAGE_DONE) &&
+           !(pages->eof && pages->num_written == pages->num_read))
+      pthread_cond_wait(&pages->cond, &pages->lock);
+
+    if (pages->num_written == pages->num_read)
+      break;
+
+    pthread_mutex_unlock(&pages->lock);
+
+    if (!stop)
+    {
+      write_start = WriteTime;
+
+      if (WriteOutput(Output, page->data, page->datalen) ||
+          WriteOutput(Output, NULL, 0))
+        stop = error = 1;
+
+      LogOutput(pages->num_written + 1);
+
+      page->metrics.write_time = WriteTime - write_start;
+      tpclTelemetryPage(Telemetry, &page->metrics);
+    }
+
+    if (page->canceled)
+      stop = 1;
+
+    free(page->data);
+    page->data     = NULL;
+    page->datasize = 0;
+
+    pthread_mutex_lock(&pages->lock);
+    pages->write_error = error;
+    pages->memory -= page->memory;
+    page->memory  = 0;
+    page->state   = PAGE_EMPTY;
+    pages->num_written ++;
+    pthread_cond_broadcast(&pages->cond);
+  }
+
+  pthread_mutex_unlock(&pages->lock);
+
+  return (NULL);
+}
+
+
+/*
+ * 'BatchAdd()' - Add a raster file to the batch.
+ */
+int                             /* O - 0 on success, -1 on error */
+BatchAdd(batch_t    *batch,     /* I - Batch */
+         const char *filename)  /* I - Raster file */
+{
+  char          **temp;         /* New inputs */
+  int           alloc;          /* New number of inputs */
+
+
+  if (batch->num_inputs >= batch->alloc_inputs)
+  {
+    alloc = batch->alloc_inputs ? batch->alloc_inputs * 2 : 256;
+
+    if ((temp = realloc(batch->inputs, (size_t)alloc * sizeof(char *))) == NULL)
+      return (-1);
+
+    batch->inputs       = temp;
+    batch->alloc_inputs = alloc;
+  }
+
+  if ((batch->inputs[batch->num_inputs] = strdup(filename)) == NULL)
+    return (-1);
+
+  batch->num_inputs ++;
+
+  return (0);
+}
+
+
+/*
+ * 'BatchFile()' - Find or add a file seen in a spool directory.
+ *
+ * New files get a size of -1, which never matches the first scan.
+ */
+batch_file_t *                  /* O - File or NULL on error */
+BatchFile(batch_t    *batch,    /* I - Batch */
+          const char *filename) /* I - Raster file */
+{
+  batch_file_t  *file,          /* Current file */
+                *temp;          /* New files */
+  int           i,              /* Looping var */
+                alloc;          /* New number of files */
+
+
+  for (i = batch->num_files, file = batch->files; i > 0; i --, file ++)
+    if (!strcmp(file->name, filename))
+      return (file);
+
+  if (batch->num_files >= batch->alloc_files)
+  {
+    alloc = batch->alloc_files ? batch->alloc_files * 2 : 256;
+
+    if ((temp = realloc(batch->files,
+                        (size_t)alloc * sizeof(batch_file_t))) == NULL)
+      return (NULL);
+
+    batch->files       = temp;
+    batch->alloc_files = alloc;
+  }
 
-  //printf("{T|}\n");   /* Feed one sheet of paper */
-  printf("{C|}\n"); 	/* clear image buffer */
+  file = batch->files + batch->num_files;
 
-  /* Get graphics mode from ppd file for graphics drawing */
-  choice = ppdFindMarkedChoice(ppd,"teGraphicsMode");
-  switch (atoi(choice->choice)) {
-    case 3:
-      Gmode = TEC_GMODE_HEX_OR; // OR drawing hex mode
-      break;
-    case 2:
-      Gmode = TEC_GMODE_HEX_AND; // AND drawing hex mode
-      break;
-    case 1:
-    default:
-      Gmode = TEC_GMODE_TOPIX;
-  }
+  if ((file->name = strdup(filename)) == NULL)
+    return (NULL);
+
+  file->size   = -1;
+  file->mtime  = 0;
+  file->queued = 0;
+
+  batch->num_files ++;
+
+  return (file);
+}
 
-  // Only print the graphics if NOT in TOPIX mode!
-  if (Gmode != TEC_GMODE_TOPIX)
+
+/*
+ * 'BatchScan()' - Add the new raster files in a directory.
+ *
+ * Files ending in ".ras" are added unless they are already queued or
+ * their output already exists, so a directory can be scanned again for
+ * files that arrived since and for files that failed to convert.  When
+ * watching a directory a file is only added once its size and time are
+ * the same as at the previous scan, so files still being copied in are
+ * left alone.
+ */
+int                             /* O - Number of files added */
+BatchScan(batch_t    *batch,    /* I - Batch */
+          const char *directory) /* I - Spool directory */
+{
+  DIR           *dir;           /* Directory */
+  struct dirent *dent;          /* Directory entry */
+  char          filename[1024], /* Raster file */
+                outname[1024];  /* Output file */
+  size_t        len;            /* Length of name */
+  struct stat   info;           /* File info */
+  batch_file_t  *file;          /* File seen before */
+  int           changed,        /* File changed since the last scan? */
+                added;          /* Files added */
+
+
+  if ((dir = opendir(directory)) == NULL)
   {
-    printf("{SG;0000,0000,%04d,%04d,%d,", header->cupsBytesPerLine * 8, header->cupsHeight, Gmode);
+    fprintf(stderr, "ERROR: Unable to open directory %s - %s\n", directory,
+            strerror(errno));
+    return (0);
   }
-  else
+
+  for (added = 0; (dent = readdir(dir)) != NULL;)
   {
-    /*
-     * Allocate buffers for 8 dots per byte graphics ready for TOPIX compression
-     */
-    LastBuffer = malloc(header->cupsBytesPerLine);
-    memset(LastBuffer, 0, header->cupsBytesPerLine);
-    // Allocate big chunk of memory for parts of TOPIX image 
-    CompBuffer = malloc(0xFFFF);
-    memset(CompBuffer, 0, 0xFFFF);
-    CompBufferPtr = CompBuffer;
-    CompLastLine = 0;
+    if ((len = strlen(dent->d_name)) <= 4 ||
+        strcmp(dent->d_name + len - 4, ".ras"))
+      continue;
+
+    snprintf(filename, sizeof(filename), "%s/%s", directory, dent->d_name);
+    BatchOutputName(batch, filename, outname, sizeof(outname));
+
+    if (!stat(outname, &info) || stat(filename, &info) ||
+        !S_ISREG(info.st_mode))
+      continue;
+
+    if ((file = BatchFile(batch, filename)) == NULL || file->queued)
+      continue;
+
+    changed     = file->size != info.st_size || file->mtime != info.st_mtime;
+    file->size  = info.st_size;
+    file->mtime = info.st_mtime;
+
+    if (changed && batch->watch > 0)
+      continue;                         /* Maybe still being written */
+
+    if (!BatchAdd(batch, filename))
+    {
+      file->queued = 1;
+      added ++;
+    }
   }
 
-  /*
-   * Allocate memory for a line of graphics...
-   */
-  Buffer = malloc(header->cupsBytesPerLine);
-  Feed   = 0;
+  closedir(dir);
+
+  return (added);
 }
 
 
 /*
- * 'EndPage()' - Finish a page of graphics.
+ * 'BatchOutputName()' - Name the TPCL file for a raster file.
+ *
+ * "label.ras" becomes "label.tpcl", in the same directory or in
+ * $TPCL_BATCH_OUTPUT if that is set.
  */
 void
-EndPage(ppd_file_t *ppd,		/* I - PPD file */
-        cups_page_header2_t *header)	/* I - Page header */
-{
-  int 		      Quant;	 		/* Quantity to print */
-  char		      *Temp;			/* Temporary string */
-  unsigned int 	Tmedia;			/* type of media */
-  char          *Tmode;			/* Print mode */
-  unsigned int  Tmirror;		/* Mirror print */
-  unsigned int  tstat;			/* with or without status */
-  unsigned int  detect;			/* type of label sensor*/
-  char  	      *Tspeed;		/* print Speed */
-  unsigned int  Tcut;			  /* Cut quantity */
-  unsigned int  CutActive;	/* Activate cutter */
-  ppd_choice_t  *choice;		/* Marked choice */
+BatchOutputName(batch_t    *batch,      /* I - Batch */
+                const char *input,      /* I - Raster file */
+                char       *filename,   /* O - Output file */
+                size_t     size)        /* I - Size of filename */
+{
+  const char    *base;          /* File name without directory */
+  int           len;            /* Length without ".ras" */
 
-#if defined(HAVE_SIGACTION) && !defined(HAVE_SIGSET)
-  struct sigaction action;		/* Actions for POSIX signals */
-#endif /* HAVE_SIGACTION && !HAVE_SIGSET */
 
-  Temp = (char *) malloc(INTSIZE +2);
-  Tmode = (char *) malloc(INTSIZE +2);
-  Tspeed = (char *) malloc(INTSIZE +2);
-  detect = 0;
-  Quant = 1;
-  CutActive =0;
+  base = strrchr(input, '/');
+  base = base ? base + 1 : input;
+  len  = (int)strlen(base);
 
-  /* Initialise printing defaults */
-	Tmedia =0;
-	Tmirror=0;
-	tstat =0;
-	strcpy(Tmode,"C\0");
-	strcpy(Tspeed,"3\0");
+  if (len > 4 && !strcmp(base + len - 4, ".ras"))
+    len -= 4;
 
-  /*
-   * Terminate sending graphics.
-   * If not in TOPIX mode, we also need to close the raw graphics output.
-   */
-  if (Gmode == TEC_GMODE_TOPIX)
-    TOPIXCompressOutputBuffer(ppd, header, 0);
+  if (batch->outdir)
+    snprintf(filename, size, "%s/%.*s.tpcl", batch->outdir, len, base);
   else
-    printf("|}\n");
+    snprintf(filename, size, "%.*s%.*s.tpcl", (int)(base - input), input,
+             len, base);
+}
+
+
+/*
+ * 'BatchOutput()' - Library write callback for the batch mode.
+ */
+int                             /* O - 0 on success, -1 on error */
+BatchOutput(void       *user_data,  /* I - Pointer to current output */
+            const void *data,       /* I - Data or NULL to flush */
+            size_t     len)         /* I - Length of data */
+{
+  return (tpclOutputWrite(*(tpcl_output_t **)user_data, data, len));
+}
 
 
-  if (Canceled)
+/*
+ * 'BatchConvert()' - Convert one raster file of the batch.
+ *
+ * The TPCL goes to a temporary file that is renamed when complete, so
+ * a partly written output is never taken for a converted file.
+ */
+int                             /* O - 0 on success, -1 on error */
+BatchConvert(batch_worker_t *worker,    /* I - Worker */
+             const char     *input)     /* I - Raster file */
+{
+  batch_t             *batch = worker->batch;
+  char                outname[1024],  /* Output file */
+                      tempname[1024]; /* Temporary output file */
+  int                 infd, outfd;  /* File descriptors */
+  raster_t            *ras;   /* Raster stream */
+  cups_page_header2_t header; /* Page header from file */
+  unsigned char       *buffer;  /* Line buffer */
+  const unsigned char *line;  /* Line read */
+  unsigned            y,      /* Current line */
+                      count;  /* Lines read at once */
+  int                 pages;  /* Pages converted */
+  long                raster_bytes, /* Raster bytes read */
+                      calls, bytes; /* Output statistics */
+  int                 status; /* Conversion status */
+
+
+  BatchOutputName(batch, input, outname, sizeof(outname));
+  snprintf(tempname, sizeof(tempname), "%s.tmp", outname);
+
+  if ((infd = open(input, O_RDONLY)) == -1)
   {
-    /*
-     * Ramclear in case of error
-     */
-    puts("{WR|}");
+    fprintf(stderr, "ERROR: Unable to open raster file %s - %s\n", input,
+            strerror(errno));
+    return (-1);
+  }
 
-  } else {
+  if ((outfd = open(tempname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+  {
+    fprintf(stderr, "ERROR: Unable to create %s - %s\n", tempname,
+            strerror(errno));
+    close(infd);
+    return (-1);
+  }
 
-    /*
-     * Set media tracking...
-     */
-    if (ppdIsMarked(ppd, "teMediaTracking", "0"))
-      detect = 0;
-    else if (ppdIsMarked(ppd, "teMediaTracking", "1"))
-      detect = 1;
-    else if (ppdIsMarked(ppd, "teMediaTracking", "2"))
-      detect = 2;
-    else if (ppdIsMarked(ppd, "teMediaTracking", "3"))
-      detect= 3;
-    else if (ppdIsMarked(ppd, "teMediaTracking", "4"))
-      detect = 4;
-
-    //	printf("{XJ;End Page %d|}",detect);
-    /*
-     * Set print mode...
-     */
-    if (header->CutMedia) /* coupe active */
-    {	
-      strcpy(Tmode,"C\0");
-      CutActive =1;
-    }
-    else
-    {
-      if ((choice = ppdFindMarkedChoice(ppd, "tePrintMode")) != NULL &&
-        strcmp(choice->choice, "0"))
-      {
-        strcpy(Tmode,"C\0");
-        if (!strcmp(choice->choice,"1"))
-          strcpy(Tmode,"D\0");
-        else if (!strcmp(choice->choice, "2"))
-          strcpy(Tmode,"E\0");
-        else if (!strcmp(choice->choice, "3"))
-        {
-          strcpy(Tmode,"C\0");
-          CutActive =1;
-        }
-      }
-    }
-    /*
-     * Set print rate...
-     */
-    choice = ppdFindMarkedChoice(ppd, "tePrintRate");
+  ras            = RasterOpen(infd);
+  worker->output = tpclOutputNew(outfd);
+
+  tpclJobReset(worker->job);
+
+  status       = ras && worker->output && !tpclJobSetup(worker->job) ? 0 : -1;
+  pages        = 0;
+  raster_bytes = 0;
 
-    /* The speed is selected from the printer parameter choice */
-    switch (atoi(choice->choice))
+  while (!status && !Canceled && RasterReadHeader(ras, &header))
+  {
+    if (tpclPageStart(worker->job, &header))
     {
-      case 2 :
-        strcpy(Tspeed,"2\0");
-        break;
-      case 3 :
-        strcpy(Tspeed,"3\0");
-        break;
-      case 4 :
-        strcpy(Tspeed,"4\0");
-        break;
-      case 5 :
-        strcpy(Tspeed,"5\0");
-        break;
-      case 6 :
-        strcpy(Tspeed,"6\0");
-        break;
-      case 8 :
-        strcpy(Tspeed,"8\0");
-        break;
-      case 10 :
-        strcpy(Tspeed,"A\0");
-        break;
+      status = -1;
+      break;
     }
-    
-    /*
-     * Set with or without ribbon mode from media type 
-     */
-    if (!strcmp(header->MediaType, "Direct"))
-      Tmedia = 0;
-    else if (!strcmp(header->MediaType, "Thermal"))
-      Tmedia = 1;
-    else if (!strcmp(header->MediaType,"Thermal2"))
-      Tmedia = 2;
-   
-    /* status response */
-    tstat = 0;
 
-    /*
-     * Manage the cut option every label or end of batch print 
-     */
-    switch (header->cupsRowStep)
+    for (y = 0; y < header.cupsHeight && !Canceled; y += count)
     {
-      case 0 :
-        Tcut =0;
-        break;
-      case 1 :
-        Tcut =1;
-        break;
-      case 999 :
-        Tcut =0;
-        break;
-      default:
-        Tcut= 0;
+      buffer = tpclPageBuffer(worker->job);
+      if ((line = RasterReadLines(ras, buffer, header.cupsBytesPerLine,
+                                  &count)) == NULL ||
+          tpclPageWriteRepeat(worker->job, line, (int)count))
         break;
     }
 
-    /*
-     * Version 1.2 Mirror option not managed local management
-     */ 
-    if ((choice = ppdFindMarkedChoice(ppd, "PrintOrient")) != NULL)
-      Tmirror = atoi(choice->choice);
-    else
-      Tmirror = 0;
+    if (y < header.cupsHeight && !Canceled)
+      status = -1;
 
-    /*
-     * End the label and eject...
-     */
-    // printf("{PV00;0010,%4d,0020,0020,A,00,B=----Hello Linux World From S.K.E----- |}\n",header->PageSize[1]*254/72 - 50);
-    // printf("{PC01;0010,%4d,05,05,O,00,B= Only Man gives names and value to things (P.Kong)|}\n",header->PageSize[1]*254/72 - 30);
-    printf("{XS;I,%04d,%03d%d%s%s%d%d%d|}\n",header->NumCopies,Tcut,detect,Tmode,Tspeed,Tmedia,Tmirror,tstat);
-    
-    /* Send eject command if cut active */
-    if (CutActive > 0)
-      printf("{IB|}\n");
+    if (tpclPageEnd(worker->job))
+      status = -1;
 
-  } // Not Cancelled
+    pages ++;
+    raster_bytes += (long)y * header.cupsBytesPerLine;
+  }
 
+  if (Canceled || (!status && !pages))
+    status = -1;
 
-  fflush(stdout);
+  bytes = 0;
+  if (worker->output)
+  {
+    if (tpclOutputFlush(worker->output))
+      status = -1;
 
-  /*
-   * Unregister the signal handler...
-   */
+    tpclOutputStats(worker->output, &calls, &bytes);
+    tpclOutputDelete(worker->output);
+    worker->output = NULL;
+  }
 
-#ifdef HAVE_SIGSET /* Use System V signals over POSIX to avoid bugs */
-  sigset(SIGTERM, SIG_IGN);
-#elif defined(HAVE_SIGACTION)
+  RasterClose(ras);
+  close(infd);
 
-  memset(&action, 0, sizeof(action));
+  if (close(outfd) || status || rename(tempname, outname))
+  {
+    if (!Canceled)
+      fprintf(stderr, "ERROR: Unable to convert %s!\n", input);
 
-  sigemptyset(&action.sa_mask);
-  action.sa_handler = SIG_IGN;
-  sigaction(SIGTERM, &action, NULL);
-#else
-  signal(SIGTERM, SIG_IGN);
-#endif /* HAVE_SIGSET */
+    unlink(tempname);
+    status = -1;
+  }
+  else
+    tpclLogDebug("Converted %s, %d pages, %ld bytes", input, pages, bytes);
 
-  /*
-   * Free memory...
-   */
-  if (Gmode == TEC_GMODE_TOPIX) {
-    free(LastBuffer);
-    free(CompBuffer);
+  pthread_mutex_lock(&batch->lock);
+  if (status)
+    batch->failed ++;
+  else
+  {
+    batch->converted ++;
+    batch->pages        += pages;
+    batch->raster_bytes += raster_bytes;
+    batch->output_bytes += bytes;
   }
-  free(Buffer);
+  pthread_mutex_unlock(&batch->lock);
+
+  return (status);
 }
 
 
 /*
- * 'CancelJob()' - Cancel the current job...
+ * 'BatchThread()' - Worker converting raster files of the batch.
  */
-void
-CancelJob(int sig)			/* I - Signal */
+void *                          /* O - Unused */
+BatchThread(void *data)         /* I - Worker */
 {
- /*
-  * Tell the main loop to stop...
-  */
-  (void)sig;
-  Canceled = 1;
-}
+  batch_worker_t      *worker = (batch_worker_t *)data;
+  batch_t             *batch = worker->batch;
+  const char          *input; /* Raster file */
 
 
-/*
- * 'OutputLine()' - Output a line of graphics.
- * 
- * Some versions of this method check to see if the Buffer has data, this doesn't.
- * Empty lines can often be skipped if the buffer is checked.
- */
-void
-OutputLine(ppd_file_t           *ppd,	    /* I - PPD file */
-           cups_page_header2_t  *header,	/* I - Page header */
-           int                  y)	      /* I - Line number */
-{
+  for (;;)
+  {
+    pthread_mutex_lock(&batch->lock);
+    input = batch->next < batch->num_inputs && !Canceled ?
+            batch->inputs[batch->next ++] : NULL;
+    pthread_mutex_unlock(&batch->lock);
+
+    if (!input)
+      break;
 
-  if (Gmode == TEC_GMODE_TOPIX) {
-    TOPIXCompress(ppd, header, y);
-  } else {
-    // Hex Output
-    fwrite(Buffer, 1, header->cupsBytesPerLine, stdout);
+    BatchConvert(worker, input);
   }
 
+  return (NULL);
 }
 
 
-
 /*
- * 'TOPIXCompress()' - Apply TOPIX compression mechanism to current data in buffers
+ * 'PrintBatch()' - Convert many raster files, several at a time.
+ *
+ * Each argument is a raster file or a spool directory of them.  Every
+ * worker thread keeps one library job for all of the files it converts,
+ * so the page buffers are only allocated once.  With $TPCL_BATCH_WATCH
+ * set to a number of seconds the directories are scanned again at that
+ * interval for new files until the filter is stopped.
  */
-void
-TOPIXCompress(ppd_file_t         *ppd,	    /* I - PPD file */
-              cups_page_header2_t *header,	/* I - Page header */
-              int                y)         /* Line number */
+int                             /* O - Exit status */
+PrintBatch(int                  num_files,      /* I - Number of arguments */
+           char                 *files[],       /* I - Files and directories */
+           const tpcl_options_t *options)       /* I - Job options */
 {
-  int               i;              /* Index into Buffer */
-  int               max;            /* Max number of items per line */
-  unsigned char     line[8][9][9] = {0};  /* Current line */
-  int               l1, l2, l3;     /* Current Positions in line */ 
-  unsigned char     cl1, cl2, cl3;  /* Current Characters */
-
-  int               width;          /* Max width of the line */
-  unsigned char     xor;      /* Current XORed character */
-  unsigned char     *ptr;     /* Pointer into the Compressed Line Buffer */
- 
+  batch_t             batch;  /* Batch */
+  batch_worker_t      workers[PAGES_MAX_THREADS]; /* Workers */
+  int                 threads;  /* Number of workers */
+  int                 i,      /* Looping var */
+                      first,  /* First input of this round */
+                      scans;  /* Times the arguments were scanned */
+  int                 watch;  /* Seconds between scans or 0 */
+  struct stat         info;   /* File info */
+  double              start,  /* Start time */
+                      elapsed;  /* Seconds converting */
+
+
+  memset(&batch, 0, sizeof(batch));
+  pthread_mutex_init(&batch.lock, NULL);
+
+  batch.outdir = getenv("TPCL_BATCH_OUTPUT");
+  watch        = getenv("TPCL_BATCH_WATCH") ? atoi(getenv("TPCL_BATCH_WATCH")) : 0;
+  batch.watch  = watch;
+
+  if ((threads = options->threads) == 0)
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads = 1;
+  if (threads > PAGES_MAX_THREADS)
+    threads = PAGES_MAX_THREADS;
+
+  for (i = 0; i < threads; i ++)
+  {
+    workers[i].batch   = &batch;
+    workers[i].output  = NULL;
+    workers[i].started = 0;
 
-  width = header->cupsBytesPerLine;
-  max = 8 * 9 * 9;
+    if ((workers[i].job = tpclJobNew(&options->settings, BatchOutput,
+                                     &workers[i].output)) == NULL)
+    {
+      fputs("ERROR: Unable to create job!\n", stderr);
+      threads = i;
+      break;
+    }
 
-  /*
-   * Ensure that we will not overrun the buffer by sending 
-   * to stdout when we get to the danger zone (width + ((width / 8) * 3))
-   * This will create multiple graphics objects depending on the size of the image.
-   */
-  if ((CompBufferPtr - CompBuffer) > (0xFFFF - (width + (ceil(width / 8) * 3)))) {
-    TOPIXCompressOutputBuffer(ppd, header, y);
-    memset(LastBuffer, 0, header->cupsBytesPerLine);
+    if (tpclLogDebugEnabled())
+      tpclJobSetLog(workers[i].job, LogDebug, NULL);
   }
 
-  /*
-   * Perform XOR on raw data for TOPIX data
-   */
-  cl1 = 0;
-  i = 0;
-  for (l1 = 0; l1 <= 7 && i < width; l1++)
+  SetTermHandler(CancelJob);
+
+  start = tpclTelemetryTime();
+  first = 0;
+  scans = 0;
+
+  do
   {
-    cl2 = 0;
-    for (l2 = 1; l2 <= 8 && i < width; l2++)
+    for (i = 0; i < num_files; i ++)
     {
-      cl3 = 0;
-      for (l3 = 1; l3 <= 8 && i < width; l3++, i++)
-      {
-        xor = Buffer[i] ^ LastBuffer[i];
-        line[l1][l2][l3] = xor;
-        if (xor > 0) {
-          // There is a change! Ensure its recorded
-          cl3 |= (1 << (8 - l3));
-        }
-      } // L3
+      if (!stat(files[i], &info) && S_ISDIR(info.st_mode))
+        BatchScan(&batch, files[i]);
+      else if (scans == 0 && BatchAdd(&batch, files[i]))
+        fputs("ERROR: Unable to allocate memory!\n", stderr);
+    }
 
-      line[l1][l2][0] = cl3;
-      if (cl3 != 0)
-        cl2 |= (1 << (8 - l2));
-    } // L2
+    scans ++;
 
-    line[l1][0][0] = cl2;
-    if (cl2 != 0)
-      cl1 |= (1 << (7 - l1));
-  } // L1
+    if (batch.num_inputs > first)
+    {
+      tpclLogDebug("Converting %d files on %d threads",
+                   batch.num_inputs - first, threads);
 
+      /*
+       * Workers that fail to start leave their files to the others, this
+       * thread converts files too...
+       */
+      for (i = 1; i < threads; i ++)
+        workers[i].started = !pthread_create(&workers[i].thread, NULL,
+                                             BatchThread, workers + i);
 
-  // Always add CL1 for line
-  *CompBufferPtr = cl1;
-  CompBufferPtr++;
+      if (threads > 0)
+        BatchThread(workers);
 
-  /*
-   * Copy the line into the compressed buffer with all the
-   * white space removed.
-   */
-  if (cl1 > 0) {
-    ptr = &line[0][0][0];
-    for(i = 0; i < max; i++) {
-      if (*ptr != 0) {
-        *CompBufferPtr = *ptr;
-        CompBufferPtr++;
-      }
-      ptr++;
+      for (i = 1; i < threads; i ++)
+        if (workers[i].started)
+          pthread_join(workers[i].thread, NULL);
+
+      first = batch.num_inputs;
+
+      fprintf(stderr, "INFO: Converted %d of %d files\n", batch.converted,
+              batch.num_inputs);
+
+      /*
+       * Files that failed have no output and are tried again by the next
+       * scan...
+       */
+      for (i = 0; i < batch.num_files; i ++)
+        batch.files[i].queued = 0;
     }
+
+    tpclLogFlush();
+
+    if (watch > 0 && !Canceled)
+      sleep((unsigned)watch);
   }
-  
+  while (watch > 0 && !Canceled);
+
+  SetTermHandler(SIG_IGN);
+
   /*
-   * Copy line into last buffer ready for next loop
+   * Show the totals...
    */
-  memcpy(LastBuffer, Buffer, header->cupsBytesPerLine);
-}
+  elapsed = tpclTelemetryTime() - start;
+  if (elapsed <= 0.0)
+    elapsed = 1e-6;
 
-/*
- * 'TOPIXCompressOutputBuffer()' - Send a set of data to output.
- *
- * Set y to 0 if this is the last line.
- */
-void TOPIXCompressOutputBuffer(ppd_file_t          *ppd,	   /* PPD file */
-                               cups_page_header2_t *header,	 /* Page header */
-                               int                 y)        /* Line number */
-{
-  unsigned short len;
-  unsigned short belen; /* Big-endian short! */
+  fprintf(stderr, "INFO: Batch converted %d files, %d failed, %d pages in "
+                  "%.2f seconds on %d threads\n", batch.converted,
+          batch.failed, batch.pages, elapsed, threads);
+  fprintf(stderr, "INFO: %.1f files/s, %.1f pages/s, %.1f MB/s of raster, "
+                  "%.1f MB of TPCL (%.1f%% of the raster)\n",
+          batch.converted / elapsed, batch.pages / elapsed,
+          batch.raster_bytes / elapsed / 1048576.0,
+          batch.output_bytes / 1048576.0,
+          batch.raster_bytes ?
+              100.0 * batch.output_bytes / batch.raster_bytes : 0.0);
 
-  len = (unsigned short) (CompBufferPtr - CompBuffer);
-  if (len == 0)
-    return;
+  for (i = 0; i < threads; i ++)
+    tpclJobDelete(workers[i].job);
 
-  fprintf(stderr, "DEBUG: Sending output with length: %04x \n", len);
+  for (i = 0; i < batch.num_inputs; i ++)
+    free(batch.inputs[i]);
 
-  // Convert into Big Endian (This may be OS dependant!)
-  belen = (len << 8 | len >> 8);
+  free(batch.inputs);
 
-  /*
-   * Output the complete graphics line to STDOUT
-   */
-  printf("{SG;0000,%04dD,%04d,%04d,%d,", CompLastLine, header->cupsBytesPerLine * 8, 300, Gmode);
-  fwrite(&belen, 2, 1, stdout);       // Length of data
-  fwrite(CompBuffer, 1, len, stdout); // Data
-  printf("|}\n");
-  fflush(stdout);
+  for (i = 0; i < batch.num_files; i ++)
+    free(batch.files[i].name);
 
-  if (y) CompLastLine = y;
+  free(batch.files);
+  pthread_mutex_destroy(&batch.lock);
 
-  /*
-   * Reset the Compressed Buffer
-   */
-  memset(CompBuffer, 0, 0xFFFF);
-  CompBufferPtr = CompBuffer;
+  return (batch.failed ? 1 : 0);
 }
 
 
-
 /*
  * 'main()' - Main entry and processing of driver.
  */
@@ -806,12 +2491,24 @@ main(int  argc,				/* I - Number of command-line arguments */
      char *argv[])			/* I - Command-line arguments */
 {
   int           			fd;		  /* File descriptor */
-  cups_raster_t		    *ras;		/* Raster stream for printing */
-  cups_page_header2_t	header;	/* Page header from file */
-  int                 y;      /* Current line */
+  raster_t            *ras;		/* Raster stream for printing */
   ppd_file_t          *ppd;   /* PPD file */
   int                 num_options;	/* Number of options */
   cups_option_t       *options;	/* Options */
+  tpcl_options_t      job_options; /* Resolved options */
+  char                key[4096]; /* Options cache key */
+  int                 cached;   /* Options from the cache? */
+  int                 threads;  /* Encoder threads */
+  size_t              max_memory; /* Memory limit in MB */
+  tpcl_cache_t        *cache;   /* Encoded page cache */
+  const char          *cache_dir; /* Cache directory */
+  const char          *debug;   /* $TPCL_DEBUG */
+  char                filename[1024]; /* Default cache directory */
+  int                 hits, misses; /* Cache statistics */
+  long                calls, bytes; /* Output statistics */
+  int                 batch;    /* Convert many files? */
+  struct stat         info;     /* Raster file info */
+  int                 status;   /* Batch exit status */
 
 
   /*
@@ -822,16 +2519,81 @@ main(int  argc,				/* I - Number of command-line arguments */
   /*
    * Check command-line...
    */
-  if (argc < 6 || argc > 7)
+  if (argc < 6)
   {
     /*
      * We don't have the correct number of arguments; write an error message
      * and return.
      */
-    fputs("ERROR: rastertotec job-id user title copies options [file]\n", stderr);
+    fputs("ERROR: rastertotec job-id user title copies options [file ...]\n",
+          stderr);
     return (1);
   }
 
+  /*
+   * Several files, or a directory, are converted to .tpcl files in batch
+   * mode...
+   */
+  batch = argc > 7 ||
+          (argc == 7 && !stat(argv[6], &info) && S_ISDIR(info.st_mode));
+
+ /*
+  * Resolve the options, from the options cache when this PPD was used with
+  * the same options before, otherwise from the PPD file...
+  */
+  num_options = cupsParseOptions(argv[5], 0, &options);
+
+  if ((cache_dir = getenv("TPCL_CACHE_DIR")) == NULL)
+  {
+    snprintf(filename, sizeof(filename), "%s/rastertotpcl",
+             getenv("CUPS_CACHEDIR") ? getenv("CUPS_CACHEDIR") :
+                                       "/var/cache/cups");
+    cache_dir = filename;
+  }
+
+  cached = 0;
+  if (getenv("PPD") &&
+      !OptionsKey(num_options, options, key, sizeof(key)) &&
+      !tpclOptionsLoad(cache_dir, getenv("PPD"), key, &job_options))
+    cached = 1;
+  else if ((ppd = ppdOpenFile(getenv("PPD"))) != NULL)
+  {
+    ppdMarkDefaults(ppd);
+    cupsMarkOptions(ppd, num_options, options);
+    GetOptions(ppd, &job_options);
+    ppdClose(ppd);
+
+    if (!OptionsKey(num_options, options, key, sizeof(key)))
+      tpclOptionsStore(cache_dir, getenv("PPD"), key, &job_options);
+  }
+  else
+  {
+    fputs("ERROR: Missing PPD file required for defaults!", stderr);
+    return(1);
+  }
+
+  /*
+   * DEBUG messages are only built when the teDebugLog option or
+   * $TPCL_DEBUG asks for them...
+   */
+  if (job_options.debug_log)
+    tpclLogSetDebug(1);
+  else if ((debug = getenv("TPCL_DEBUG")) != NULL && *debug &&
+           strcmp(debug, "0"))
+    tpclLogSetDebug(1);
+
+  tpclLogDebug("Options from %s", cached ? "the options cache" : "the PPD file");
+
+  if (batch)
+  {
+    status = PrintBatch(argc - 6, argv + 6, &job_options);
+
+    tpclLogFlush();
+    cupsFreeOptions(num_options, options);
+
+    return (status);
+  }
+
  /*
   * Open the page stream...
   */
@@ -847,91 +2609,89 @@ main(int  argc,				/* I - Number of command-line arguments */
   else
     fd = 0;
 
-  ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
+  ras = RasterOpen(fd);
 
- /*
-  * Open the PPD file and apply options...
-  */
-  num_options = cupsParseOptions(argv[5], 0, &options);
+  /*
+   * Initialize the print device and process pages as needed...
+   */
+  Page     = 0;
+  Canceled = 0;
 
-  if ((ppd = ppdOpenFile(getenv("PPD"))) != NULL)
+  if ((Output = tpclOutputNew(1)) == NULL)
   {
-    ppdMarkDefaults(ppd);
-    cupsMarkOptions(ppd, num_options, options);
-  }
-  else
-  {
-    fputs("ERROR: Missing PPD file required for defaults!", stderr);
-    return(1);
+    fputs("ERROR: Unable to allocate memory!\n", stderr);
+    return (1);
   }
 
   /*
-   * Initialize the print device...
+   * Per-page metrics go to $TPCL_TELEMETRY as JSON lines and a timeline
+   * to $TPCL_TRACE in Chrome trace format...
    */
-  Setup(ppd);
+  Telemetry = tpclTelemetryOpen(getenv("TPCL_TELEMETRY"), getenv("TPCL_TRACE"));
+
+  if ((threads = job_options.threads) == 0)
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads = 1;
 
   /*
-   * Process pages as needed...
+   * Incremental pages depend on the page before, so they are encoded in
+   * order by one job, without encoder threads or the page cache...
    */
-  Page     = 0;
-  Canceled = 0;
-
-  while (cupsRasterReadHeader2(ras, &header))
+  if (job_options.settings.incremental && threads > 1)
   {
-    /*
-     * Write a status message with the page number and number of copies.
-     */
-    Page++;
-    fprintf(stderr, "PAGE: %d 1\n", Page);
+    tpclLogDebug("Incremental updates, not using %d encoder threads", threads);
+    threads = 1;
+  }
 
-    /*
-     * Start the page...
-     */
-    StartPage(ppd, &header);
+  max_memory = (size_t)job_options.memory_limit;
 
-    /*
-     * Loop for each line on the page...
-     */
-    for (y = 0; y < header.cupsHeight && !Canceled; y++)
-    {
-      /*
-       * Let the user know how far we have progressed...
-       */
-      if ((y & 15) == 0)
-        fprintf(stderr, "INFO: Printing page %d, %d%% complete...\n", Page,
-	        100 * y / header.cupsHeight);
+  cache = NULL;
+  if (!job_options.settings.incremental && job_options.page_cache > 0)
+  {
+    if ((cache = tpclCacheOpen(cache_dir,
+                               (size_t)job_options.page_cache << 20)) == NULL)
+      tpclLogDebug("Unable to use page cache %s", cache_dir);
+  }
 
-      /*
-       * Read a line of graphics...
-       */
-      if (cupsRasterReadPixels(ras, Buffer, header.cupsBytesPerLine) < 1)
-        break;
+  if (job_options.merge_pages)
+    PrintPagesMerged(ras, &job_options.settings);
+  else if (threads > 1 || cache)
+    PrintPagesParallel(ras, &job_options.settings, threads, max_memory << 20,
+                       cache);
+  else if (job_options.pipeline)
+    PrintPagesPipelined(ras, &job_options.settings);
+  else
+    PrintPages(ras, &job_options.settings);
 
-      /*
-       * Write it to the printer...
-       */
-      OutputLine(ppd, &header, y);
-    }
+  tpclOutputFlush(Output);
+  tpclTelemetryClose(Telemetry);
+  Telemetry = NULL;
 
-    /*
-     * Eject the page...
-     */
-    EndPage(ppd, &header);
-    if (Canceled)
-      break;
+  tpclOutputStats(Output, &calls, &bytes);
+  tpclLogDebug("Sent %ld bytes in %ld write calls", bytes, calls);
+  tpclOutputDelete(Output);
+  Output = NULL;
+
+  if (cache)
+  {
+    tpclCacheStats(cache, &hits, &misses);
+    tpclLogDebug("Page cache: %d hits, %d misses", hits, misses);
+    tpclCacheClose(cache);
   }
 
+  tpclLogFlush();
+
   /*
    * Close the raster stream...
    */
-  cupsRasterClose(ras);
+  RasterClose(ras);
   if (fd != 0)
     close(fd);
 
   /*
-   * Close the PPD file and free the options...
+   * Free the options...
    */
-  ppdClose(ppd);
   cupsFreeOptions(num_options, options);
 
   /*
@@ -0,0 +1,234 @@
+/*
+ *   Single producer, single consumer ring buffer for the TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   tpclRingNew()       - Create a ring.
+ *   tpclRingDelete()    - Free a ring.
+ *   tpclRingSlotSize()  - Size of each slot.
+ *   tpclRingWriteSlot() - Wait for a free slot to fill.
+ *   tpclRingPush()      - Hand the filled slot to the reader.
+ *   tpclRingReadSlot()  - Wait for a filled slot.
+ *   tpclRingPop()       - Give the read slot back to the writer.
+ *
+ * head is only written by the producer and tail only by the consumer;
+ * the release/acquire pairs make the slot contents visible before the
+ * index that publishes them.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include "ring.h"
+
+
+/*
+ * Ring structure...
+ */
+typedef struct tpcl_slot_s
+{
+  int             type;                 /* Producer defined type */
+  size_t          len;                  /* Bytes used */
+  unsigned char   *data;                /* Slot data */
+} tpcl_slot_t;
+
+struct tpcl_ring_s
+{
+  int             slots;                /* Number of slots */
+  size_t          slot_size;            /* Bytes per slot */
+  tpcl_slot_t     *slot;                /* Slots */
+  unsigned char   *data;                /* Slot storage */
+  _Atomic unsigned long head            /* Slots written */
+                  __attribute__((aligned(64)));
+  _Atomic unsigned long tail            /* Slots read */
+                  __attribute__((aligned(64)));
+};
+
+
+/*
+ * Local functions...
+ */
+static void ring_wait(int *spins);
+
+
+/*
+ * 'tpclRingNew()' - Create a ring.
+ */
+tpcl_ring_t *                           /* O - New ring or NULL */
+tpclRingNew(int    slots,               /* I - Number of slots */
+            size_t slot_size)           /* I - Bytes per slot */
+{
+  tpcl_ring_t   *ring;                  /* New ring */
+  int           i;                      /* Looping var */
+
+
+  if (slots < 2 || slot_size == 0)
+    return (NULL);
+
+  if ((ring = calloc(1, sizeof(tpcl_ring_t))) == NULL)
+    return (NULL);
+
+  ring->slots     = slots;
+  ring->slot_size = slot_size;
+  ring->slot      = calloc((size_t)slots, sizeof(tpcl_slot_t));
+  ring->data      = malloc((size_t)slots * slot_size);
+
+  if (!ring->slot || !ring->data)
+  {
+    tpclRingDelete(ring);
+    return (NULL);
+  }
+
+  for (i = 0; i < slots; i++)
+    ring->slot[i].data = ring->data + (size_t)i * slot_size;
+
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+
+  return (ring);
+}
+
+
+/*
+ * 'tpclRingDelete()' - Free a ring.
+ */
+void
+tpclRingDelete(tpcl_ring_t *ring)       /* I - Ring */
+{
+  if (!ring)
+    return;
+
+  free(ring->slot);
+  free(ring->data);
+  free(ring);
+}
+
+
+/*
+ * 'tpclRingSlotSize()' - Size of each slot.
+ */
+size_t                                  /* O - Bytes per slot */
+tpclRingSlotSize(tpcl_ring_t *ring)     /* I - Ring */
+{
+  return (ring->slot_size);
+}
+
+
+/*
+ * 'tpclRingWriteSlot()' - Wait for a free slot to fill.
+ */
+void *                                  /* O - Slot data */
+tpclRingWriteSlot(tpcl_ring_t *ring)    /* I - Ring */
+{
+  unsigned long head;                   /* Our next slot */
+  int           spins = 0;              /* Times we have waited */
+
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+  while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >=
+         (unsigned long)ring->slots)
+    ring_wait(&spins);
+
+  return (ring->slot[head % ring->slots].data);
+}
+
+
+/*
+ * 'tpclRingPush()' - Hand the filled slot to the reader.
+ */
+void
+tpclRingPush(tpcl_ring_t *ring,         /* I - Ring */
+             int         type,          /* I - Slot type */
+             size_t      len)           /* I - Bytes used */
+{
+  unsigned long head;                   /* Slot being pushed */
+
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+  ring->slot[head % ring->slots].type = type;
+  ring->slot[head % ring->slots].len  = len;
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+/*
+ * 'tpclRingReadSlot()' - Wait for a filled slot.
+ */
+void *                                  /* O - Slot data */
+tpclRingReadSlot(tpcl_ring_t *ring,     /* I - Ring */
+                 int         *type,     /* O - Slot type */
+                 size_t      *len)      /* O - Bytes used */
+{
+  unsigned long tail;                   /* Our next slot */
+  tpcl_slot_t   *slot;                  /* Slot */
+  int           spins = 0;              /* Times we have waited */
+
+
+  tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+    ring_wait(&spins);
+
+  slot  = ring->slot + tail % ring->slots;
+  *type = slot->type;
+  *len  = slot->len;
+
+  return (slot->data);
+}
+
+
+/*
+ * 'tpclRingPop()' - Give the read slot back to the writer.
+ */
+void
+tpclRingPop(tpcl_ring_t *ring)          /* I - Ring */
+{
+  atomic_store_explicit(&ring->tail,
+                        atomic_load_explicit(&ring->tail, memory_order_relaxed) + 1,
+                        memory_order_release);
+}
+
+
+/*
+ * 'ring_wait()' - Back off while the other side catches up.
+ *
+ * Spin with yields first, then sleep up to a millisecond so a stalled
+ * backend or upstream does not burn a core.
+ */
+static void
+ring_wait(int *spins)                   /* IO - Times we have waited */
+{
+  struct timespec ts;                   /* Sleep time */
+
+
+  if (*spins < 64)
+  {
+    (*spins) ++;
+    sched_yield();
+    return;
+  }
+
+  ts.tv_sec  = 0;
+  ts.tv_nsec = *spins < 1000 ? 50000 : 1000000;
+  (*spins) ++;
+  nanosleep(&ts, NULL);
+}
@@ -0,0 +1,43 @@
+/*
+ *   Single producer, single consumer ring buffer for the TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TPCL_RING_H_
+#define _TPCL_RING_H_
+
+#include <stddef.h>
+
+/*
+ * A ring is a fixed number of fixed size slots, each with a type and
+ * length chosen by the producer.  One thread may write and one other
+ * thread may read; neither takes a lock.  A full or empty ring makes the
+ * caller spin briefly and then sleep, so memory use is always bounded.
+ */
+typedef struct tpcl_ring_s tpcl_ring_t;
+
+extern tpcl_ring_t  *tpclRingNew(int slots, size_t slot_size);
+extern void         tpclRingDelete(tpcl_ring_t *ring);
+extern size_t       tpclRingSlotSize(tpcl_ring_t *ring);
+
+extern void         *tpclRingWriteSlot(tpcl_ring_t *ring);
+extern void         tpclRingPush(tpcl_ring_t *ring, int type, size_t len);
+
+extern void         *tpclRingReadSlot(tpcl_ring_t *ring, int *type, size_t *len);
+extern void         tpclRingPop(tpcl_ring_t *ring);
+
+#endif /* !_TPCL_RING_H_ */
@@ -0,0 +1,222 @@
+/*
+ *   Page and stage telemetry for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   tpclTelemetryOpen()  - Open the metrics and trace files.
+ *   tpclTelemetryClose() - Log the job summary and close the files.
+ *   tpclTelemetryTime()  - Current time in seconds.
+ *   tpclTelemetryPage()  - Record the metrics of a page.
+ *   tpclTelemetryTrace() - Record a timed span in the trace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "telemetry.h"
+
+
+/*
+ * Telemetry structure...
+ */
+struct tpcl_telemetry_s
+{
+  pthread_mutex_t       lock;           /* Protects everything below */
+  FILE                  *fp;            /* JSON lines metrics or NULL */
+  FILE                  *trace;         /* Chrome trace or NULL */
+  int                   events;         /* Trace events written */
+  double                start;          /* Time the job started */
+  tpcl_page_metrics_t   total;          /* Sums over all pages */
+  int                   pages;          /* Pages recorded */
+};
+
+
+/*
+ * 'tpclTelemetryOpen()' - Open the metrics and trace files.
+ *
+ * Either file name may be NULL; returns NULL if both are.
+ */
+tpcl_telemetry_t *                      /* O - Telemetry or NULL */
+tpclTelemetryOpen(const char *filename, /* I - Metrics file or NULL */
+                  const char *tracefile)/* I - Trace file or NULL */
+{
+  tpcl_telemetry_t      *t;             /* New telemetry */
+
+
+  if ((!filename || !*filename) && (!tracefile || !*tracefile))
+    return (NULL);
+
+  if ((t = calloc(1, sizeof(tpcl_telemetry_t))) == NULL)
+    return (NULL);
+
+  pthread_mutex_init(&t->lock, NULL);
+
+  t->start = tpclTelemetryTime();
+
+  if (filename && *filename && (t->fp = fopen(filename, "a")) == NULL)
+    fprintf(stderr, "DEBUG: Unable to open telemetry file \"%s\"\n", filename);
+
+  if (tracefile && *tracefile)
+  {
+    if ((t->trace = fopen(tracefile, "w")) == NULL)
+      fprintf(stderr, "DEBUG: Unable to open trace file \"%s\"\n", tracefile);
+    else
+      fputs("[\n", t->trace);
+  }
+
+  return (t);
+}
+
+
+/*
+ * 'tpclTelemetryClose()' - Log the job summary and close the files.
+ */
+void
+tpclTelemetryClose(tpcl_telemetry_t *t) /* I - Telemetry */
+{
+  tpcl_page_metrics_t   *total;         /* Sums over all pages */
+  double                elapsed;        /* Job time */
+  double                ratio;          /* Compression ratio */
+
+
+  if (!t)
+    return;
+
+  total   = &t->total;
+  elapsed = tpclTelemetryTime() - t->start;
+  ratio   = total->stats.bytes ?
+            (double)total->raster_bytes / total->stats.bytes : 0.0;
+
+  fprintf(stderr, "INFO: Sent %d pages, %ld bytes (%.1f:1) in %.2f seconds\n",
+          t->pages, total->stats.bytes, ratio, elapsed);
+  fprintf(stderr, "ATTR: tpcl-pages=%d tpcl-raster-bytes=%ld "
+                  "tpcl-output-bytes=%ld tpcl-graphics-objects=%d "
+                  "tpcl-read-seconds=%.3f tpcl-encode-seconds=%.3f "
+                  "tpcl-write-seconds=%.3f\n",
+          t->pages, total->raster_bytes, total->stats.bytes,
+          total->stats.objects, total->read_time, total->encode_time,
+          total->write_time);
+
+  if (t->fp)
+  {
+    fprintf(t->fp, "{\"job\":{\"pages\":%d,\"raster_bytes\":%ld,"
+                   "\"output_bytes\":%ld,\"ratio\":%.3f,\"objects\":%d,"
+                   "\"read_ms\":%.3f,\"encode_ms\":%.3f,\"write_ms\":%.3f,"
+                   "\"elapsed_ms\":%.3f}}\n",
+            t->pages, total->raster_bytes, total->stats.bytes, ratio,
+            total->stats.objects, total->read_time * 1000.0,
+            total->encode_time * 1000.0, total->write_time * 1000.0,
+            elapsed * 1000.0);
+    fclose(t->fp);
+  }
+
+  if (t->trace)
+  {
+    fputs("\n]\n", t->trace);
+    fclose(t->trace);
+  }
+
+  pthread_mutex_destroy(&t->lock);
+  free(t);
+}
+
+
+/*
+ * 'tpclTelemetryTime()' - Current time in seconds.
+ */
+double                                  /* O - Monotonic time */
+tpclTelemetryTime(void)
+{
+  struct timespec       ts;             /* Current time */
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (ts.tv_sec + ts.tv_nsec * 0.000000001);
+}
+
+
+/*
+ * 'tpclTelemetryPage()' - Record the metrics of a page.
+ */
+void
+tpclTelemetryPage(tpcl_telemetry_t          *t, /* I - Telemetry */
+                  const tpcl_page_metrics_t *m) /* I - Page metrics */
+{
+  if (!t)
+    return;
+
+  pthread_mutex_lock(&t->lock);
+
+  t->pages ++;
+  t->total.raster_bytes        += m->raster_bytes;
+  t->total.stats.lines         += m->stats.lines;
+  t->total.stats.blank_lines   += m->stats.blank_lines;
+  t->total.stats.changed_lines += m->stats.changed_lines;
+  t->total.stats.objects       += m->stats.objects;
+  t->total.stats.bytes         += m->stats.bytes;
+  t->total.read_time           += m->read_time;
+  t->total.encode_time         += m->encode_time;
+  t->total.write_time          += m->write_time;
+
+  if (t->fp)
+    fprintf(t->fp, "{\"page\":%d,\"copies\":%d,\"raster_bytes\":%ld,"
+                   "\"lines\":%d,\"blank_lines\":%d,\"changed_lines\":%d,"
+                   "\"output_bytes\":%ld,\"ratio\":%.3f,\"objects\":%d,"
+                   "\"read_ms\":%.3f,\"encode_ms\":%.3f,\"write_ms\":%.3f}\n",
+            m->page, m->copies, m->raster_bytes, m->stats.lines,
+            m->stats.blank_lines, m->stats.changed_lines, m->stats.bytes,
+            m->stats.bytes ? (double)m->raster_bytes / m->stats.bytes : 0.0,
+            m->stats.objects, m->read_time * 1000.0,
+            m->encode_time * 1000.0, m->write_time * 1000.0);
+
+  pthread_mutex_unlock(&t->lock);
+}
+
+
+/*
+ * 'tpclTelemetryTrace()' - Record a timed span in the trace.
+ */
+void
+tpclTelemetryTrace(tpcl_telemetry_t *t, /* I - Telemetry */
+                   const char       *name,      /* I - Span name */
+                   int              thread,     /* I - Thread number */
+                   int              page,       /* I - Page number or 0 */
+                   double           start,      /* I - Start time */
+                   double           end)        /* I - End time */
+{
+  if (!t || !t->trace)
+    return;
+
+  pthread_mutex_lock(&t->lock);
+
+  fprintf(t->trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.1f,\"dur\":%.1f",
+          t->events ? ",\n" : "", name, thread,
+          (start - t->start) * 1000000.0, (end - start) * 1000000.0);
+
+  if (page > 0)
+    fprintf(t->trace, ",\"args\":{\"page\":%d}}", page);
+  else
+    putc('}', t->trace);
+
+  t->events ++;
+
+  pthread_mutex_unlock(&t->lock);
+}
@@ -0,0 +1,56 @@
+/*
+ *   Page and stage telemetry for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TPCL_TELEMETRY_H_
+#define _TPCL_TELEMETRY_H_
+
+#include "tpcl.h"
+
+/*
+ * Each page is written as one JSON object per line to the metrics file,
+ * and each timed span as a complete event ("ph":"X") to an optional
+ * Chrome trace file that chrome://tracing or Perfetto can load.  Times
+ * are seconds from tpclTelemetryTime().  All functions may be called
+ * from several threads.
+ */
+typedef struct tpcl_telemetry_s tpcl_telemetry_t;
+
+typedef struct tpcl_page_metrics_s
+{
+  int               page;           /* Page number */
+  int               copies;         /* Issue quantity */
+  long              raster_bytes;   /* Raster bytes read */
+  tpcl_page_stats_t stats;          /* Library statistics */
+  double            read_time;      /* Seconds reading raster */
+  double            encode_time;    /* Seconds encoding */
+  double            write_time;     /* Seconds writing or blocked on output */
+} tpcl_page_metrics_t;
+
+extern tpcl_telemetry_t *tpclTelemetryOpen(const char *filename,
+                                           const char *tracefile);
+extern void             tpclTelemetryClose(tpcl_telemetry_t *t);
+extern double           tpclTelemetryTime(void);
+extern void             tpclTelemetryPage(tpcl_telemetry_t *t,
+                                          const tpcl_page_metrics_t *m);
+extern void             tpclTelemetryTrace(tpcl_telemetry_t *t,
+                                           const char *name, int thread,
+                                           int page, double start,
+                                           double end);
+
+#endif /* !_TPCL_TELEMETRY_H_ */
@@ -0,0 +1,842 @@
+/*
+ *   TOPIX compression kernels for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   TOPIXDirtySpan()    - Find the first and last byte that changed.
+ *   TOPIXEncodeLine()   - Encode one line against the previous one.
+ *   TOPIXDecodeLine()   - Apply one encoded line to the previous one.
+ *   TOPIXLineSpan()     - Find the bytes an encoded line changes.
+ *   TOPIXLineEncoder()  - Choose the line encoder for a width.
+ *   TOPIXSelectKernel() - Choose the fastest line encoder for this CPU.
+ *   TOPIXKernelName()   - Name of the line encoder in use.
+ *
+ * All kernels must produce exactly the same bytes; the SIMD versions only
+ * speed up the XOR, mask building and gathering of the non-zero bytes.
+ * Setting TOPIX_KERNEL=scalar|sse2|avx2 in the environment forces one.
+ *
+ * The SIMD kernels are also built for each print head width, with the
+ * width known at compile time so the group loop is unrolled and the
+ * partial last group is read as the last 64 bytes of the line instead of
+ * going through the scalar encoder.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "topix.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define TOPIX_HAVE_X86 1
+#  include <immintrin.h>
+#endif /* __GNUC__ && x86 */
+
+
+/*
+ * Local functions...
+ */
+static int  topix_encode_scalar(const unsigned char *buffer,
+                                const unsigned char *last,
+                                int width, unsigned char *out);
+static void topix_select_kernel(void);
+
+/*
+ * Globals...
+ */
+static pthread_once_t KernelOnce = PTHREAD_ONCE_INIT;
+static topix_kernel_t Kernel = NULL;
+static const char   *KernelName = "scalar";
+
+
+/*
+ * 'topix_encode_scalar()' - Portable TOPIX line encoder.
+ *
+ * Mask bytes are reserved before their group is walked and dropped
+ * again if nothing in the group changed.
+ */
+static int
+topix_encode_scalar(const unsigned char *buffer,  /* I - Current line */
+                    const unsigned char *last,    /* I - Previous line */
+                    int                 width,    /* I - Bytes per line */
+                    unsigned char       *out)     /* O - Encoded line */
+{
+  int               i;              /* Index into buffer */
+  int               l1, l2, l3;     /* Current positions in line */
+  unsigned char     cl1, cl2, cl3;  /* Current change masks */
+  unsigned char     *cl2ptr;        /* Reserved CL2 byte */
+  unsigned char     *cl3ptr;        /* Reserved CL3 byte */
+  unsigned char     xor;            /* Current XORed character */
+  unsigned char     *ptr;           /* Pointer into out */
+
+
+  if (width > TOPIX_MAX_WIDTH)
+    width = TOPIX_MAX_WIDTH;
+
+  ptr = out + 1;
+  cl1 = 0;
+  i   = 0;
+
+  for (l1 = 0; l1 < 8 && i < width; l1++)
+  {
+    cl2    = 0;
+    cl2ptr = ptr++;
+    for (l2 = 0; l2 < 8 && i < width; l2++)
+    {
+      cl3    = 0;
+      cl3ptr = ptr++;
+      for (l3 = 0; l3 < 8 && i < width; l3++, i++)
+      {
+        xor = buffer[i] ^ last[i];
+        if (xor)
+        {
+          cl3    |= 0x80 >> l3;
+          *ptr++ = xor;
+        }
+      }
+
+      if (cl3)
+      {
+        *cl3ptr = cl3;
+        cl2     |= 0x80 >> l2;
+      }
+      else
+        ptr--;
+    }
+
+    if (cl2)
+    {
+      *cl2ptr = cl2;
+      cl1     |= 0x80 >> l1;
+    }
+    else
+      ptr--;
+  }
+
+  out[0] = cl1;
+
+  return ((int)(ptr - out));
+}
+
+
+#ifdef TOPIX_HAVE_X86
+/*
+ * Tables shared by the SIMD kernels: movemask gives the first byte in the
+ * lowest bit while TOPIX wants it in the highest, and the AVX2 kernel
+ * packs the non-zero bytes of each 8 byte group with a shuffle.
+ */
+static unsigned char  BitReverse[256];
+static unsigned char  Shuffle[256][8];
+
+
+/*
+ * 'topix_init_tables()' - Fill in the SIMD lookup tables.
+ */
+static void
+topix_init_tables(void)
+{
+  int   m, b, n;                    /* Mask, bit, count */
+
+
+  for (m = 0; m < 256; m++)
+  {
+    BitReverse[m] = 0;
+    for (b = 0, n = 0; b < 8; b++)
+      if (m & (1 << b))
+      {
+        BitReverse[m] |= 0x80 >> b;
+        Shuffle[m][n++] = (unsigned char)b;
+      }
+
+    while (n < 8)
+      Shuffle[m][n++] = 0x80;       /* pshufb writes zero */
+  }
+}
+
+
+/*
+ * 'topix_emit_group()' - Write CL2, CL3 and the data for one 64 byte group.
+ *
+ * nz has one bit per non-zero byte of xor, first byte lowest.
+ */
+static inline unsigned char *
+topix_emit_group(const unsigned char *xor,  /* I - XORed bytes */
+                 unsigned long long  nz,    /* I - Non-zero byte mask */
+                 unsigned char       *ptr)  /* I - Output position */
+{
+  unsigned char     *cl2ptr;        /* Reserved CL2 byte */
+  unsigned char     cl2;            /* CL2 mask */
+  unsigned          m;              /* CL3 mask, movemask order */
+  int               l2;             /* Group in line */
+
+
+  cl2    = 0;
+  cl2ptr = ptr++;
+
+  for (l2 = 0; l2 < 8; l2++, nz >>= 8, xor += 8)
+  {
+    if ((m = (unsigned)(nz & 0xff)) == 0)
+      continue;
+
+    cl2    |= 0x80 >> l2;
+    *ptr++ = BitReverse[m];
+
+    do
+    {
+      *ptr++ = xor[__builtin_ctz(m)];
+      m &= m - 1;
+    }
+    while (m);
+  }
+
+  *cl2ptr = cl2;
+
+  return (ptr);
+}
+
+
+/*
+ * 'topix_encode_sse2()' - SSE2 TOPIX line encoder.
+ */
+__attribute__((target("sse2")))
+static int
+topix_encode_sse2(const unsigned char *buffer,  /* I - Current line */
+                  const unsigned char *last,    /* I - Previous line */
+                  int                 width,    /* I - Bytes per line */
+                  unsigned char       *out)     /* O - Encoded line */
+{
+  unsigned char     xor[64] __attribute__((aligned(16)));
+                                    /* XORed group */
+  unsigned long long nz;            /* Non-zero byte mask */
+  unsigned char     *ptr;           /* Pointer into out */
+  unsigned char     *tail, save;    /* Partial group position */
+  unsigned char     cl1;            /* CL1 mask */
+  int               i, l1, k;       /* Looping vars */
+  __m128i           v, zero;        /* Vectors */
+
+
+  if (width > TOPIX_MAX_WIDTH)
+    width = TOPIX_MAX_WIDTH;
+
+  zero = _mm_setzero_si128();
+  ptr  = out + 1;
+  cl1  = 0;
+
+  for (l1 = 0, i = 0; i + 64 <= width; l1++, i += 64)
+  {
+    for (k = 0, nz = 0; k < 4; k++)
+    {
+      v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buffer + i + k * 16)),
+                        _mm_loadu_si128((const __m128i *)(last + i + k * 16)));
+      _mm_store_si128((__m128i *)(xor + k * 16), v);
+      nz |= (unsigned long long)(~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) &
+                                 0xffff) << (k * 16);
+    }
+
+    if (nz)
+    {
+      cl1 |= 0x80 >> l1;
+      ptr = topix_emit_group(xor, nz, ptr);
+    }
+  }
+
+  if (i < width)
+  {
+   /*
+    * Partial last group, let the scalar encoder do it over the previous
+    * byte (its CL1 lands there) and merge the masks.
+    */
+    tail = ptr - 1;
+    save = *tail;
+    k    = topix_encode_scalar(buffer + i, last + i, width - i, tail);
+    if (*tail)
+    {
+      cl1 |= 0x80 >> l1;
+      ptr += k - 1;
+    }
+    *tail = save;
+  }
+
+  out[0] = cl1;
+
+  return ((int)(ptr - out));
+}
+
+
+/*
+ * 'topix_emit_group_avx2()' - Write one 64 byte group with pshufb.
+ *
+ * Like topix_emit_group(), but the non-zero bytes of each 8 byte group
+ * are packed with one shuffle.  Up to 8 bytes past the last changed byte
+ * of xor may be read, and up to 7 bytes past the end of the group written.
+ */
+__attribute__((target("avx2")))
+static inline unsigned char *
+topix_emit_group_avx2(const unsigned char *xor, /* I - XORed bytes */
+                      unsigned long long  nz,   /* I - Non-zero byte mask */
+                      unsigned char       *ptr) /* I - Output position */
+{
+  unsigned char     *cl2ptr;        /* Reserved CL2 byte */
+  unsigned char     cl2;            /* CL2 mask */
+  unsigned          m;              /* CL3 mask, movemask order */
+  int               l2;             /* Group in line */
+
+
+  cl2    = 0;
+  cl2ptr = ptr++;
+
+  for (l2 = 0; l2 < 8; l2++, nz >>= 8)
+  {
+    if ((m = (unsigned)(nz & 0xff)) == 0)
+      continue;
+
+    cl2    |= 0x80 >> l2;
+    *ptr++ = BitReverse[m];
+
+    _mm_storel_epi64((__m128i *)ptr,
+                     _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i *)(xor + l2 * 8)),
+                                      _mm_loadl_epi64((const __m128i *)Shuffle[m])));
+    ptr += __builtin_popcount(m);
+  }
+
+  *cl2ptr = cl2;
+
+  return (ptr);
+}
+
+
+/*
+ * 'topix_encode_avx2()' - AVX2 TOPIX line encoder.
+ *
+ * Each 64 byte group is handled with two 32 byte compares and the
+ * non-zero bytes are packed 8 at a time with pshufb.
+ */
+__attribute__((target("avx2")))
+static int
+topix_encode_avx2(const unsigned char *buffer,  /* I - Current line */
+                  const unsigned char *last,    /* I - Previous line */
+                  int                 width,    /* I - Bytes per line */
+                  unsigned char       *out)     /* O - Encoded line */
+{
+  unsigned char     xor[64] __attribute__((aligned(32)));
+                                    /* XORed group */
+  unsigned long long nz;            /* Non-zero byte mask */
+  unsigned char     *ptr;           /* Pointer into out */
+  unsigned char     *tail, save;    /* Partial group position */
+  unsigned char     cl1;            /* CL1 mask */
+  int               i, l1, k;       /* Looping vars */
+  __m256i           a, b, zero;     /* Vectors */
+
+
+  if (width > TOPIX_MAX_WIDTH)
+    width = TOPIX_MAX_WIDTH;
+
+  zero = _mm256_setzero_si256();
+  ptr  = out + 1;
+  cl1  = 0;
+
+  for (l1 = 0, i = 0; i + 64 <= width; l1++, i += 64)
+  {
+    a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buffer + i)),
+                         _mm256_loadu_si256((const __m256i *)(last + i)));
+    b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buffer + i + 32)),
+                         _mm256_loadu_si256((const __m256i *)(last + i + 32)));
+
+    nz = ~(((unsigned long long)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, zero)) << 32) |
+           (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero)));
+    if (!nz)
+      continue;
+
+    _mm256_store_si256((__m256i *)xor, a);
+    _mm256_store_si256((__m256i *)(xor + 32), b);
+
+    cl1 |= 0x80 >> l1;
+    ptr = topix_emit_group_avx2(xor, nz, ptr);
+  }
+
+  if (i < width)
+  {
+    tail = ptr - 1;
+    save = *tail;
+    k    = topix_encode_scalar(buffer + i, last + i, width - i, tail);
+    if (*tail)
+    {
+      cl1 |= 0x80 >> l1;
+      ptr += k - 1;
+    }
+    *tail = save;
+  }
+
+  out[0] = cl1;
+
+  return ((int)(ptr - out));
+}
+
+
+/*
+ * 'topix_fixed_sse2()' - SSE2 TOPIX line encoder for a fixed width.
+ *
+ * Always inlined with a constant width of at least 64 bytes.  The last
+ * 64 bytes of the line are XORed for a partial last group and the mask
+ * shifted down to the bytes of that group, so nothing past the end of
+ * the line is read.
+ */
+__attribute__((target("sse2"), always_inline))
+static inline int
+topix_fixed_sse2(const unsigned char *buffer, /* I - Current line */
+                 const unsigned char *last,   /* I - Previous line */
+                 int                 width,   /* I - Bytes per line */
+                 unsigned char       *out)    /* O - Encoded line */
+{
+  unsigned char     xor[64] __attribute__((aligned(16)));
+                                    /* XORed group */
+  unsigned long long nz;            /* Non-zero byte mask */
+  unsigned char     *ptr;           /* Pointer into out */
+  unsigned char     cl1;            /* CL1 mask */
+  int               i, l1, k, skip; /* Looping vars */
+  __m128i           v, zero;        /* Vectors */
+
+
+  zero = _mm_setzero_si128();
+  ptr  = out + 1;
+  cl1  = 0;
+
+  for (l1 = 0, i = 0; i < width; l1++, i += 64)
+  {
+    if ((skip = i + 64 - width) < 0)
+      skip = 0;
+
+    for (k = 0, nz = 0; k < 4; k++)
+    {
+      v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buffer + i - skip + k * 16)),
+                        _mm_loadu_si128((const __m128i *)(last + i - skip + k * 16)));
+      _mm_store_si128((__m128i *)(xor + k * 16), v);
+      nz |= (unsigned long long)(~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) &
+                                 0xffff) << (k * 16);
+    }
+
+    if ((nz >>= skip) != 0)
+    {
+      cl1 |= 0x80 >> l1;
+      ptr = topix_emit_group(xor + skip, nz, ptr);
+    }
+  }
+
+  out[0] = cl1;
+
+  return ((int)(ptr - out));
+}
+
+
+/*
+ * 'topix_fixed_avx2()' - AVX2 TOPIX line encoder for a fixed width.
+ *
+ * As topix_fixed_sse2().  The XORed bytes are kept with 8 bytes to spare
+ * for the shuffles of a partial last group.
+ */
+__attribute__((target("avx2"), always_inline))
+static inline int
+topix_fixed_avx2(const unsigned char *buffer, /* I - Current line */
+                 const unsigned char *last,   /* I - Previous line */
+                 int                 width,   /* I - Bytes per line */
+                 unsigned char       *out)    /* O - Encoded line */
+{
+  unsigned char     xor[64 + 8] __attribute__((aligned(32)));
+                                    /* XORed group */
+  unsigned long long nz;            /* Non-zero byte mask */
+  unsigned char     *ptr;           /* Pointer into out */
+  unsigned char     cl1;            /* CL1 mask */
+  int               i, l1, skip;    /* Looping vars */
+  __m256i           a, b, zero;     /* Vectors */
+
+
+  zero = _mm256_setzero_si256();
+  ptr  = out + 1;
+  cl1  = 0;
+
+  _mm_storel_epi64((__m128i *)(xor + 64), _mm_setzero_si128());
+
+  for (l1 = 0, i = 0; i < width; l1++, i += 64)
+  {
+    if ((skip = i + 64 - width) < 0)
+      skip = 0;
+
+    a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buffer + i - skip)),
+                         _mm256_loadu_si256((const __m256i *)(last + i - skip)));
+    b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buffer + i - skip + 32)),
+                         _mm256_loadu_si256((const __m256i *)(last + i - skip + 32)));
+
+    nz = ~(((unsigned long long)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, zero)) << 32) |
+           (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero)));
+    if ((nz >>= skip) == 0)
+      continue;
+
+    _mm256_store_si256((__m256i *)xor, a);
+    _mm256_store_si256((__m256i *)(xor + 32), b);
+
+    cl1 |= 0x80 >> l1;
+    ptr = topix_emit_group_avx2(xor + skip, nz, ptr);
+  }
+
+  out[0] = cl1;
+
+  return ((int)(ptr - out));
+}
+
+
+/*
+ * Bytes per line of the print heads, from the MaxSize widths and
+ * resolutions of the models in tectpcl2.drv: (points * dpi / 72 + 7) / 8.
+ */
+#define TOPIX_HEAD_WIDTHS(W) \
+  W(104) W(106) W(108) W(128) W(157) W(160) W(171) W(189) W(214) W(252) \
+  W(315) W(320)
+
+#define TOPIX_FIXED_ENCODERS(w) \
+  __attribute__((target("sse2"))) \
+  static int topix_sse2_##w(const unsigned char *buffer, \
+                            const unsigned char *last, int width, \
+                            unsigned char *out) \
+  { (void)width; return (topix_fixed_sse2(buffer, last, w, out)); } \
+  __attribute__((target("avx2"))) \
+  static int topix_avx2_##w(const unsigned char *buffer, \
+                            const unsigned char *last, int width, \
+                            unsigned char *out) \
+  { (void)width; return (topix_fixed_avx2(buffer, last, w, out)); }
+
+TOPIX_HEAD_WIDTHS(TOPIX_FIXED_ENCODERS)
+
+#define TOPIX_FIXED_ENTRY(w) { w, topix_sse2_##w, topix_avx2_##w },
+
+static const struct
+{
+  int               width;          /* Bytes per line */
+  topix_kernel_t    sse2,           /* SSE2 encoder */
+                    avx2;           /* AVX2 encoder */
+} FixedEncoders[] =
+{
+  TOPIX_HEAD_WIDTHS(TOPIX_FIXED_ENTRY)
+};
+#endif /* TOPIX_HAVE_X86 */
+
+
+/*
+ * 'TOPIXDirtySpan()' - Find the first and last byte that changed.
+ *
+ * Lines are compared a machine word at a time from both ends, so blank
+ * margins and unchanged lines cost a handful of loads.  Returns 0 and
+ * leaves first/end alone if the lines are identical.
+ */
+int
+TOPIXDirtySpan(const unsigned char *buffer,   /* I - Current line */
+               const unsigned char *last,     /* I - Previous line */
+               int                 width,     /* I - Bytes per line */
+               int                 *first,    /* O - First changed byte */
+               int                 *end)      /* O - One past last changed byte */
+{
+  int               i, j;           /* Byte positions */
+  uint64_t          a, b;           /* Words being compared */
+
+
+  for (i = 0; i + 8 <= width; i += 8)
+  {
+    memcpy(&a, buffer + i, 8);
+    memcpy(&b, last + i, 8);
+    if (a != b)
+      break;
+  }
+
+  while (i < width && buffer[i] == last[i])
+    i++;
+
+  if (i >= width)
+    return (0);
+
+  for (j = width; j - 8 >= i; j -= 8)
+  {
+    memcpy(&a, buffer + j - 8, 8);
+    memcpy(&b, last + j - 8, 8);
+    if (a != b)
+      break;
+  }
+
+  while (buffer[j - 1] == last[j - 1])
+    j--;
+
+  *first = i;
+  *end   = j;
+
+  return (1);
+}
+
+
+/*
+ * 'TOPIXEncodeLine()' - Encode one line against the previous one.
+ *
+ * Only the 64 byte CL1 groups that hold the dirty span are handed to the
+ * kernel; groups are encoded independently, so the kernel's CL1 just has
+ * to be shifted into place.  Unchanged lines come out as a single zero.
+ */
+int
+TOPIXEncodeLine(const unsigned char *buffer,  /* I - Current line */
+                const unsigned char *last,    /* I - Previous line */
+                int                 width,    /* I - Bytes per line */
+                unsigned char       *out)     /* O - Encoded line */
+{
+  int               first, end;     /* Dirty span */
+  int               len;            /* Encoded length */
+
+
+  if (width > TOPIX_MAX_WIDTH)
+    width = TOPIX_MAX_WIDTH;
+
+  if (!TOPIXDirtySpan(buffer, last, width, &first, &end))
+  {
+    *out = 0;
+    return (1);
+  }
+
+  pthread_once(&KernelOnce, topix_select_kernel);
+
+  first &= ~63;
+  end   = (end + 63) & ~63;
+  if (end > width)
+    end = width;
+
+  len    = (*Kernel)(buffer + first, last + first, end - first, out);
+  out[0] >>= first / 64;
+
+  return (len);
+}
+
+
+/*
+ * 'TOPIXDecodeLine()' - Apply one encoded line to the previous one.
+ *
+ * line holds the previous line on entry and the decoded line on return.
+ * Bytes addressed beyond width are consumed but dropped.
+ */
+int                                         /* O - Bytes used or -1 if short */
+TOPIXDecodeLine(const unsigned char *in,    /* I - Encoded data */
+                int                 len,    /* I - Bytes available */
+                unsigned char       *line,  /* IO - Line to update */
+                int                 width)  /* I - Bytes per line */
+{
+  int               p;              /* Position in input */
+  int               i;              /* Index into line */
+  int               l1, l2, l3;     /* Current positions in line */
+  unsigned char     cl1, cl2, cl3;  /* Current change masks */
+
+
+  if (len < 1)
+    return (-1);
+
+  cl1 = in[0];
+  p   = 1;
+
+  for (l1 = 0; l1 < 8; l1++)
+  {
+    if (!(cl1 & (0x80 >> l1)))
+      continue;
+
+    if (p >= len)
+      return (-1);
+    cl2 = in[p++];
+
+    for (l2 = 0; l2 < 8; l2++)
+    {
+      if (!(cl2 & (0x80 >> l2)))
+        continue;
+
+      if (p >= len)
+        return (-1);
+      cl3 = in[p++];
+
+      for (l3 = 0; l3 < 8; l3++)
+      {
+        if (!(cl3 & (0x80 >> l3)))
+          continue;
+
+        if (p >= len)
+          return (-1);
+
+        i = l1 * 64 + l2 * 8 + l3;
+        if (i < width)
+          line[i] ^= in[p];
+        p++;
+      }
+    }
+  }
+
+  return (p);
+}
+
+
+/*
+ * 'TOPIXLineSpan()' - Find the bytes an encoded line changes.
+ *
+ * Only the masks are read.  first and end are widened to take in the
+ * changed bytes and left alone for an unchanged line.
+ */
+int                                         /* O - Bytes used or -1 if short */
+TOPIXLineSpan(const unsigned char *in,      /* I - Encoded data */
+              int                 len,      /* I - Bytes available */
+              int                 *first,   /* IO - First changed byte */
+              int                 *end)     /* IO - One past last changed byte */
+{
+  int               p;              /* Position in input */
+  int               i;              /* Index into line */
+  int               l1, l2, l3;     /* Current positions in line */
+  unsigned char     cl1, cl2, cl3;  /* Current change masks */
+
+
+  if (len < 1)
+    return (-1);
+
+  cl1 = in[0];
+  p   = 1;
+
+  for (l1 = 0; l1 < 8; l1++)
+  {
+    if (!(cl1 & (0x80 >> l1)))
+      continue;
+
+    if (p >= len)
+      return (-1);
+    cl2 = in[p++];
+
+    for (l2 = 0; l2 < 8; l2++)
+    {
+      if (!(cl2 & (0x80 >> l2)))
+        continue;
+
+      if (p >= len)
+        return (-1);
+      cl3 = in[p++];
+
+      for (l3 = 0; l3 < 8; l3++)
+      {
+        if (!(cl3 & (0x80 >> l3)))
+          continue;
+
+        i = l1 * 64 + l2 * 8 + l3;
+        if (i < *first)
+          *first = i;
+        if (i >= *end)
+          *end = i + 1;
+        p++;
+      }
+    }
+  }
+
+  return (p > len ? -1 : p);
+}
+
+
+/*
+ * 'TOPIXLineEncoder()' - Choose the line encoder for a width.
+ *
+ * Returns an encoder built for the width with the chosen kernel, or
+ * TOPIXEncodeLine() for other widths and the scalar kernel.  Either one
+ * gives exactly the same bytes.
+ */
+topix_kernel_t                              /* O - Line encoder */
+TOPIXLineEncoder(int width)                 /* I - Bytes per line */
+{
+#ifdef TOPIX_HAVE_X86
+  int               i;              /* Looping var */
+
+
+  pthread_once(&KernelOnce, topix_select_kernel);
+
+  if (Kernel == topix_encode_scalar)
+    return (TOPIXEncodeLine);
+
+  for (i = 0; i < (int)(sizeof(FixedEncoders) / sizeof(FixedEncoders[0])); i++)
+    if (FixedEncoders[i].width == width)
+      return (Kernel == topix_encode_avx2 ? FixedEncoders[i].avx2 :
+                                            FixedEncoders[i].sse2);
+#else
+  (void)width;
+#endif /* TOPIX_HAVE_X86 */
+
+  return (TOPIXEncodeLine);
+}
+
+
+/*
+ * 'TOPIXSelectKernel()' - Choose the fastest line encoder for this CPU.
+ *
+ * The choice and the lookup tables are made once per process, so any
+ * thread may call this or start encoding at any time.
+ */
+void
+TOPIXSelectKernel(void)
+{
+  pthread_once(&KernelOnce, topix_select_kernel);
+}
+
+
+/*
+ * 'TOPIXKernelName()' - Name of the line encoder in use.
+ */
+const char *
+TOPIXKernelName(void)
+{
+  return (KernelName);
+}
+
+
+/*
+ * 'topix_select_kernel()' - Fill in the tables and choose the kernel.
+ */
+static void
+topix_select_kernel(void)
+{
+  const char        *force;         /* TOPIX_KERNEL environment variable */
+  topix_kernel_t    kernel;         /* Chosen kernel */
+
+
+  force      = getenv("TOPIX_KERNEL");
+  kernel     = topix_encode_scalar;
+  KernelName = "scalar";
+
+#ifdef TOPIX_HAVE_X86
+  topix_init_tables();
+
+  __builtin_cpu_init();
+
+  if (force && !strcmp(force, "scalar"))
+    ;
+  else if (__builtin_cpu_supports("avx2") && (!force || !strcmp(force, "avx2")))
+  {
+    kernel     = topix_encode_avx2;
+    KernelName = "avx2";
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    kernel     = topix_encode_sse2;
+    KernelName = "sse2";
+  }
+#else
+  (void)force;
+#endif /* TOPIX_HAVE_X86 */
+
+  Kernel = kernel;
+}
+
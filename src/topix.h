@@ -0,0 +1,59 @@
+/*
+ *   TOPIX compression kernels for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TOPIX_H_
+#define _TOPIX_H_
+
+/*
+ * A TOPIX line is addressed by three levels of change masks: CL1 selects
+ * 64 byte groups, CL2 selects 8 byte groups within them and CL3 selects
+ * the changed bytes themselves, so at most 8 * 8 * 8 bytes can be sent.
+ */
+#define TOPIX_MAX_WIDTH   512
+#define TOPIX_MAX_LINE    (1 + 8 + 64 + TOPIX_MAX_WIDTH)
+
+/*
+ * Extra bytes the kernels may scribble past the end of the encoded line.
+ * Output buffers must always leave this much room after the worst case.
+ */
+#define TOPIX_SLACK       16
+
+/*
+ * Line encoder kernel: XOR buffer with last, write CL1/CL2/CL3 masks and
+ * the non-zero bytes to out and return the number of bytes used.
+ */
+typedef int (*topix_kernel_t)(const unsigned char *buffer,
+                              const unsigned char *last,
+                              int width, unsigned char *out);
+
+extern int          TOPIXDirtySpan(const unsigned char *buffer,
+                                   const unsigned char *last, int width,
+                                   int *first, int *end);
+extern int          TOPIXEncodeLine(const unsigned char *buffer,
+                                    const unsigned char *last,
+                                    int width, unsigned char *out);
+extern int          TOPIXDecodeLine(const unsigned char *in, int len,
+                                    unsigned char *line, int width);
+extern int          TOPIXLineSpan(const unsigned char *in, int len,
+                                  int *first, int *end);
+extern topix_kernel_t TOPIXLineEncoder(int width);
+extern void         TOPIXSelectKernel(void);
+extern const char   *TOPIXKernelName(void);
+
+#endif /* !_TOPIX_H_ */
@@ -0,0 +1,2194 @@
+/*
+ *   Toshiba TEC TPCL label encoding library.
+ *
+ *   Copyright 2001-2007 by Easy Software Products.
+ *   Copyright 2009 by Patrick Kong
+ *   Copyright 2010 by Sam Lown
+ *
+ *   Based on Source from CUPS printing system and rastertolabel filter.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contents:
+ *
+ *   tpclDefaultSettings() - Fill in the PPD default settings.
+ *   tpclJobNew()          - Create a job writing to a callback.
+ *   tpclJobDelete()       - Free a job.
+ *   tpclJobReset()        - Start another job with the same settings.
+ *   tpclJobSetLog()       - Set the DEBUG message callback.
+ *   tpclJobSetup()        - Prepare the printer for printing.
+ *   tpclJobSetThreads()   - Set the number of threads for tall pages.
+ *   tpclJobCancel()       - Cancel the job, safe from a signal handler.
+ *   tpclJobCanceled()     - Has the job been canceled?
+ *   tpclPageStart()       - Start a page of graphics.
+ *   tpclPageBuffer()      - Line buffer that can be filled by the caller.
+ *   tpclPageWriteLine()   - Output a line of graphics.
+ *   tpclPageWriteLines()  - Output several lines of graphics.
+ *   tpclPageWriteRepeat() - Output a line several times.
+ *   tpclPageWriteGraphics() - Send already encoded graphics for a page.
+ *   tpclPageEndGraphics() - Finish the graphics of a page.
+ *   tpclPageRepeatable()  - Can the page be issued several times at once?
+ *   tpclPageEnd()         - Finish a page of graphics.
+ *   tpclPageEndCopies()   - Finish a page, printing it a number of times.
+ *   tpclPageStats()       - Get the statistics of the current page.
+ *
+ *   tpcl_reserve()        - Grow a job buffer when it is too small.
+ *   tpcl_dither()         - Convert a grayscale line to 1 bit.
+ *   tpcl_orient_line()    - Mirror and/or invert a line.
+ *   tpcl_orient_page()    - Rotate and send a kept page.
+ *   tpcl_encode_line()    - Encode a line in the page's graphics mode.
+ *   tpcl_encode_lines()   - Encode several lines.
+ *   tpcl_frame_output()   - Send a kept page in full or as changes.
+ *   tpcl_delta_output()   - Send the areas that changed since the last page.
+ *   tpcl_delta_rect()     - Send one changed area.
+ *   tpcl_delta_object()   - Send the graphics object of a changed area.
+ *   tpcl_topix_compress() - Compress a line into TEC's TOPIX format.
+ *   tpcl_topix_repeat()   - Compress repeats of the last line.
+ *   tpcl_topix_blank()    - Send or skip a run of blank lines.
+ *   tpcl_topix_output()   - Send current contents of TOPIX data.
+ *   tpcl_topix_raw()      - Send a TOPIX object as raw graphics if smaller.
+ *   tpcl_raw_line()       - Collect a raw graphics line.
+ *   tpcl_raw_output()     - Send the ink box of the raw graphics lines.
+ *   tpcl_topix_bands()    - Compress many lines on several threads.
+ *   tpcl_band_encode()    - Encode each line of a band against the one above.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
+#include "tpcl.h"
+#include "topix.h"
+#include "dither.h"
+#include "orient.h"
+
+
+/*
+ * Size of the TOPIX compression buffer, the data length is sent as a
+ * 16 bit number so a graphics object can never be larger.
+ */
+#define TPCL_COMP_SIZE    0xFFFF
+
+/*
+ * Each graphics block buffer has room for the {SG} header and length in
+ * front of the data and the "|}\n" trailer (within TOPIX_SLACK) after it,
+ * so a block is handed to the write callback in one piece.
+ */
+#define TPCL_BLOCK_HEAD   64
+#define TPCL_BLOCK_SIZE(n) (TPCL_BLOCK_HEAD + (n) + TOPIX_SLACK)
+
+/*
+ * Raw graphics objects have no length field, so they are collected in
+ * larger blocks to keep the number of objects down.
+ */
+#define TPCL_RAW_SIZE     0x40000
+
+/*
+ * A TOPIX object is sent once less than a worst case line is left, and
+ * no object can be taller than its 4 digit height.  A run of blank lines
+ * ends the object when encoding it would cost more than TPCL_BLOCK_COST
+ * bytes, so a new object (about 32 bytes of header and trailer) saves at
+ * least as much.
+ */
+#define TPCL_COMP_LIMIT(w) (TPCL_COMP_SIZE - ((w) + ((w) / 8) * 3))
+#define TPCL_BLOCK_LINES  9999
+#define TPCL_BLOCK_COST   128
+
+/*
+ * Graphics state of a page...
+ */
+#define TPCL_GRAPHICS_NONE  0           /* Nothing sent yet */
+#define TPCL_GRAPHICS_OPEN  1           /* Graphics being sent */
+#define TPCL_GRAPHICS_DONE  2           /* Graphics complete */
+
+/*
+ * Tall pages are split into bands of at least this many lines, one per
+ * thread, and at most TPCL_MAX_THREADS bands.
+ */
+#define TPCL_BAND_LINES   256
+#define TPCL_MAX_THREADS  64
+
+/*
+ * Orientation of a page, applied in this order.  Rotated and upside down
+ * pages are kept in memory until they are complete, up to
+ * TPCL_ORIENT_LIMIT bytes; larger pages are rejected rather than printed
+ * the wrong way round.
+ */
+#define TPCL_ORIENT_TRANSPOSE 1         /* Swap lines and columns */
+#define TPCL_ORIENT_VFLIP     2         /* Reverse the order of the lines */
+#define TPCL_ORIENT_HFLIP     4         /* Reverse each line */
+#define TPCL_ORIENT_INVERT    8         /* Invert every pixel */
+#define TPCL_ORIENT_LIMIT     0x4000000
+
+/*
+ * Incremental pages are kept up to the same size, to be compared with
+ * the next one.  Changed lines are gathered into one area while the
+ * unchanged bytes this adds cost less than a new graphics object.
+ */
+#define TPCL_FRAME_LIMIT      0x4000000
+
+
+/*
+ * Band of lines encoded by one thread...
+ */
+typedef struct tpcl_band_s
+{
+  const unsigned char   *lines;         /* First line of the band */
+  const unsigned char   *prev;          /* Line above the band */
+  int                   count;          /* Number of lines */
+  int                   width;          /* Bytes per line */
+  topix_kernel_t        encode;         /* TOPIX line encoder */
+  unsigned char         *data;          /* Encoded lines */
+  int                   *lengths;       /* Encoded length of each line */
+} tpcl_band_t;
+
+
+/*
+ * Job structure...
+ */
+struct tpcl_job_s
+{
+  tpcl_settings_t       settings;       /* Resolved PPD options */
+  tpcl_write_cb_t       write_cb;       /* Output callback */
+  void                  *write_data;    /* Output callback data */
+  tpcl_log_cb_t         log_cb;         /* DEBUG message callback */
+  void                  *log_data;      /* DEBUG message callback data */
+  volatile sig_atomic_t canceled;       /* Non-zero if job is canceled */
+  int                   error;          /* Non-zero if output failed */
+  int                   rejected;       /* Current page is not printed */
+  int                   threads;        /* Threads for tpclPageWriteLines() */
+  int                   detect;         /* {XS} label sensor */
+  char                  speed;          /* {XS} print speed */
+  unsigned char         *arena;         /* Page buffers, kept between pages */
+  size_t                arena_size;     /* Size of arena */
+  unsigned char         *scratch;       /* Band buffers, kept between pages */
+  size_t                scratch_size;   /* Size of scratch */
+  unsigned char         *mono;          /* Dithered lines, kept between pages */
+  size_t                mono_size;      /* Size of mono */
+  unsigned char         *pages;         /* Rotation buffers, kept between pages */
+  size_t                pages_size;     /* Size of pages */
+  unsigned char         *frames[2];     /* Current and last incremental page */
+  size_t                frames_size[2]; /* Size of frames */
+  int                   frame_index;    /* frames[] of the current page */
+  int                   allocs;         /* Heap allocations so far */
+  int                   page_allocs;    /* Heap allocations before this page */
+  tpcl_page_stats_t     stats;          /* Statistics of the page */
+
+  cups_page_header2_t   header;         /* Current page header */
+  int                   gmode;          /* Tec Graphics mode */
+  int                   automatic;      /* TEC_GMODE_AUTO, raw when smaller */
+  int                   graphics;       /* TPCL_GRAPHICS_xxx */
+  int                   width;          /* Bytes per line */
+  topix_kernel_t        encode;         /* TOPIX line encoder for width */
+  int                   y;              /* Current line */
+  int                   gray;           /* Non-zero for 8-bit grayscale */
+  int                   invert;         /* Grayscale has 255 for white */
+  int                   gray_width;     /* Bytes per grayscale line */
+  unsigned char         *gray_buffer;   /* Grayscale line buffer */
+  unsigned char         *thresholds;    /* Dither threshold rows */
+  int                   *errors;        /* Error diffusion line */
+  int                   orient;         /* TPCL_ORIENT_xxx */
+  int                   pixels;         /* Pixels per line sent */
+  int                   src_width;      /* Bytes per kept line */
+  unsigned char         *page;          /* Kept page or NULL */
+  unsigned char         *orient_buffer; /* Mirrored line */
+  unsigned char         *frame;         /* Kept incremental page or NULL */
+  int                   frame_lines;    /* Lines in frame */
+  int                   delta;          /* Send changes to the last frame? */
+  int                   last_valid;     /* Last frame is in the printer? */
+  int                   last_width;     /* Bytes per line of last frame */
+  int                   last_lines;     /* Lines in last frame */
+  int                   last_gmode;     /* Graphics mode of last frame */
+  char                  last_size[32];  /* {D} command of last frame */
+  unsigned char         *buffer;        /* Output buffer */
+  unsigned char         *last_buffer;   /* Last buffer */
+  unsigned char         *zero_buffer;   /* Blank line */
+  unsigned char         *comp_block[2]; /* Graphics block buffers */
+  unsigned char         *raw_block;     /* Spare block for raw objects */
+  int                   comp_index;     /* Block buffer being filled */
+  unsigned char         *comp_buffer;   /* Data area of current block */
+  unsigned char         *comp_ptr;      /* Current position in comp_buffer */
+  size_t                comp_size;      /* Size of comp_buffer */
+  int                   comp_last_line; /* First line of the TOPIX object */
+  int                   block_lines;    /* Lines in the TOPIX object */
+  int                   blank_lines;    /* Blank lines not sent yet */
+  int                   ink_left,       /* First raw byte with ink */
+                        ink_right;      /* One past last raw byte with ink */
+};
+
+
+/*
+ * Local functions...
+ */
+static int  tpcl_write(tpcl_job_t *job, const void *data, size_t len);
+static int  tpcl_printf(tpcl_job_t *job, const char *format, ...)
+            __attribute__((format(printf, 2, 3)));
+static void tpcl_log(tpcl_job_t *job, const char *format, ...)
+            __attribute__((format(printf, 2, 3)));
+static void tpcl_clear_page(tpcl_job_t *job);
+static void *tpcl_reserve(tpcl_job_t *job, unsigned char **buffer,
+                          size_t *bufsize, size_t size);
+static void tpcl_dither(tpcl_job_t *job, const unsigned char *gray, int y,
+                        unsigned char *out);
+static const unsigned char *tpcl_orient_line(tpcl_job_t *job,
+                                             const unsigned char *line);
+static void tpcl_orient_page(tpcl_job_t *job);
+static void tpcl_encode_line(tpcl_job_t *job, const unsigned char *line);
+static int  tpcl_encode_lines(tpcl_job_t *job, const unsigned char *lines,
+                              int count);
+static void tpcl_frame_output(tpcl_job_t *job);
+static void tpcl_delta_output(tpcl_job_t *job, const unsigned char *frame,
+                              const unsigned char *last);
+static void tpcl_delta_rect(tpcl_job_t *job, const unsigned char *frame,
+                            int top, int bottom, int left, int right);
+static void tpcl_delta_object(tpcl_job_t *job, int left, int top,
+                              int bytes, int lines);
+static void tpcl_topix_compress(tpcl_job_t *job, const unsigned char *line,
+                                const unsigned char *encoded, int len);
+static void tpcl_topix_repeat(tpcl_job_t *job, const unsigned char *line,
+                              int count);
+static void tpcl_topix_blank(tpcl_job_t *job);
+static void tpcl_topix_output(tpcl_job_t *job);
+static int  tpcl_topix_raw(tpcl_job_t *job, unsigned len);
+static void tpcl_raw_line(tpcl_job_t *job, const unsigned char *line);
+static void tpcl_raw_output(tpcl_job_t *job);
+static int  tpcl_topix_bands(tpcl_job_t *job, const unsigned char *lines,
+                             int count);
+static void *tpcl_band_encode(void *data);
+static void tpcl_init_once(void);
+
+static pthread_once_t InitOnce = PTHREAD_ONCE_INIT;
+
+
+/*
+ * 'tpclDefaultSettings()' - Fill in the PPD default settings.
+ */
+void
+tpclDefaultSettings(tpcl_settings_t *settings)  /* O - Settings */
+{
+  memset(settings, 0, sizeof(tpcl_settings_t));
+
+  settings->gap            = 2;
+  settings->media_tracking = 2;
+  settings->print_mode     = 0;
+  settings->print_rate     = 3;
+  settings->graphics_mode  = TEC_GMODE_TOPIX;
+  settings->print_orient   = 0;
+  settings->dither         = TPCL_DITHER_ORDERED;
+  settings->rotate         = 0;
+  settings->incremental    = 0;
+
+  strcpy(settings->feed_adjust, "+000");
+  strcpy(settings->cut_adjust, "+000");
+  strcpy(settings->back_adjust, "+00");
+  strcpy(settings->ribbon_fwd, "-00");
+  strcpy(settings->ribbon_back, "-00");
+}
+
+
+/*
+ * 'tpclJobNew()' - Create a job writing to a callback.
+ */
+tpcl_job_t *                            /* O - New job or NULL */
+tpclJobNew(const tpcl_settings_t *settings,     /* I - Settings or NULL */
+           tpcl_write_cb_t       cb,            /* I - Output callback */
+           void                  *user_data)    /* I - Output callback data */
+{
+  tpcl_job_t    *job;                   /* New job */
+  tpcl_settings_t *s;                   /* Job settings */
+
+
+  if (!cb)
+    return (NULL);
+
+  pthread_once(&InitOnce, tpcl_init_once);
+
+  if ((job = calloc(1, sizeof(tpcl_job_t))) == NULL)
+    return (NULL);
+
+  if (settings)
+    job->settings = *settings;
+  else
+    tpclDefaultSettings(&job->settings);
+
+  job->write_cb   = cb;
+  job->write_data = user_data;
+  job->threads    = 1;
+
+  /*
+   * The sensor and speed of the {XS} command are the same for every
+   * label...
+   */
+  s = &job->settings;
+
+  job->detect = (s->media_tracking >= 0 && s->media_tracking <= 4) ?
+                s->media_tracking : 0;
+
+  switch (s->print_rate)
+  {
+    case 2 :
+    case 4 :
+    case 5 :
+    case 6 :
+    case 8 :
+      job->speed = (char)('0' + s->print_rate);
+      break;
+    case 10 :
+      job->speed = 'A';
+      break;
+    case 3 :
+    default :
+      job->speed = '3';
+      break;
+  }
+
+  return (job);
+}
+
+
+/*
+ * 'tpclJobDelete()' - Free a job.
+ */
+void
+tpclJobDelete(tpcl_job_t *job)          /* I - Job */
+{
+  if (!job)
+    return;
+
+  tpcl_clear_page(job);
+  free(job->arena);
+  free(job->scratch);
+  free(job->mono);
+  free(job->pages);
+  free(job->frames[0]);
+  free(job->frames[1]);
+  free(job);
+}
+
+
+/*
+ * 'tpclJobReset()' - Start another job with the same settings.
+ *
+ * The job forgets the printer state of the last job, including a
+ * cancel, an output error and the last incremental page, but keeps its
+ * buffers, so converting many files in turn only allocates for the
+ * largest page.  Call tpclJobSetup() again before the first page.
+ */
+void
+tpclJobReset(tpcl_job_t *job)           /* I - Job */
+{
+  job->canceled   = 0;
+  job->error      = 0;
+  job->rejected   = 0;
+  job->last_valid = 0;
+  job->graphics   = TPCL_GRAPHICS_NONE;
+}
+
+
+/*
+ * 'tpclJobSetLog()' - Set the DEBUG message callback.
+ */
+void
+tpclJobSetLog(tpcl_job_t    *job,       /* I - Job */
+              tpcl_log_cb_t cb,         /* I - Log callback or NULL */
+              void          *user_data) /* I - Log callback data */
+{
+  job->log_cb   = cb;
+  job->log_data = user_data;
+}
+
+
+/*
+ * 'tpclJobSetup()' - Prepare the printer for printing.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclJobSetup(tpcl_job_t *job)           /* I - Job */
+{
+  tpcl_settings_t   *s = &job->settings;
+
+
+  /*
+   * Always send a reset command. Helps with reliability on failed jobs.
+   */
+  tpcl_printf(job, "{WS|}\n");
+
+  /*
+   * Feed adjust, cut or peel adjust and back feed adjust.
+   */
+  tpcl_printf(job, "{AX;%s,%s,%s|}\n", s->feed_adjust, s->cut_adjust,
+              s->back_adjust);
+
+  /*
+   * Ribbon motor setup parameters.
+   */
+  tpcl_printf(job, "{RM;%s%s|}\n", s->ribbon_fwd, s->ribbon_back);
+
+  return (job->error ? -1 : 0);
+}
+
+
+/*
+ * 'tpclJobSetThreads()' - Set the number of threads for tall pages.
+ *
+ * tpclPageWriteLines() uses up to this many threads, including the
+ * caller, when given enough TOPIX lines.  The output does not change.
+ */
+void
+tpclJobSetThreads(tpcl_job_t *job,      /* I - Job */
+                  int        threads)   /* I - Number of threads */
+{
+  if (threads < 1)
+    threads = 1;
+  else if (threads > TPCL_MAX_THREADS)
+    threads = TPCL_MAX_THREADS;
+
+  job->threads = threads;
+}
+
+
+/*
+ * 'tpclJobCancel()' - Cancel the job, safe from a signal handler.
+ */
+void
+tpclJobCancel(tpcl_job_t *job)          /* I - Job */
+{
+  job->canceled = 1;
+}
+
+
+/*
+ * 'tpclJobCanceled()' - Has the job been canceled?
+ */
+int                                     /* O - Non-zero if canceled */
+tpclJobCanceled(tpcl_job_t *job)        /* I - Job */
+{
+  return (job->canceled);
+}
+
+
+/*
+ * 'tpclPageStart()' - Start a page of graphics.
+ *
+ * A page that cannot be printed as asked, such as one too large to
+ * rotate, fails here and at tpclPageEnd(); its lines must still be
+ * written, but nothing of it is sent.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclPageStart(tpcl_job_t                *job,    /* I - Job */
+              const cups_page_header2_t *header) /* I - Page header */
+{
+  int           labelgap;               /* length of labelgap */
+  int           labelpitch;             /* label pitch, distance from start of one label to the next */
+  int           length;                 /* Effective label length */
+  int           width;                  /* Effective label width */
+  int           darkness;               /* Temperature fine adjust */
+  int           i;                      /* Page size index for width */
+  size_t        block;                  /* Size of a block buffer */
+  int           blocks;                 /* Number of block buffers */
+  size_t        line;                   /* Size of a line buffer */
+  int           lines;                  /* Number of line buffers */
+  int           src_line;               /* Bytes per line written */
+  size_t        gray;                   /* Size of the grayscale buffers */
+  size_t        page;                   /* Size of the rotation buffers */
+  int           mirror;                 /* Mirror the page in software? */
+  size_t        frame;                  /* Size of the incremental page */
+  char          size[32];               /* Label size command */
+  unsigned char *arena;                 /* Page buffers */
+  static const int rotations[4] =       /* Orientation of each rotation */
+  {
+    0,
+    TPCL_ORIENT_TRANSPOSE | TPCL_ORIENT_HFLIP,
+    TPCL_ORIENT_VFLIP | TPCL_ORIENT_HFLIP,
+    TPCL_ORIENT_TRANSPOSE | TPCL_ORIENT_VFLIP
+  };
+
+
+  tpcl_clear_page(job);
+
+  job->page_allocs = job->allocs;
+  job->rejected    = 0;
+
+  memset(&job->stats, 0, sizeof(job->stats));
+
+  job->header = *header;
+  job->width  = header->cupsBytesPerLine;
+  job->y      = 0;
+
+  /*
+   * 8-bit grayscale pages are dithered to 1 bit lines of cupsWidth pixels.
+   */
+  job->gray   = header->cupsBitsPerPixel == 8 &&
+                header->cupsBytesPerLine >= header->cupsWidth;
+  job->invert = header->cupsColorSpace == CUPS_CSPACE_W ||
+                header->cupsColorSpace == CUPS_CSPACE_SW;
+
+  if (job->gray)
+  {
+    job->gray_width = header->cupsBytesPerLine;
+    job->width      = (header->cupsWidth + 7) / 8;
+  }
+
+  /*
+   * Pages turned a quarter or half way are kept until they are complete,
+   * in one buffer for the lines as written and one for the turned page.
+   * Lines that are only mirrored or inverted are sent as they come.
+   */
+  job->orient    = rotations[(job->settings.rotate / 90) & 3];
+  job->src_width = (header->cupsWidth + 7) / 8;
+  page           = 0;
+
+  /*
+   * The mirror choices of PrintOrient (2 and 3) already have the printer
+   * mirror the label, so MirrorPrint is not applied a second time...
+   */
+  mirror = header->MirrorPrint && job->settings.print_orient < 2;
+
+  if (mirror)
+    job->orient ^= TPCL_ORIENT_HFLIP;
+  if (header->NegativePrint)
+    job->orient |= TPCL_ORIENT_INVERT;
+
+  if (job->orient & (TPCL_ORIENT_TRANSPOSE | TPCL_ORIENT_VFLIP))
+  {
+    page = (size_t)job->src_width * header->cupsHeight;
+    if (job->orient & TPCL_ORIENT_TRANSPOSE)
+      page += (size_t)((header->cupsHeight + 7) / 8) * header->cupsWidth;
+
+    if (page > TPCL_ORIENT_LIMIT)
+    {
+      /*
+       * Set up the page unturned so its lines can be written, but do not
+       * send any of it...
+       */
+      tpcl_log(job, "Page of %lu bytes is too large to rotate, not printed",
+               (unsigned long)page);
+
+      job->orient   = (mirror ? TPCL_ORIENT_HFLIP : 0) |
+                      (header->NegativePrint ? TPCL_ORIENT_INVERT : 0);
+      job->rejected = 1;
+      page          = 0;
+    }
+  }
+
+  src_line = job->width;
+
+  if (job->orient & TPCL_ORIENT_TRANSPOSE)
+    job->pixels = (int)header->cupsHeight;
+  else
+    job->pixels = (int)header->cupsWidth;
+
+  if (job->orient)
+    job->width = (job->pixels + 7) / 8;
+
+  job->encode = TOPIXLineEncoder(job->width);
+
+  /*
+   * First paper size Dxxxx,xxxx,xxxx
+   *
+   *   100 == 10.0mm
+   */
+  labelgap = job->settings.gap * 10;
+
+  /* Calculate page widths and heights, turned with the page */
+  i          = (job->orient & TPCL_ORIENT_TRANSPOSE) ? 1 : 0;
+  length     = (int) (header->cupsPageSize[1 - i] * 254/72);
+  labelpitch = length + labelgap;
+  width      = (int) (header->cupsPageSize[i] * 254/72);
+
+  /* Send label size, assume gap is same all the way round */
+  snprintf(size, sizeof(size), "{D%04d,%04d,%04d|}\n", labelpitch, width,
+           length);
+  tpcl_printf(job, "%s", size);
+
+  /*
+   * AY temperature fine adjust uses the Darkness choice (1-21, passed in
+   * cupsCompression) less 11, with 1 for thermal transfer and 0 for
+   * direct printing.
+   */
+  darkness = (int)header->cupsCompression;
+  if (darkness < 1 || darkness > 21)
+    darkness = 11;
+
+  tpcl_printf(job, "{AY;%+03d,%d|}\n", darkness - 11,
+              strcmp(header->MediaType, "Direct") ? 1 : 0);
+
+  job->gmode     = job->settings.graphics_mode;
+  job->automatic = job->gmode == TEC_GMODE_AUTO;
+  job->graphics  = TPCL_GRAPHICS_NONE;
+
+  if (job->automatic)
+    job->gmode = TEC_GMODE_TOPIX;
+
+  /*
+   * Incremental pages are kept whole.  When the printer still holds the
+   * last one, at the same size and in the same mode, only the areas that
+   * changed are sent over it and the image buffer is not cleared...
+   */
+  frame      = 0;
+  job->delta = 0;
+
+  if (job->settings.incremental)
+  {
+    if (job->orient & TPCL_ORIENT_TRANSPOSE)
+      job->frame_lines = (int)header->cupsWidth;
+    else
+      job->frame_lines = (int)header->cupsHeight;
+
+    frame = (size_t)job->width * job->frame_lines;
+
+    if (frame > TPCL_FRAME_LIMIT)
+    {
+      tpcl_log(job, "Page of %lu bytes is too large to send incrementally",
+               (unsigned long)frame);
+
+      frame           = 0;
+      job->last_valid = 0;
+    }
+    else
+      job->delta = job->last_valid && job->last_width == job->width &&
+                   job->last_lines == job->frame_lines &&
+                   job->last_gmode == job->gmode &&
+                   !strcmp(job->last_size, size);
+
+    job->last_valid = 0;
+    job->last_width = job->width;
+    job->last_lines = job->frame_lines;
+    job->last_gmode = job->gmode;
+    memcpy(job->last_size, size, sizeof(job->last_size));
+  }
+
+  if (!job->delta)
+    tpcl_printf(job, "{C|}\n");         /* clear image buffer */
+
+  /*
+   * Use two block buffers, so the callback can still be sending one while
+   * the next is filled, and line buffers for the page and the TOPIX line
+   * above.  Raw graphics lines are collected in the block buffers, which
+   * must hold at least one line.  All of them share one job buffer that is
+   * only reallocated when a page needs more than any page before it.
+   */
+  if (job->gmode == TEC_GMODE_TOPIX)
+    job->comp_size = TPCL_COMP_SIZE;
+  else if (job->width > TPCL_RAW_SIZE)
+    job->comp_size = (size_t)job->width;
+  else
+    job->comp_size = TPCL_RAW_SIZE;
+
+  block = (TPCL_BLOCK_SIZE(job->comp_size) + 15) & ~(size_t)15;
+  line  = ((size_t)(job->width > src_line ? job->width : src_line) + 15) &
+          ~(size_t)15;
+  lines = job->orient ? 4 : 3;
+  gray  = 0;
+
+  /*
+   * Automatic mode sends raw objects from a third block, so the other two
+   * take turns as for TOPIX...
+   */
+  blocks = job->automatic ? 3 : 2;
+
+  if (job->gray)
+    gray = (((size_t)job->gray_width + 15) & ~(size_t)15) +
+           (((size_t)header->cupsWidth * DITHER_ROWS + 15) & ~(size_t)15) +
+           ((header->cupsWidth + 2) * sizeof(int));
+
+  if ((arena = tpcl_reserve(job, &job->arena, &job->arena_size,
+                            blocks * block + lines * line + gray)) == NULL)
+    return (-1);
+
+  job->comp_block[0]  = arena;
+  job->comp_block[1]  = arena + block;
+  job->raw_block      = job->automatic ? arena + 2 * block : NULL;
+  job->buffer         = arena + blocks * block;
+  job->last_buffer    = job->buffer + line;
+  job->zero_buffer    = job->last_buffer + line;
+  job->comp_index     = 0;
+  job->comp_buffer    = job->comp_block[0] + TPCL_BLOCK_HEAD;
+  job->comp_ptr       = job->comp_buffer;
+  job->comp_last_line = 0;
+  job->block_lines    = 0;
+  job->blank_lines    = 0;
+
+  memset(job->last_buffer, 0, job->width);
+  memset(job->zero_buffer, 0, job->width);
+
+  if (job->orient)
+    job->orient_buffer = job->zero_buffer + line;
+
+  if (page &&
+      (job->page = tpcl_reserve(job, &job->pages, &job->pages_size,
+                                page)) == NULL)
+    return (-1);
+
+  if (frame &&
+      (job->frame = tpcl_reserve(job, job->frames + job->frame_index,
+                                 job->frames_size + job->frame_index,
+                                 frame)) == NULL)
+    return (-1);
+
+  if (job->gray)
+  {
+    job->gray_buffer = arena + blocks * block + lines * line;
+    job->thresholds  = job->gray_buffer +
+                       (((size_t)job->gray_width + 15) & ~(size_t)15);
+    job->errors      = (int *)(job->thresholds +
+                               (((size_t)header->cupsWidth * DITHER_ROWS + 15) &
+                                ~(size_t)15));
+
+    if (job->settings.dither == TPCL_DITHER_DIFFUSION)
+      memset(job->errors, 0, (header->cupsWidth + 2) * sizeof(int));
+    else
+      DITHERThresholds(job->settings.dither, (int)header->cupsWidth,
+                       job->thresholds);
+  }
+
+  return (job->error || job->rejected ? -1 : 0);
+}
+
+
+/*
+ * 'tpclPageBuffer()' - Line buffer that can be filled by the caller.
+ *
+ * Lines written from this buffer are not copied; its contents are
+ * undefined after tpclPageWriteLine() returns.
+ */
+unsigned char *                         /* O - Line buffer */
+tpclPageBuffer(tpcl_job_t *job)         /* I - Job */
+{
+  return (job->gray ? job->gray_buffer : job->buffer);
+}
+
+
+/*
+ * 'tpclPageWriteLine()' - Output a line of graphics.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclPageWriteLine(tpcl_job_t          *job,   /* I - Job */
+                  const unsigned char *line)  /* I - cupsBytesPerLine bytes */
+{
+  if (job->error)
+    return (-1);
+
+  job->graphics = TPCL_GRAPHICS_OPEN;
+
+  if (job->gray)
+  {
+    tpcl_dither(job, line, job->y, job->buffer);
+    line = job->buffer;
+  }
+
+  if (job->page)
+  {
+   /*
+    * Keep the line until the page can be turned...
+    */
+    if (job->y < (int)job->header.cupsHeight)
+      memcpy(job->page + (size_t)job->y * job->src_width, line,
+             job->src_width);
+
+    job->y ++;
+
+    return (0);
+  }
+
+  if (job->orient)
+    line = tpcl_orient_line(job, line);
+
+  tpcl_encode_line(job, line);
+
+  return (job->error ? -1 : 0);
+}
+
+
+/*
+ * 'tpclPageWriteLines()' - Output several lines of graphics.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclPageWriteLines(tpcl_job_t          *job,    /* I - Job */
+                   const unsigned char *lines,  /* I - count lines of cupsBytesPerLine bytes */
+                   int                 count)   /* I - Number of lines */
+{
+  int           i;                      /* Looping var */
+  unsigned char *mono;                  /* Dithered lines */
+
+
+  if (job->gmode == TEC_GMODE_TOPIX && job->threads > 1 &&
+      count >= 2 * TPCL_BAND_LINES && !job->orient && !job->frame)
+  {
+    if (!job->gray)
+      return (tpcl_topix_bands(job, lines, count));
+
+    /*
+     * Dither the whole run first, the bands need their lines above...
+     */
+    if ((mono = tpcl_reserve(job, &job->mono, &job->mono_size,
+                             (size_t)count * job->width)) == NULL)
+      return (-1);
+
+    for (i = 0; i < count; i ++)
+      tpcl_dither(job, lines + (size_t)i * job->gray_width, job->y + i,
+                  mono + (size_t)i * job->width);
+
+    return (tpcl_topix_bands(job, mono, count));
+  }
+
+  for (i = 0; i < count; i ++, lines += job->header.cupsBytesPerLine)
+    if (tpclPageWriteLine(job, lines))
+      return (-1);
+
+  return (0);
+}
+
+
+/*
+ * 'tpclPageWriteRepeat()' - Output a line several times.
+ *
+ * For raster that already counts repeated lines, such as version 2 CUPS
+ * raster.  In TOPIX mode the repeats are not compared or encoded again:
+ * each one is a zero CL1 byte, or adds to the blank lines.  The line must
+ * stay unchanged during the call, so it can only be the tpclPageBuffer()
+ * buffer when count is 1.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclPageWriteRepeat(tpcl_job_t          *job,   /* I - Job */
+                    const unsigned char *line,  /* I - cupsBytesPerLine bytes */
+                    int                 count)  /* I - Number of times */
+{
+  if (count < 1)
+    return (0);
+
+  if (count == 1 || job->gmode != TEC_GMODE_TOPIX || job->gray ||
+      job->page || job->frame)
+  {
+    /*
+     * Dithering depends on the line number, and kept pages need every
+     * line...
+     */
+    for (; count > 0; count --)
+      if (tpclPageWriteLine(job, line))
+        return (-1);
+
+    return (0);
+  }
+
+  if (job->error)
+    return (-1);
+
+  job->graphics = TPCL_GRAPHICS_OPEN;
+
+  if (job->orient)
+    line = tpcl_orient_line(job, line);
+
+  tpcl_encode_line(job, line);
+  tpcl_topix_repeat(job, line, count - 1);
+
+  return (job->error ? -1 : 0);
+}
+
+
+/*
+ * 'tpclPageWriteGraphics()' - Send already encoded graphics for a page.
+ *
+ * The data must be the complete graphics of a page with the same width,
+ * height and graphics mode, as sent between tpclPageStart() and
+ * tpclPageEndGraphics() (for example from a cache).  No lines may be
+ * written to the page afterwards.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclPageWriteGraphics(tpcl_job_t *job,  /* I - Job */
+                      const void *data, /* I - Encoded graphics */
+                      size_t     len)   /* I - Length of data */
+{
+  if (job->graphics != TPCL_GRAPHICS_NONE)
+    return (-1);
+
+  job->graphics   = TPCL_GRAPHICS_DONE;
+  job->frame      = NULL;
+  job->last_valid = 0;
+
+  return (tpcl_write(job, data, len));
+}
+
+
+/*
+ * 'tpclPageEndGraphics()' - Finish the graphics of a page.
+ *
+ * Sends the last TOPIX graphics object or closes the raw graphics, so
+ * that everything written since tpclPageStart() is the complete image.
+ * tpclPageEnd() calls this when needed.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclPageEndGraphics(tpcl_job_t *job)    /* I - Job */
+{
+  if (job->graphics == TPCL_GRAPHICS_DONE)
+    return (job->error || job->rejected ? -1 : 0);
+
+  /*
+   * Turn and send a kept page, unless the job was canceled...
+   */
+  if (job->page && job->y && !job->canceled)
+    tpcl_orient_page(job);
+
+  job->page = NULL;
+
+  if (job->frame)
+    tpcl_frame_output(job);
+
+  /*
+   * Terminate sending graphics, blank lines at the bottom are never sent.
+   */
+  job->blank_lines = 0;
+
+  if (job->gmode == TEC_GMODE_TOPIX)
+    tpcl_topix_output(job);
+  else
+    tpcl_raw_output(job);
+
+  job->graphics = TPCL_GRAPHICS_DONE;
+
+  return (job->error || job->rejected ? -1 : 0);
+}
+
+
+/*
+ * 'tpclPageRepeatable()' - Can the page be issued several times at once?
+ *
+ * A run of identical pages can be sent once with a larger quantity,
+ * except when the cutter is active and would only cut at the end of the
+ * batch; then each label must keep its own issue and {IB}.
+ */
+int                                     /* O - 1 if repeatable, 0 if not */
+tpclPageRepeatable(tpcl_job_t *job)     /* I - Job */
+{
+  if (job->canceled)
+    return (0);
+
+  if (job->header.CutMedia || job->settings.print_mode == 3)
+    return (job->header.cupsRowStep == 1);
+
+  return (1);
+}
+
+
+/*
+ * 'tpclPageEnd()' - Finish a page of graphics.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclPageEnd(tpcl_job_t *job)            /* I - Job */
+{
+  return (tpclPageEndCopies(job, (int)job->header.NumCopies));
+}
+
+
+/*
+ * 'tpclPageEndCopies()' - Finish a page, printing it a number of times.
+ */
+int                                     /* O - 0 on success, -1 on error */
+tpclPageEndCopies(tpcl_job_t *job,      /* I - Job */
+                  int        copies)    /* I - Issue quantity */
+{
+  tpcl_settings_t     *s = &job->settings;
+  cups_page_header2_t *header = &job->header;
+  const char          *Tmode;           /* Print mode */
+  unsigned int        Tmedia;           /* type of media */
+  unsigned int        Tcut;             /* Cut quantity */
+  unsigned int        CutActive;        /* Activate cutter */
+
+
+  tpclPageEndGraphics(job);
+
+  if (job->canceled)
+  {
+    /*
+     * Ramclear in case of error
+     */
+    tpcl_printf(job, "{WR|}\n");
+  }
+  else
+  {
+    /*
+     * Set print mode...
+     */
+    Tmode     = "C";
+    CutActive = 0;
+
+    if (header->CutMedia) /* coupe active */
+      CutActive = 1;
+    else if (s->print_mode == 1)
+      Tmode = "D";
+    else if (s->print_mode == 2)
+      Tmode = "E";
+    else if (s->print_mode == 3)
+      CutActive = 1;
+
+    /*
+     * Set with or without ribbon mode from media type
+     */
+    if (!strcmp(header->MediaType, "Thermal"))
+      Tmedia = 1;
+    else if (!strcmp(header->MediaType, "Thermal2"))
+      Tmedia = 2;
+    else
+      Tmedia = 0;
+
+    /*
+     * Manage the cut option every label or end of batch print
+     */
+    Tcut = header->cupsRowStep == 1 ? 1 : 0;
+
+    /*
+     * End the label and eject, without status response...
+     */
+    tpcl_printf(job, "{XS;I,%04d,%03d%d%s%c%d%d%d|}\n", copies, Tcut,
+                job->detect, Tmode, job->speed, Tmedia, s->print_orient, 0);
+
+    /* Send eject command if cut active */
+    if (CutActive > 0)
+      tpcl_printf(job, "{IB|}\n");
+  }
+
+  tpcl_write(job, NULL, 0);
+
+  tpcl_log(job, "Page used %d heap allocations", job->allocs - job->page_allocs);
+
+  if (job->automatic)
+    tpcl_log(job, "Sent %d of %d objects raw, saving %ld bytes",
+             job->stats.raw_objects, job->stats.objects,
+             job->stats.saved_bytes);
+
+  tpcl_clear_page(job);
+
+  return (job->error || job->rejected ? -1 : 0);
+}
+
+
+/*
+ * 'tpclPageStats()' - Get the statistics of the current page.
+ *
+ * After tpclPageEnd() these are the statistics of the page that ended,
+ * until the next tpclPageStart().
+ */
+void
+tpclPageStats(tpcl_job_t        *job,   /* I - Job */
+              tpcl_page_stats_t *stats) /* O - Statistics */
+{
+  *stats = job->stats;
+}
+
+
+/*
+ * 'tpcl_write()' - Send data to the write callback.
+ */
+static int                              /* O - 0 on success, -1 on error */
+tpcl_write(tpcl_job_t *job,             /* I - Job */
+           const void *data,            /* I - Data or NULL to flush */
+           size_t     len)              /* I - Length of data */
+{
+  if (job->error)
+    return (-1);
+
+  if (job->rejected)
+    return (0);                         /* Page is not printed */
+
+  if ((*job->write_cb)(job->write_data, data, len))
+  {
+    job->error = 1;
+    return (-1);
+  }
+
+  if (data)
+    job->stats.bytes += (long)len;
+
+  return (0);
+}
+
+
+/*
+ * 'tpcl_printf()' - Send a formatted command to the write callback.
+ */
+static int                              /* O - 0 on success, -1 on error */
+tpcl_printf(tpcl_job_t *job,            /* I - Job */
+            const char *format,         /* I - printf-style format */
+            ...)                        /* I - Additional args */
+{
+  char          buffer[256];            /* Command buffer */
+  int           len;                    /* Length of command */
+  va_list       ap;                     /* Argument pointer */
+
+
+  va_start(ap, format);
+  len = vsnprintf(buffer, sizeof(buffer), format, ap);
+  va_end(ap);
+
+  if (len < 0 || len >= (int)sizeof(buffer))
+  {
+    job->error = 1;
+    return (-1);
+  }
+
+  return (tpcl_write(job, buffer, (size_t)len));
+}
+
+
+/*
+ * 'tpcl_log()' - Send a DEBUG message to the log callback.
+ */
+static void
+tpcl_log(tpcl_job_t *job,               /* I - Job */
+         const char *format,            /* I - printf-style format */
+         ...)                           /* I - Additional args */
+{
+  char          buffer[256];            /* Message buffer */
+  va_list       ap;                     /* Argument pointer */
+
+
+  if (!job->log_cb)
+    return;
+
+  va_start(ap, format);
+  vsnprintf(buffer, sizeof(buffer), format, ap);
+  va_end(ap);
+
+  (*job->log_cb)(job->log_data, buffer);
+}
+
+
+/*
+ * 'tpcl_clear_page()' - Forget the buffers of the current page.
+ *
+ * The memory stays with the job for the next page.
+ */
+static void
+tpcl_clear_page(tpcl_job_t *job)        /* I - Job */
+{
+  job->buffer        = NULL;
+  job->last_buffer   = NULL;
+  job->zero_buffer   = NULL;
+  job->gray_buffer   = NULL;
+  job->page          = NULL;
+  job->orient_buffer = NULL;
+  job->frame         = NULL;
+  job->thresholds    = NULL;
+  job->errors        = NULL;
+  job->comp_block[0] = NULL;
+  job->comp_block[1] = NULL;
+  job->raw_block     = NULL;
+  job->comp_buffer   = NULL;
+  job->comp_ptr      = NULL;
+}
+
+
+/*
+ * 'tpcl_reserve()' - Grow a job buffer when it is too small.
+ *
+ * Job buffers never shrink, so a job printing pages of the same size
+ * only allocates for the first one.  Old contents are not kept.
+ */
+static void *                           /* O - Buffer or NULL on error */
+tpcl_reserve(tpcl_job_t    *job,        /* I - Job */
+             unsigned char **buffer,    /* IO - Buffer */
+             size_t        *bufsize,    /* IO - Size of buffer */
+             size_t        size)        /* I - Bytes needed */
+{
+  if (size <= *bufsize)
+    return (*buffer);
+
+  free(*buffer);
+  job->allocs ++;
+
+  if ((*buffer = malloc(size)) == NULL)
+  {
+    *bufsize   = 0;
+    job->error = 1;
+    return (NULL);
+  }
+
+  *bufsize = size;
+
+  return (*buffer);
+}
+
+
+/*
+ * 'tpcl_dither()' - Convert a grayscale line to 1 bit.
+ *
+ * Error diffusion must see the lines of a page in order.
+ */
+static void
+tpcl_dither(tpcl_job_t          *job,   /* I - Job */
+            const unsigned char *gray,  /* I - Grayscale line */
+            int                 y,      /* I - Line number */
+            unsigned char       *out)   /* O - Bitmap line */
+{
+  int           pixels;                 /* Pixels per line */
+
+
+  pixels = (int)job->header.cupsWidth;
+
+  if (job->settings.dither == TPCL_DITHER_DIFFUSION)
+    DITHERDiffuse(gray, job->errors, pixels, y, job->invert, out);
+  else
+    DITHERLine(gray, job->thresholds + (size_t)(y % DITHER_ROWS) * pixels,
+               pixels, job->invert, out);
+}
+
+
+/*
+ * 'tpcl_orient_line()' - Mirror and/or invert a line.
+ */
+static const unsigned char *            /* O - Line to send */
+tpcl_orient_line(tpcl_job_t          *job,      /* I - Job */
+                 const unsigned char *line)     /* I - Line */
+{
+  if (job->orient & TPCL_ORIENT_HFLIP)
+    ORIENTMirrorLine(line, job->pixels, job->orient_buffer);
+  else if (job->orient & TPCL_ORIENT_INVERT)
+    memcpy(job->orient_buffer, line, job->width);
+  else
+    return (line);
+
+  if (job->orient & TPCL_ORIENT_INVERT)
+    ORIENTInvertLine(job->orient_buffer, job->pixels);
+
+  return (job->orient_buffer);
+}
+
+
+/*
+ * 'tpcl_orient_page()' - Rotate and send a kept page.
+ *
+ * The page is turned into its final form in place, so tall pages can
+ * still be encoded in bands.
+ */
+static void
+tpcl_orient_page(tpcl_job_t *job)       /* I - Job */
+{
+  unsigned char *page;                  /* Page to send */
+  unsigned char *top, *bottom;          /* Lines being swapped */
+  int           height;                 /* Source lines */
+  int           count;                  /* Lines to send */
+  int           i;                      /* Looping var */
+
+
+  height = (int)job->header.cupsHeight;
+
+  if (job->y < height)
+    memset(job->page + (size_t)job->y * job->src_width, 0,
+           (size_t)(height - job->y) * job->src_width);
+
+  if (job->orient & TPCL_ORIENT_TRANSPOSE)
+  {
+    page  = job->page + (size_t)job->src_width * height;
+    count = (int)job->header.cupsWidth;
+
+    ORIENTTranspose(job->page, job->src_width, count, height, page,
+                    job->width);
+  }
+  else
+  {
+    page  = job->page;
+    count = height;
+  }
+
+  if (job->orient & TPCL_ORIENT_VFLIP)
+  {
+    for (i = 0; i < count / 2; i ++)
+    {
+      top    = page + (size_t)i * job->width;
+      bottom = page + (size_t)(count - 1 - i) * job->width;
+
+      memcpy(job->orient_buffer, top, job->width);
+      memcpy(top, bottom, job->width);
+      memcpy(bottom, job->orient_buffer, job->width);
+    }
+  }
+
+  if (job->orient & (TPCL_ORIENT_HFLIP | TPCL_ORIENT_INVERT))
+  {
+    for (i = 0, top = page; i < count; i ++, top += job->width)
+      memcpy(top, tpcl_orient_line(job, top), job->width);
+  }
+
+  job->y = 0;
+
+  tpcl_encode_lines(job, page, count);
+}
+
+
+/*
+ * 'tpcl_encode_line()' - Encode a line in the page's graphics mode.
+ */
+static void
+tpcl_encode_line(tpcl_job_t          *job,      /* I - Job */
+                 const unsigned char *line)     /* I - Line of job->width */
+{
+  if (job->frame)
+  {
+   /*
+    * Keep the line of an incremental page...
+    */
+    if (job->y < job->frame_lines)
+      memcpy(job->frame + (size_t)job->y * job->width, line, job->width);
+
+    job->y ++;
+    return;
+  }
+
+  if (job->gmode == TEC_GMODE_TOPIX)
+    tpcl_topix_compress(job, line, NULL, 0);
+  else
+    tpcl_raw_line(job, line);           // Hex Output, collected into blocks
+
+  job->y ++;
+  job->stats.lines ++;
+}
+
+
+/*
+ * 'tpcl_encode_lines()' - Encode several lines.
+ */
+static int                              /* O - 0 on success, -1 on error */
+tpcl_encode_lines(tpcl_job_t          *job,     /* I - Job */
+                  const unsigned char *lines,   /* I - Lines of job->width */
+                  int                 count)    /* I - Number of lines */
+{
+  int           i;                      /* Looping var */
+
+
+  if (job->gmode == TEC_GMODE_TOPIX && job->threads > 1 &&
+      count >= 2 * TPCL_BAND_LINES && !job->frame)
+    return (tpcl_topix_bands(job, lines, count));
+
+  for (i = 0; i < count && !job->error; i ++, lines += job->width)
+    tpcl_encode_line(job, lines);
+
+  return (job->error ? -1 : 0);
+}
+
+
+/*
+ * 'tpcl_frame_output()' - Send a kept page in full or as changes.
+ *
+ * Either way the page becomes the last frame, which the next page is
+ * compared with, unless it was canceled.
+ */
+static void
+tpcl_frame_output(tpcl_job_t *job)      /* I - Job */
+{
+  unsigned char *frame;                 /* Kept page */
+
+
+  frame      = job->frame;
+  job->frame = NULL;
+
+  if (job->canceled)
+    return;
+
+  if (job->y < job->frame_lines)
+    memset(frame + (size_t)job->y * job->width, 0,
+           (size_t)(job->frame_lines - job->y) * job->width);
+
+  job->y = 0;
+
+  if (job->delta)
+    tpcl_delta_output(job, frame, job->frames[!job->frame_index]);
+  else
+    tpcl_encode_lines(job, frame, job->frame_lines);
+
+  job->last_valid  = !job->error && !job->rejected;
+  job->frame_index = !job->frame_index;
+}
+
+
+/*
+ * 'tpcl_delta_output()' - Send the areas that changed since the last page.
+ *
+ * Runs of changed lines are sent as one area, as wide as the widest
+ * change, for as long as the unchanged bytes that come with it cost less
+ * than starting a new object.  TOPIX objects cannot reach past
+ * TOPIX_MAX_WIDTH bytes, as for whole pages.
+ */
+static void
+tpcl_delta_output(tpcl_job_t          *job,     /* I - Job */
+                  const unsigned char *frame,   /* I - Current page */
+                  const unsigned char *last)    /* I - Last page */
+{
+  int           y;                      /* Current line */
+  int           width;                  /* Bytes per line compared */
+  int           first, end;             /* Changed bytes of the line */
+  int           top, bottom;            /* Lines of the area */
+  int           left, right;            /* Bytes of the area */
+  int           l, r;                   /* Bytes of the grown area */
+  size_t        grown, kept;            /* Bytes with and without growing */
+
+
+  width = job->width;
+  if (job->gmode == TEC_GMODE_TOPIX && width > TOPIX_MAX_WIDTH)
+    width = TOPIX_MAX_WIDTH;
+
+  top = bottom = left = right = 0;
+
+  for (y = 0; y < job->frame_lines; y ++)
+  {
+    if (!TOPIXDirtySpan(frame + (size_t)y * job->width,
+                        last + (size_t)y * job->width, width, &first, &end))
+      continue;
+
+    job->stats.changed_lines ++;
+
+    if (bottom > top)
+    {
+      l     = first < left ? first : left;
+      r     = end > right ? end : right;
+      grown = (size_t)(y + 1 - top) * (size_t)(r - l);
+      kept  = (size_t)(bottom - top) * (size_t)(right - left) +
+              (size_t)(end - first);
+
+      if (grown <= kept + TPCL_BLOCK_COST && y + 1 - top <= TPCL_BLOCK_LINES)
+      {
+        left   = l;
+        right  = r;
+        bottom = y + 1;
+        continue;
+      }
+
+      tpcl_delta_rect(job, frame, top, bottom, left, right);
+    }
+
+    top    = y;
+    bottom = y + 1;
+    left   = first;
+    right  = end;
+  }
+
+  if (bottom > top)
+    tpcl_delta_rect(job, frame, top, bottom, left, right);
+
+  job->y           = job->frame_lines;
+  job->stats.lines = job->frame_lines;
+
+  tpcl_log(job, "Sent %d changed lines in %d objects",
+           job->stats.changed_lines, job->stats.objects);
+}
+
+
+/*
+ * 'tpcl_delta_rect()' - Send one changed area.
+ *
+ * Every line of the area is sent, blank or not, so that it overwrites
+ * what the last page left in the image buffer.  Areas that do not fit in
+ * a block buffer are sent as several objects.
+ */
+static void
+tpcl_delta_rect(tpcl_job_t          *job,       /* I - Job */
+                const unsigned char *frame,     /* I - Current page */
+                int                 top,        /* I - First line */
+                int                 bottom,     /* I - Line after the area */
+                int                 left,       /* I - First byte */
+                int                 right)      /* I - Byte after the area */
+{
+  int                   y;              /* Current line */
+  int                   start;          /* First line of the object */
+  int                   bytes;          /* Bytes per line */
+  size_t                limit;          /* Bytes before the object is sent */
+  const unsigned char   *line;          /* Current line */
+  const unsigned char   *above;         /* Line above in the object */
+
+
+  bytes = right - left;
+
+  if (job->gmode == TEC_GMODE_TOPIX)
+    limit = TPCL_COMP_LIMIT(bytes);
+  else
+    limit = job->comp_size - (size_t)bytes;
+
+  start = top;
+  above = job->zero_buffer;
+
+  for (y = top; y < bottom && !job->error; y ++)
+  {
+    if ((size_t)(job->comp_ptr - job->comp_buffer) > limit)
+    {
+      tpcl_delta_object(job, left, start, bytes, y - start);
+
+      start = y;
+      above = job->zero_buffer;
+    }
+
+    line = frame + (size_t)y * job->width + left;
+
+    if (job->gmode == TEC_GMODE_TOPIX)
+      job->comp_ptr += TOPIXEncodeLine(line, above, bytes, job->comp_ptr);
+    else
+    {
+      memcpy(job->comp_ptr, line, (size_t)bytes);
+      job->comp_ptr += bytes;
+    }
+
+    above = line;
+  }
+
+  tpcl_delta_object(job, left, start, bytes, bottom - start);
+}
+
+
+/*
+ * 'tpcl_delta_object()' - Send the graphics object of a changed area.
+ *
+ * Raw graphics always use the overwriting hex mode, since ORing could
+ * not clear the dots the last page left behind.
+ */
+static void
+tpcl_delta_object(tpcl_job_t *job,      /* I - Job */
+                  int        left,      /* I - First byte */
+                  int        top,       /* I - First line */
+                  int        bytes,     /* I - Bytes per line */
+                  int        lines)     /* I - Number of lines */
+{
+  unsigned      len;                    /* Length of data */
+  int           mode;                   /* Graphics mode of the object */
+  char          head[TPCL_BLOCK_HEAD];  /* {SG} header */
+  int           headlen;                /* Length of header */
+  unsigned char *start;                 /* Start of block */
+
+
+  len  = (unsigned)(job->comp_ptr - job->comp_buffer);
+  mode = job->gmode == TEC_GMODE_TOPIX ? TEC_GMODE_TOPIX : TEC_GMODE_HEX_AND;
+
+  headlen = snprintf(head, sizeof(head), "{SG;%04dD,%04dD,%04d,%04d,%d,",
+                     left * 8, top, bytes * 8, lines, mode);
+  if (headlen < 0 || headlen + 2 > TPCL_BLOCK_HEAD)
+  {
+    job->error = 1;
+    return;
+  }
+
+  if (mode == TEC_GMODE_TOPIX)
+  {
+    start                = job->comp_buffer - 2 - headlen;
+    job->comp_buffer[-2] = (unsigned char)(len >> 8);   // Length of data
+    job->comp_buffer[-1] = (unsigned char)len;
+  }
+  else
+    start = job->comp_buffer - headlen;
+
+  memcpy(start, head, (size_t)headlen);
+  memcpy(job->comp_ptr, "|}\n", 3);
+
+  tpcl_write(job, start, (size_t)(job->comp_ptr - start) + 3);
+
+  job->stats.objects ++;
+
+  job->comp_index  = !job->comp_index;
+  job->comp_buffer = job->comp_block[job->comp_index] + TPCL_BLOCK_HEAD;
+  job->comp_ptr    = job->comp_buffer;
+}
+
+
+/*
+ * 'tpcl_topix_compress()' - Apply TOPIX compression mechanism to a line.
+ *
+ * Blank lines are only counted until the next line with ink, see
+ * tpcl_topix_blank().  encoded may hold the line already encoded against
+ * the line above it (len bytes), or be NULL.
+ */
+static void
+tpcl_topix_compress(tpcl_job_t          *job,     /* I - Job */
+                    const unsigned char *line,    /* I - Line to compress */
+                    const unsigned char *encoded, /* I - Encoded line or NULL */
+                    int                 len)      /* I - Length of encoded line */
+{
+  int               width;          /* Max width of the line */
+  unsigned char     *tmp;           /* Buffer being swapped */
+
+
+  width = job->width;
+
+  if (!line[0] && !memcmp(line, line + 1, width - 1))
+  {
+    job->blank_lines ++;
+    job->stats.blank_lines ++;
+    return;
+  }
+
+  if (job->blank_lines)
+    tpcl_topix_blank(job);
+
+  /*
+   * Ensure that we will not overrun the buffer by sending
+   * to output when we get to the danger zone (width + ((width / 8) * 3))
+   * This will create multiple graphics objects depending on the size of the image.
+   * The new object starts from a blank line, so the line is encoded again.
+   */
+  if ((job->comp_ptr - job->comp_buffer) > TPCL_COMP_LIMIT(width) ||
+      job->block_lines >= TPCL_BLOCK_LINES)
+  {
+    tpcl_topix_output(job);
+    encoded = NULL;
+  }
+
+  if (!job->block_lines)
+    job->comp_last_line = job->y;
+
+  /*
+   * XOR against the last line and copy the changed bytes, together with
+   * their CL1/CL2/CL3 masks, into the compressed buffer. Unchanged lines
+   * are a single zero CL1 byte and leave the buffers as they are.
+   */
+  if (encoded)
+    memcpy(job->comp_ptr, encoded, (size_t)len);
+  else
+    len = (*job->encode)(line, job->last_buffer, width, job->comp_ptr);
+
+  job->comp_ptr += len;
+  job->block_lines ++;
+
+  if (len == 1)
+    return;
+
+  job->stats.changed_lines ++;
+
+  /*
+   * Keep the line for the next loop, swapping buffers when the caller
+   * filled our own line buffer.
+   */
+  if (line == job->buffer)
+  {
+    tmp              = job->last_buffer;
+    job->last_buffer = job->buffer;
+    job->buffer      = tmp;
+  }
+  else
+    memcpy(job->last_buffer, line, width);
+}
+
+
+/*
+ * 'tpcl_topix_repeat()' - Compress repeats of the last line.
+ *
+ * The line was just compressed, so as long as the object has room each
+ * repeat is one zero CL1 byte, and repeats of a blank line are only
+ * counted.  When the object is full the line starts the next one.
+ */
+static void
+tpcl_topix_repeat(tpcl_job_t          *job,     /* I - Job */
+                  const unsigned char *line,    /* I - Line just compressed */
+                  int                 count)    /* I - Repeats */
+{
+  int           room;                   /* Repeats that fit in the object */
+
+
+  job->stats.lines += count;
+
+  if (job->blank_lines)
+  {
+    job->blank_lines       += count;
+    job->stats.blank_lines += count;
+    job->y                 += count;
+    return;
+  }
+
+  while (count > 0 && !job->error)
+  {
+    room = TPCL_COMP_LIMIT(job->width) -
+           (int)(job->comp_ptr - job->comp_buffer) + 1;
+    if (room > TPCL_BLOCK_LINES - job->block_lines)
+      room = TPCL_BLOCK_LINES - job->block_lines;
+    if (room > count)
+      room = count;
+
+    if (room > 0)
+    {
+      memset(job->comp_ptr, 0, (size_t)room);
+      job->comp_ptr    += room;
+      job->block_lines += room;
+      job->y           += room;
+      count            -= room;
+    }
+    else
+    {
+      tpcl_topix_compress(job, line, NULL, 0);
+      job->y ++;
+      count --;
+    }
+  }
+}
+
+
+/*
+ * 'tpcl_topix_blank()' - Send or skip a run of blank lines.
+ *
+ * Blank lines before the first object are skipped.  Later runs are
+ * encoded into the current object (the line clearing the last ink, then
+ * one byte per line) when that is cheap, otherwise the object is sent and
+ * the next one starts at the right Y offset after the run.  Either way
+ * the next line is encoded against a blank line.
+ */
+static void
+tpcl_topix_blank(tpcl_job_t *job)       /* I - Job */
+{
+  int           count;                  /* Blank lines */
+  int           used;                   /* Bytes used in object */
+  int           len;                    /* Length of clearing line */
+
+
+  count            = job->blank_lines;
+  job->blank_lines = 0;
+
+  if (!job->block_lines)
+    return;
+
+  used = (int)(job->comp_ptr - job->comp_buffer);
+
+  if (used <= TPCL_COMP_LIMIT(job->width) &&
+      job->block_lines + count < TPCL_BLOCK_LINES)
+  {
+    len = (*job->encode)(job->zero_buffer, job->last_buffer, job->width,
+                         job->comp_ptr);
+
+    if (len + count - 1 <= TPCL_BLOCK_COST &&
+        used + len + count - 1 <= TPCL_COMP_LIMIT(job->width))
+    {
+      memset(job->comp_ptr + len, 0, (size_t)(count - 1));
+      job->comp_ptr    += len + count - 1;
+      job->block_lines += count;
+      memset(job->last_buffer, 0, job->width);
+      return;
+    }
+  }
+
+  tpcl_topix_output(job);
+}
+
+
+/*
+ * 'tpcl_topix_output()' - Send a set of data to output.
+ *
+ * The header and length are built in front of the data and the trailer
+ * after it, and the whole graphics object is written with one callback
+ * before switching block buffers.
+ */
+static void
+tpcl_topix_output(tpcl_job_t *job)      /* I - Job */
+{
+  unsigned      len;                    /* Length of compressed data */
+  char          head[TPCL_BLOCK_HEAD];  /* {SG} header */
+  int           headlen;                /* Length of header */
+  unsigned char *start;                 /* Start of block */
+
+
+  len = (unsigned)(job->comp_ptr - job->comp_buffer);
+  if (len == 0)
+    return;
+
+  if (job->automatic && tpcl_topix_raw(job, len))
+  {
+   /*
+    * The raw object went out from the spare block, which now has to stay
+    * valid until the next object.  The other block is free again and
+    * becomes the spare, and this one is filled again.
+    */
+    start                             = job->comp_block[!job->comp_index];
+    job->comp_block[!job->comp_index] = job->raw_block;
+    job->raw_block                    = start;
+  }
+  else
+  {
+    tpcl_log(job, "Sending output with length: %04x", len);
+
+    headlen = snprintf(head, sizeof(head), "{SG;0000,%04dD,%04d,%04d,%d,",
+                       job->comp_last_line, job->width * 8, job->block_lines,
+                       job->gmode);
+    if (headlen < 0 || headlen + 2 > TPCL_BLOCK_HEAD)
+    {
+      job->error = 1;
+      return;
+    }
+
+   /*
+    * Output the complete graphics block
+    */
+    start = job->comp_buffer - 2 - headlen;
+    memcpy(start, head, (size_t)headlen);
+    job->comp_buffer[-2] = (unsigned char)(len >> 8);   // Length of data
+    job->comp_buffer[-1] = (unsigned char)len;
+    memcpy(job->comp_ptr, "|}\n", 3);
+
+    tpcl_write(job, start, (size_t)headlen + 2 + len + 3);
+    tpcl_write(job, NULL, 0);
+
+    job->stats.objects ++;
+
+    job->comp_index = !job->comp_index;
+  }
+
+  /*
+   * Continue in the next block buffer, the next object starts from a
+   * blank line.
+   */
+  job->comp_buffer = job->comp_block[job->comp_index] + TPCL_BLOCK_HEAD;
+  job->comp_ptr    = job->comp_buffer;
+  job->block_lines = 0;
+
+  memset(job->last_buffer, 0, job->width);
+}
+
+
+/*
+ * 'tpcl_topix_raw()' - Send a TOPIX object as raw graphics if smaller.
+ *
+ * The columns the object changes, read from its masks, are the ink box
+ * of its lines.  When the box sent raw (TEC_GMODE_HEX_AND) takes fewer
+ * bytes than the TOPIX object, the lines are decoded into the spare block
+ * and sent from there.  Raw data is then smaller than the TOPIX data, so
+ * it always fits.  last_buffer is used for decoding; the caller clears
+ * it for the next object anyway.
+ */
+static int                              /* O - 1 if sent raw, 0 otherwise */
+tpcl_topix_raw(tpcl_job_t *job,         /* I - Job */
+               unsigned   len)          /* I - Length of TOPIX data */
+{
+  char          head[TPCL_BLOCK_HEAD];  /* {SG} header */
+  int           headlen;                /* Length of raw header */
+  long          topix, raw;             /* Bytes of each object */
+  int           first, end;             /* Columns with ink */
+  int           bytes;                  /* Bytes per raw line */
+  int           used;                   /* Bytes of an encoded line */
+  int           i;                      /* Looping var */
+  const unsigned char *ptr;             /* Encoded line */
+  unsigned char *data;                  /* Raw lines */
+
+
+  first = job->width;
+  end   = 0;
+
+  for (i = 0, ptr = job->comp_buffer; i < job->block_lines; i ++, ptr += used)
+    if ((used = TOPIXLineSpan(ptr, (int)(job->comp_ptr - ptr), &first,
+                              &end)) < 0)
+      return (0);
+
+  if (end <= first)
+    return (0);
+
+  bytes   = end - first;
+  topix   = snprintf(head, sizeof(head), "{SG;0000,%04dD,%04d,%04d,%d,",
+                     job->comp_last_line, job->width * 8, job->block_lines,
+                     TEC_GMODE_TOPIX) + 2 + (long)len;
+  headlen = snprintf(head, sizeof(head), "{SG;%04dD,%04dD,%04d,%04d,%d,",
+                     first * 8, job->comp_last_line, bytes * 8,
+                     job->block_lines, TEC_GMODE_HEX_AND);
+  raw     = headlen + (long)bytes * job->block_lines;
+
+  if (headlen < 0 || headlen > TPCL_BLOCK_HEAD || raw >= topix)
+  {
+    tpcl_log(job, "Sending lines %d to %d as TOPIX, %ld bytes instead of %ld "
+                  "raw", job->comp_last_line,
+             job->comp_last_line + job->block_lines - 1, topix, raw);
+    return (0);
+  }
+
+  tpcl_log(job, "Sending lines %d to %d raw, %ld bytes instead of %ld TOPIX",
+           job->comp_last_line, job->comp_last_line + job->block_lines - 1,
+           raw, topix);
+
+  data = job->raw_block + TPCL_BLOCK_HEAD;
+
+  memset(job->last_buffer, 0, job->width);
+
+  for (i = 0, ptr = job->comp_buffer; i < job->block_lines; i ++, ptr += used)
+  {
+    used = TOPIXDecodeLine(ptr, (int)(job->comp_ptr - ptr), job->last_buffer,
+                           job->width);
+    memcpy(data + (size_t)i * bytes, job->last_buffer + first, (size_t)bytes);
+  }
+
+  memcpy(data - headlen, head, (size_t)headlen);
+  memcpy(data + (size_t)job->block_lines * bytes, "|}\n", 3);
+
+  tpcl_write(job, data - headlen, (size_t)raw + 3);
+  tpcl_write(job, NULL, 0);
+
+  job->stats.objects ++;
+  job->stats.raw_objects ++;
+  job->stats.saved_bytes += topix - raw;
+
+  return (1);
+}
+
+
+/*
+ * 'tpcl_raw_line()' - Collect a raw graphics line.
+ *
+ * Lines are kept at full width together with the columns that have ink.
+ * Blank lines are handled as for TOPIX: skipped at the top, and later
+ * runs either kept or ending the object, whatever sends fewer bytes.
+ */
+static void
+tpcl_raw_line(tpcl_job_t          *job, /* I - Job */
+              const unsigned char *line)/* I - Line */
+{
+  int           first, end;             /* Columns with ink */
+  size_t        blank;                  /* Bytes of blank lines */
+
+
+  if (!TOPIXDirtySpan(line, job->zero_buffer, job->width, &first, &end))
+  {
+    job->blank_lines ++;
+    job->stats.blank_lines ++;
+    return;
+  }
+
+  job->stats.changed_lines ++;
+
+  if (job->blank_lines && job->block_lines)
+  {
+    blank = (size_t)job->blank_lines * (size_t)job->width;
+
+    if ((size_t)job->blank_lines * (size_t)(job->ink_right - job->ink_left) <= TPCL_BLOCK_COST &&
+        (size_t)(job->comp_ptr - job->comp_buffer) + blank <= job->comp_size &&
+        job->block_lines + job->blank_lines < TPCL_BLOCK_LINES)
+    {
+      memset(job->comp_ptr, 0, blank);
+      job->comp_ptr    += blank;
+      job->block_lines += job->blank_lines;
+    }
+    else
+      tpcl_raw_output(job);
+  }
+
+  job->blank_lines = 0;
+
+  if ((size_t)(job->comp_ptr - job->comp_buffer) + job->width > job->comp_size ||
+      job->block_lines >= TPCL_BLOCK_LINES)
+    tpcl_raw_output(job);
+
+  if (!job->block_lines)
+  {
+    job->comp_last_line = job->y;
+    job->ink_left       = first;
+    job->ink_right      = end;
+  }
+  else
+  {
+    if (first < job->ink_left)
+      job->ink_left = first;
+    if (end > job->ink_right)
+      job->ink_right = end;
+  }
+
+  memcpy(job->comp_ptr, line, job->width);
+  job->comp_ptr += job->width;
+  job->block_lines ++;
+}
+
+
+/*
+ * 'tpcl_raw_output()' - Send the ink box of the raw graphics lines.
+ *
+ * The columns with ink are packed to the start of the buffer, then the
+ * object is written with its X/Y offset and size in one callback.
+ */
+static void
+tpcl_raw_output(tpcl_job_t *job)        /* I - Job */
+{
+  char          head[TPCL_BLOCK_HEAD];  /* {SG} header */
+  int           headlen;                /* Length of header */
+  int           bytes;                  /* Bytes per line in the box */
+  int           i;                      /* Looping var */
+  unsigned char *start;                 /* Start of block */
+
+
+  if (!job->comp_buffer || !job->block_lines)
+    return;
+
+  bytes = job->ink_right - job->ink_left;
+
+  if (bytes < job->width)
+  {
+    for (i = 0; i < job->block_lines; i ++)
+      memmove(job->comp_buffer + (size_t)i * bytes,
+              job->comp_buffer + (size_t)i * job->width + job->ink_left,
+              (size_t)bytes);
+
+    job->comp_ptr = job->comp_buffer + (size_t)job->block_lines * bytes;
+  }
+
+  headlen = snprintf(head, sizeof(head), "{SG;%04dD,%04dD,%04d,%04d,%d,",
+                     job->ink_left * 8, job->comp_last_line, bytes * 8,
+                     job->block_lines, job->gmode);
+  if (headlen < 0 || headlen > TPCL_BLOCK_HEAD)
+  {
+    job->error = 1;
+    return;
+  }
+
+  start = job->comp_buffer - headlen;
+  memcpy(start, head, (size_t)headlen);
+  memcpy(job->comp_ptr, "|}\n", 3);
+
+  tpcl_write(job, start, (size_t)(job->comp_ptr - start) + 3);
+
+  job->stats.objects ++;
+
+  job->comp_index  = !job->comp_index;
+  job->comp_buffer = job->comp_block[job->comp_index] + TPCL_BLOCK_HEAD;
+  job->comp_ptr    = job->comp_buffer;
+  job->block_lines = 0;
+}
+
+
+/*
+ * 'tpcl_topix_bands()' - Compress many lines on several threads.
+ *
+ * Between graphics objects every line is encoded against the one above
+ * it, so the lines can be split into bands and encoded by separate
+ * threads.  The encoded lines are then passed to tpcl_topix_compress() in
+ * order, which only encodes again the first line of an object that was
+ * sent because it was full, so the output is the same as line by line.
+ */
+static int                              /* O - 0 on success, -1 on error */
+tpcl_topix_bands(tpcl_job_t          *job,      /* I - Job */
+                 const unsigned char *lines,    /* I - Lines to compress */
+                 int                 count)     /* I - Number of lines */
+{
+  tpcl_band_t   bands[TPCL_MAX_THREADS];        /* Bands */
+  pthread_t     threads[TPCL_MAX_THREADS];      /* Band threads */
+  int           started[TPCL_MAX_THREADS];      /* Thread was started? */
+  int           num_bands;              /* Number of bands */
+  int           width;                  /* Bytes per line */
+  int           max_line;               /* Worst case encoded line */
+  int           b, i;                   /* Looping vars */
+  size_t        lengths;                /* Size of line lengths */
+  const unsigned char *line;            /* Current line */
+  unsigned char *ptr;                   /* Current encoded line */
+
+
+  if (job->error)
+    return (-1);
+
+  job->graphics = TPCL_GRAPHICS_OPEN;
+
+  width    = job->width;
+  max_line = 1 + 8 + 64 + (width < TOPIX_MAX_WIDTH ? width : TOPIX_MAX_WIDTH);
+
+  if ((num_bands = count / TPCL_BAND_LINES) > job->threads)
+    num_bands = job->threads;
+
+  /*
+   * The line lengths and encoded lines of all bands share the job's
+   * scratch buffer...
+   */
+  lengths = ((size_t)count * sizeof(int) + 15) & ~(size_t)15;
+
+  if ((ptr = tpcl_reserve(job, &job->scratch, &job->scratch_size,
+                          lengths + (size_t)count * max_line +
+                          (size_t)num_bands * TOPIX_SLACK)) == NULL)
+    return (-1);
+
+  /*
+   * Encode the bands, the last one on this thread...
+   */
+  memset(bands, 0, sizeof(bands));
+  memset(started, 0, sizeof(started));
+
+  for (b = 0; b < num_bands; b ++)
+  {
+    bands[b].count   = count / num_bands + (b < count % num_bands);
+    bands[b].lines   = b ? bands[b - 1].lines + (size_t)bands[b - 1].count * width
+                         : lines;
+    bands[b].prev    = b ? bands[b].lines - width :
+                       job->blank_lines ? job->zero_buffer : job->last_buffer;
+    bands[b].width   = width;
+    bands[b].encode  = job->encode;
+    bands[b].lengths = b ? bands[b - 1].lengths + bands[b - 1].count
+                         : (int *)job->scratch;
+    bands[b].data    = b ? bands[b - 1].data +
+                           (size_t)bands[b - 1].count * max_line + TOPIX_SLACK
+                         : job->scratch + lengths;
+  }
+
+  for (b = 0; b < num_bands - 1; b ++)
+    started[b] = !pthread_create(threads + b, NULL, tpcl_band_encode,
+                                 bands + b);
+
+  for (b = 0; b < num_bands; b ++)
+  {
+    if (b < num_bands - 1 && started[b])
+      pthread_join(threads[b], NULL);
+    else
+      tpcl_band_encode(bands + b);
+  }
+
+  /*
+   * Then copy them into graphics objects...
+   */
+  for (b = 0; b < num_bands; b ++)
+  {
+    line = bands[b].lines;
+    ptr  = bands[b].data;
+
+    for (i = 0; i < bands[b].count; i ++, line += width)
+    {
+      tpcl_topix_compress(job, line, ptr, bands[b].lengths[i]);
+
+      ptr += bands[b].lengths[i];
+      job->y ++;
+      job->stats.lines ++;
+    }
+  }
+
+  return (job->error ? -1 : 0);
+}
+
+
+/*
+ * 'tpcl_band_encode()' - Encode each line of a band against the one above.
+ */
+static void *                           /* O - Unused */
+tpcl_band_encode(void *data)            /* I - Band */
+{
+  tpcl_band_t           *band = (tpcl_band_t *)data;
+  const unsigned char   *line,          /* Current line */
+                        *prev;          /* Line above */
+  unsigned char         *ptr;           /* Output pointer */
+  int                   i;              /* Looping var */
+
+
+  line = band->lines;
+  prev = band->prev;
+  ptr  = band->data;
+
+  for (i = 0; i < band->count; i ++)
+  {
+    band->lengths[i] = (*band->encode)(line, prev, band->width, ptr);
+    ptr  += band->lengths[i];
+    prev = line;
+    line += band->width;
+  }
+
+  return (NULL);
+}
+
+
+/*
+ * 'tpcl_init_once()' - One time library initialization.
+ */
+static void
+tpcl_init_once(void)
+{
+  TOPIXSelectKernel();
+  DITHERSelectKernel();
+  ORIENTSelectKernel();
+}
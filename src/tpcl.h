@@ -0,0 +1,186 @@
+/*
+ *   Toshiba TEC TPCL label encoding library.
+ *
+ *   Copyright 2001-2007 by Easy Software Products.
+ *   Copyright 2009 by Patrick Kong
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The library turns CUPS raster lines into a TPCL command stream.  All
+ * state lives in a tpcl_job_t, so any number of jobs can be encoded at
+ * once from different threads as long as each job is used by one thread
+ * at a time.  Output goes to a caller supplied write callback.
+ *
+ * Typical use:
+ *
+ *   job = tpclJobNew(&settings, my_write, my_data);
+ *   tpclJobSetup(job);
+ *   for each page:
+ *     tpclPageStart(job, &header);
+ *     for each line:
+ *       read the line into tpclPageBuffer(job)
+ *       tpclPageWriteLine(job, tpclPageBuffer(job));
+ *     tpclPageEnd(job);
+ *   tpclJobDelete(job);
+ *
+ * When a whole page (or a large part of one) is already in memory,
+ * tpclPageWriteLines() encodes it in one call, using the threads set with
+ * tpclJobSetThreads() to encode tall pages in bands.
+ *
+ * Pages may be 1-bit or 8-bit grayscale; grayscale lines are dithered to
+ * 1 bit with the job's dither setting as they are written.  Pages are
+ * rotated by the rotate setting, mirrored when the header's MirrorPrint
+ * is set and inverted for NegativePrint.  Rotated pages are kept in
+ * memory and encoded by tpclPageEndGraphics().
+ *
+ * With the incremental setting the printer's image buffer is not cleared
+ * between pages of the same size; every page is kept and only the areas
+ * that differ from the page before are sent.  The pages of such a job
+ * must be encoded in order by a single job object.
+ */
+
+#ifndef _TPCL_H_
+#define _TPCL_H_
+
+#include <stddef.h>
+#include <cups/raster.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*
+ * Largest issue quantity in {XS}
+ */
+#define TPCL_MAX_COPIES   9999
+
+
+/*
+ * TEC Graphics Modes
+ */
+#define TEC_GMODE_TOPIX   3
+#define TEC_GMODE_HEX_AND 1
+#define TEC_GMODE_HEX_OR  5
+
+/*
+ * Not a TPCL mode: TOPIX, but each object that would be smaller as raw
+ * graphics (TEC_GMODE_HEX_AND) is sent raw instead.
+ */
+#define TEC_GMODE_AUTO    15
+
+
+/*
+ * Conversion of 8-bit grayscale pages to the printer's 1 bit
+ */
+#define TPCL_DITHER_THRESHOLD 0         /* Fixed 50% threshold */
+#define TPCL_DITHER_ORDERED   1         /* 8x8 Bayer matrix */
+#define TPCL_DITHER_SCREEN    2         /* Vertical line screen */
+#define TPCL_DITHER_DIFFUSION 3         /* Floyd-Steinberg */
+
+
+/*
+ * Write callback: send len bytes of data to the printer and return 0,
+ * or -1 on error.  A call with a NULL data pointer asks the callback to
+ * flush anything it has buffered.  Graphics objects are passed whole, and
+ * stay valid until the following object has been passed, so a callback
+ * may keep sending one while the next is encoded.
+ */
+typedef int (*tpcl_write_cb_t)(void *user_data, const void *data, size_t len);
+
+/*
+ * Log callback: DEBUG level messages, without prefix or newline.
+ */
+typedef void (*tpcl_log_cb_t)(void *user_data, const char *message);
+
+/*
+ * Job settings, the resolved values of the PPD options.
+ */
+typedef struct tpcl_settings_s
+{
+  int   gap;                /* Label gap in mm (Gap) */
+  int   media_tracking;     /* Sensor type 0-4 (teMediaTracking) */
+  int   print_mode;         /* 0 batch, 1/2 peel, 3 cut (tePrintMode) */
+  int   print_rate;         /* Speed choice (tePrintRate) */
+  int   graphics_mode;      /* TEC_GMODE_xxx (teGraphicsMode) */
+  int   print_orient;       /* Orientation/mirror 0-3 (PrintOrient) */
+  int   dither;             /* TPCL_DITHER_xxx for grayscale (teDither) */
+  int   rotate;             /* 0, 90, 180 or 270 degrees clockwise (teRotate) */
+  int   incremental;        /* Send only changes to the last page (teIncremental) */
+  char  feed_adjust[8];     /* Signed feed adjust, "+000" (FAdjSgn/FAdjV) */
+  char  cut_adjust[8];      /* Signed cut/peel adjust (CAdjSgn/CAdjV) */
+  char  back_adjust[8];     /* Signed back feed adjust (RAdjSgn/RAdjV) */
+  char  ribbon_fwd[8];      /* Ribbon take up motor (RbnAdjFwd) */
+  char  ribbon_back[8];     /* Ribbon feed motor (RbnAdjBck) */
+} tpcl_settings_t;
+
+typedef struct tpcl_job_s tpcl_job_t;
+
+/*
+ * Page statistics, for the page being written or the last one ended.
+ * Pages sent with tpclPageWriteGraphics() only count bytes.
+ */
+typedef struct tpcl_page_stats_s
+{
+  int   lines;              /* Lines written */
+  int   blank_lines;        /* Lines without ink */
+  int   changed_lines;      /* Lines sent with data */
+  int   objects;            /* Graphics objects sent */
+  int   raw_objects;        /* Objects TEC_GMODE_AUTO sent raw */
+  long  saved_bytes;        /* Bytes saved by sending them raw */
+  long  bytes;              /* Bytes sent for the page */
+} tpcl_page_stats_t;
+
+
+/*
+ * Prototypes...
+ */
+extern void           tpclDefaultSettings(tpcl_settings_t *settings);
+
+extern tpcl_job_t     *tpclJobNew(const tpcl_settings_t *settings,
+                                  tpcl_write_cb_t cb, void *user_data);
+extern void           tpclJobDelete(tpcl_job_t *job);
+extern void           tpclJobReset(tpcl_job_t *job);
+extern void           tpclJobSetLog(tpcl_job_t *job, tpcl_log_cb_t cb,
+                                    void *user_data);
+extern int            tpclJobSetup(tpcl_job_t *job);
+extern void           tpclJobSetThreads(tpcl_job_t *job, int threads);
+extern void           tpclJobCancel(tpcl_job_t *job);
+extern int            tpclJobCanceled(tpcl_job_t *job);
+
+extern int            tpclPageStart(tpcl_job_t *job,
+                                    const cups_page_header2_t *header);
+extern unsigned char  *tpclPageBuffer(tpcl_job_t *job);
+extern int            tpclPageWriteLine(tpcl_job_t *job,
+                                        const unsigned char *line);
+extern int            tpclPageWriteLines(tpcl_job_t *job,
+                                         const unsigned char *lines,
+                                         int count);
+extern int            tpclPageWriteRepeat(tpcl_job_t *job,
+                                          const unsigned char *line,
+                                          int count);
+extern int            tpclPageWriteGraphics(tpcl_job_t *job,
+                                            const void *data, size_t len);
+extern int            tpclPageEndGraphics(tpcl_job_t *job);
+extern int            tpclPageRepeatable(tpcl_job_t *job);
+extern int            tpclPageEnd(tpcl_job_t *job);
+extern int            tpclPageEndCopies(tpcl_job_t *job, int copies);
+extern void           tpclPageStats(tpcl_job_t *job,
+                                    tpcl_page_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_TPCL_H_ */
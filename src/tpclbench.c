@@ -0,0 +1,919 @@
+/*
+ *   Encoder benchmark for the Toshiba TEC TPCL filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Usage:
+ *
+ *   tpclbench [-d dir] [-b baseline] [-w] [-t tolerance] [-m model]
+ *             [-k workload] [-j threads] [-r] [-e]
+ *
+ * Creates a corpus of CUPS raster files (one per model, resolution and
+ * workload) in dir, then runs each through libtpcl in every graphics
+ * mode and reports lines/s, MB/s of raster and the output size.  The
+ * results are checked against the baseline file, which is written on the
+ * first run or with -w; a run fails if any case is slower than the
+ * baseline by more than the tolerance (default 0.25) or produces more
+ * output bytes.  Throughput baselines only make sense on one machine.
+ * With -j each page is passed to tpclPageWriteLines() in one call so tall
+ * pages are encoded in bands on that many threads.
+ *
+ * With -r the raster readers are tested instead: every corpus file, and
+ * an uncompressed copy of it, is read by libcups and by the native
+ * reader, the pixels are compared and the read rates are reported.  A
+ * run fails if the pixels differ.
+ *
+ * With -e the TOPIX line encoders are compared instead: every line of
+ * each corpus page is encoded against the one above by TOPIXEncodeLine()
+ * and by the encoder TOPIXLineEncoder() picks for the width of the
+ * model's print head, the output is compared and the rates are reported.
+ * A run fails if the output differs.
+ *
+ * Contents:
+ *
+ *   Random()       - Small deterministic random number generator.
+ *   FillLine()     - Generate one raster line of a workload.
+ *   MakeRaster()   - Write a corpus raster file.
+ *   LoadRaster()   - Read a raster file into memory.
+ *   ReadCase()     - Time one raster reader over a file.
+ *   EncodeCase()   - Time one TOPIX line encoder over a page.
+ *   CountOutput()  - libtpcl write callback counting the output.
+ *   RunCase()      - Time the encoder over one page in one mode.
+ *   ReadBaseline() - Load the baseline results.
+ *   main()         - Main entry for the benchmark.
+ */
+
+#include <cups/cups.h>
+#include <cups/raster.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <sys/stat.h>
+#include "tpcl.h"
+#include "topix.h"
+#include "raster.h"
+
+
+/*
+ * Models from tectpcl2.drv: widest media and resolutions.
+ */
+typedef struct bench_model_s
+{
+  const char  *name;                    /* PCFileName without .ppd */
+  int         max_width;                /* MaxSize width in points */
+  int         max_length;               /* MaxSize length in points */
+  int         dpi;                      /* Resolution */
+} bench_model_t;
+
+static const bench_model_t Models[] =
+{
+  { "tecbsa4",  300, 2830, 203 },
+  { "tecbsa4",  300, 2830, 300 },
+  { "tecbsx4",  295, 4246, 203 },
+  { "tecbsx5",  362, 4246, 203 },
+  { "tecbsx5",  362, 4246, 300 },
+  { "tecbsx6",  483, 4246, 203 },
+  { "tecbsx6",  483, 4246, 300 },
+  { "tecbsx8",  605, 4246, 203 },
+  { "tecbsx8",  605, 4246, 300 },
+  { "tecb852r", 614, 1814, 300 },
+  { "tecbsv4d", 306, 1726, 203 },
+  { "tecbsv4t", 306, 1726, 203 },
+  { "tecbev4d", 306, 1726, 203 },
+  { "tecbev4d", 306, 1726, 300 },
+  { "tecbev4t", 306, 1726, 203 },
+  { "tecbev4t", 306, 1726, 300 }
+};
+
+static const char * const Workloads[] =
+{
+  "blank", "barcode", "text", "photo", "long", "noise"
+};
+
+static const struct
+{
+  const char  *name;                    /* Name in reports */
+  int         gmode;                    /* TEC_GMODE_xxx */
+} Modes[] =
+{
+  { "topix",  TEC_GMODE_TOPIX },
+  { "hexand", TEC_GMODE_HEX_AND },
+  { "hexor",  TEC_GMODE_HEX_OR },
+  { "auto",   TEC_GMODE_AUTO }
+};
+
+#define NUM_MODELS    (int)(sizeof(Models) / sizeof(Models[0]))
+#define NUM_WORKLOADS (int)(sizeof(Workloads) / sizeof(Workloads[0]))
+#define NUM_MODES     (int)(sizeof(Modes) / sizeof(Modes[0]))
+
+#define LABEL_LENGTH  432               /* Normal label length, 6" */
+#define MIN_SECONDS   0.1               /* Minimum time per run */
+#define NUM_RUNS      3                 /* Runs per case, best is kept */
+
+
+/*
+ * Baseline entries...
+ */
+typedef struct bench_result_s
+{
+  char    key[64];                      /* model/dpi/workload/mode */
+  double  lines_per_sec;                /* Encoder throughput */
+  double  out_bytes;                    /* Output size */
+} bench_result_t;
+
+
+/*
+ * Prototypes...
+ */
+static unsigned       Random(unsigned *seed);
+static void           FillLine(const char *workload, unsigned char *line,
+                               int bpl, int y, int height, unsigned *seed);
+static int            MakeRaster(const char *filename, const bench_model_t *model,
+                                 int compressed,
+                                 const char *workload);
+static unsigned char  *LoadRaster(const char *filename,
+                                  cups_page_header2_t *header);
+static double         ReadCase(const char *filename, int native,
+                               const unsigned char *pixels, size_t size,
+                               int *same);
+static double         EncodeCase(const cups_page_header2_t *header,
+                                 const unsigned char *pixels,
+                                 topix_kernel_t encode, unsigned char *out,
+                                 size_t *out_bytes);
+static int            CountOutput(void *user_data, const void *data, size_t len);
+static double         RunCase(const cups_page_header2_t *header,
+                              unsigned char *pixels, int gmode,
+                              int threads, size_t *out_bytes);
+static int            ReadBaseline(const char *filename, bench_result_t **results);
+
+
+/*
+ * 'Random()' - Small deterministic random number generator.
+ */
+static unsigned                         /* O - Next random number */
+Random(unsigned *seed)                  /* IO - Generator state */
+{
+  *seed = *seed * 1103515245 + 12345;
+
+  return ((*seed >> 8) & 0xffffff);
+}
+
+
+/*
+ * 'FillLine()' - Generate one raster line of a workload.
+ */
+static void
+FillLine(const char    *workload,       /* I - Workload name */
+         unsigned char *line,           /* O - Line */
+         int           bpl,             /* I - Bytes per line */
+         int           y,               /* I - Line number */
+         int           height,          /* I - Page height */
+         unsigned      *seed)           /* IO - Random state */
+{
+  int       i, x;                       /* Byte, dot */
+  int       band;                       /* Vertical band */
+  unsigned  glyph;                      /* Pseudo glyph bits */
+  double    level;                      /* Photo grey level */
+  static const unsigned char bayer[4][4] =
+  {                                     /* Ordered dither matrix */
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 }
+  };
+
+
+  memset(line, 0, bpl);
+
+  if (!strcmp(workload, "noise"))
+  {
+    for (i = 0; i < bpl; i++)
+      line[i] = (unsigned char)Random(seed);
+  }
+  else if (!strcmp(workload, "barcode"))
+  {
+   /*
+    * 1D barcode in the top half, 2D matrix of 6 dot modules below.
+    */
+    band = y * 8 / height;
+
+    if (band >= 1 && band <= 3)
+    {
+      for (i = bpl / 10; i < bpl * 9 / 10; i++)
+        line[i] = (unsigned char)(0xF0F0F0F0 >> ((i * 7) % 13));
+    }
+    else if (band >= 4 && band <= 6)
+    {
+      for (x = bpl / 4 * 8; x < bpl * 3 / 4 * 8; x++)
+      {
+        glyph = (unsigned)(x / 6) * 2654435761u ^ (unsigned)(y / 6) * 40503u;
+        if ((glyph >> 13) & 1)
+          line[x / 8] |= 0x80 >> (x & 7);
+      }
+    }
+  }
+  else if (!strcmp(workload, "text") || !strcmp(workload, "long"))
+  {
+   /*
+    * Lines of 24x32 dot character cells made of 3x4 dot pixels, with a
+    * gap between text lines.
+    */
+    if ((y % 48) >= 32)
+      return;
+
+    for (x = 16; x < bpl * 8 - 16; x++)
+    {
+      glyph = (unsigned)((x / 24) + (y / 48) * 131) * 2246822519u;
+      if ((x % 24) < 18 && (glyph >> (((x % 24) / 3) + ((y % 48) / 4) * 6 % 26)) & 1)
+        line[x / 8] |= 0x80 >> (x & 7);
+    }
+  }
+  else if (!strcmp(workload, "photo"))
+  {
+   /*
+    * Smooth shading dithered with a 4x4 Bayer matrix.
+    */
+    for (x = 0; x < bpl * 8; x++)
+    {
+      level = 0.5 + 0.25 * sin(x / 37.0) + 0.25 * cos(y / 53.0 + x / 91.0);
+      if (level * 16.0 > bayer[y & 3][x & 3] + 0.5)
+        line[x / 8] |= 0x80 >> (x & 7);
+    }
+  }
+}
+
+
+/*
+ * 'MakeRaster()' - Write a corpus raster file.
+ */
+static int                              /* O - 0 on success, -1 on error */
+MakeRaster(const char          *filename, /* I - File to create */
+           const bench_model_t *model,    /* I - Printer model */
+           int                 compressed, /* I - Version 2 raster? */
+           const char          *workload) /* I - Workload */
+{
+  int                 fd;               /* File */
+  cups_raster_t       *ras;             /* Raster stream */
+  cups_page_header2_t header;           /* Page header */
+  unsigned char       *line;            /* Line buffer */
+  unsigned            y, seed;          /* Line, random state */
+
+
+  memset(&header, 0, sizeof(header));
+
+  header.HWResolution[0]  = model->dpi;
+  header.HWResolution[1]  = model->dpi;
+  header.cupsPageSize[0]  = model->max_width;
+  header.cupsPageSize[1]  = strcmp(workload, "long") ? LABEL_LENGTH : model->max_length;
+  header.PageSize[0]      = (unsigned)header.cupsPageSize[0];
+  header.PageSize[1]      = (unsigned)header.cupsPageSize[1];
+  header.cupsWidth        = (unsigned)(header.cupsPageSize[0] * model->dpi / 72);
+  header.cupsHeight       = (unsigned)(header.cupsPageSize[1] * model->dpi / 72);
+  header.cupsBitsPerColor = 1;
+  header.cupsBitsPerPixel = 1;
+  header.cupsBytesPerLine = (header.cupsWidth + 7) / 8;
+  header.cupsColorOrder   = CUPS_ORDER_CHUNKED;
+  header.cupsColorSpace   = CUPS_CSPACE_K;
+  header.cupsCompression  = 11;         /* Darkness 0 */
+  header.NumCopies        = 1;
+  strcpy(header.MediaType, "Direct");
+
+  if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return (-1);
+
+  ras = cupsRasterOpen(fd, compressed ? CUPS_RASTER_WRITE_COMPRESSED :
+                                       CUPS_RASTER_WRITE);
+  cupsRasterWriteHeader2(ras, &header);
+
+  line = malloc(header.cupsBytesPerLine);
+  seed = 1;
+
+  for (y = 0; y < header.cupsHeight; y++)
+  {
+    FillLine(workload, line, header.cupsBytesPerLine, y, header.cupsHeight, &seed);
+    cupsRasterWritePixels(ras, line, header.cupsBytesPerLine);
+  }
+
+  free(line);
+  cupsRasterClose(ras);
+  close(fd);
+
+  return (0);
+}
+
+
+/*
+ * 'LoadRaster()' - Read a raster file into memory.
+ */
+static unsigned char *                  /* O - Pixels or NULL */
+LoadRaster(const char          *filename, /* I - Raster file */
+           cups_page_header2_t *header)   /* O - Page header */
+{
+  int             fd;                   /* File */
+  cups_raster_t   *ras;                 /* Raster stream */
+  unsigned char   *pixels = NULL;       /* Page pixels */
+  size_t          size;                 /* Size of page */
+
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return (NULL);
+
+  if ((ras = cupsRasterOpen(fd, CUPS_RASTER_READ)) != NULL &&
+      cupsRasterReadHeader2(ras, header))
+  {
+    size = (size_t)header->cupsBytesPerLine * header->cupsHeight;
+    if ((pixels = malloc(size)) != NULL &&
+        cupsRasterReadPixels(ras, pixels, (unsigned)size) < size)
+    {
+      free(pixels);
+      pixels = NULL;
+    }
+  }
+
+  if (ras)
+    cupsRasterClose(ras);
+  close(fd);
+
+  return (pixels);
+}
+
+
+/*
+ * 'ReadCase()' - Time one raster reader over a file.
+ *
+ * The file is read like the filter does, a line at a time, for at least
+ * MIN_SECONDS, NUM_RUNS times, and the lines of the first pass are
+ * compared with the pixels loaded by libcups.
+ */
+static double                           /* O - Seconds per page */
+ReadCase(const char          *filename, /* I - Raster file */
+         int                 native,    /* I - Native reader? */
+         const unsigned char *pixels,   /* I - Pixels from libcups */
+         size_t              size,      /* I - Size of pixels */
+         int                 *same)     /* O - Pixels the same? */
+{
+  int                 fd;               /* File */
+  cups_raster_t       *ras = NULL;      /* libcups stream */
+  tpcl_raster_t       *nras = NULL;     /* Native stream */
+  cups_page_header2_t header;           /* Page header */
+  unsigned char       *buffer;          /* Line buffer */
+  const unsigned char *line;            /* Line read */
+  struct timespec     start, now;       /* Timestamps */
+  double              elapsed;          /* Seconds */
+  double              best;             /* Best seconds per page */
+  int                 run, pages;       /* Current run, pages read */
+  size_t              offset;           /* Offset of line in pixels */
+  unsigned            y;                /* Line */
+
+
+  *same  = 1;
+  best   = 0.0;
+  buffer = malloc(size);
+
+  for (run = 0; run < NUM_RUNS; run ++)
+  {
+    pages = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do
+    {
+      if ((fd = open(filename, O_RDONLY)) < 0)
+      {
+        *same = 0;
+        free(buffer);
+        return (1.0);
+      }
+
+      if (native)
+        nras = tpclRasterOpen(fd);
+      else
+        ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
+
+      if (!(native ? tpclRasterReadHeader(nras, &header) :
+                     cupsRasterReadHeader2(ras, &header)) ||
+          (size_t)header.cupsBytesPerLine * header.cupsHeight != size)
+        *same = 0;
+
+      for (y = 0, offset = 0; *same && y < header.cupsHeight;
+           y ++, offset += header.cupsBytesPerLine)
+      {
+        if (native)
+          line = tpclRasterReadLine(nras);
+        else if (cupsRasterReadPixels(ras, buffer, header.cupsBytesPerLine) > 0)
+          line = buffer;
+        else
+          line = NULL;
+
+        if (!line)
+        {
+          *same = 0;
+          break;
+        }
+
+        if (run == 0 && pages == 0 &&
+            memcmp(line, pixels + offset, header.cupsBytesPerLine))
+          *same = 0;
+      }
+
+      if (native)
+        tpclRasterClose(nras);
+      else
+        cupsRasterClose(ras);
+      close(fd);
+
+      pages ++;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    while (elapsed < MIN_SECONDS && *same);
+
+    if (!*same)
+      break;
+
+    if (run == 0 || elapsed / pages < best)
+      best = elapsed / pages;
+  }
+
+  free(buffer);
+
+  return (best);
+}
+
+
+/*
+ * 'EncodeCase()' - Time one TOPIX line encoder over a page.
+ *
+ * Each line is encoded against the one above it, the first against a
+ * blank line, for at least MIN_SECONDS, NUM_RUNS times.  out must hold
+ * TOPIX_MAX_LINE + TOPIX_SLACK bytes per line.
+ */
+static double                           /* O - Seconds per page */
+EncodeCase(const cups_page_header2_t *header, /* I - Page header */
+           const unsigned char       *pixels, /* I - Page pixels */
+           topix_kernel_t            encode,  /* I - Line encoder */
+           unsigned char             *out,    /* O - Encoded lines */
+           size_t                    *out_bytes) /* O - Bytes encoded */
+{
+  unsigned char     *blank;             /* Line above the first */
+  const unsigned char *line, *prev;     /* Current line and line above */
+  unsigned char     *ptr;               /* Output pointer */
+  struct timespec   start, now;         /* Timestamps */
+  double            elapsed;            /* Seconds */
+  double            best;               /* Best seconds per page */
+  int               run, pages;         /* Current run, pages encoded */
+  unsigned          y;                  /* Line */
+
+
+  blank = calloc(1, header->cupsBytesPerLine);
+  best  = 0.0;
+
+  for (run = 0; run < NUM_RUNS; run ++)
+  {
+    pages = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do
+    {
+      for (y = 0, prev = blank, line = pixels, ptr = out;
+           y < header->cupsHeight;
+           y ++, prev = line, line += header->cupsBytesPerLine)
+        ptr += (*encode)(line, prev, (int)header->cupsBytesPerLine, ptr);
+
+      pages ++;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    while (elapsed < MIN_SECONDS);
+
+    if (run == 0 || elapsed / pages < best)
+      best = elapsed / pages;
+  }
+
+  free(blank);
+
+  *out_bytes = (size_t)(ptr - out);
+
+  return (best);
+}
+
+
+/*
+ * 'CountOutput()' - libtpcl write callback counting the output.
+ */
+static int                              /* O - Always 0 */
+CountOutput(void       *user_data,      /* I - Byte counter */
+            const void *data,           /* I - Data or NULL to flush */
+            size_t     len)             /* I - Length of data */
+{
+  if (data)
+    *(size_t *)user_data += len;
+
+  return (0);
+}
+
+
+/*
+ * 'RunCase()' - Time the encoder over one page in one mode.
+ *
+ * The page is encoded repeatedly for at least MIN_SECONDS, NUM_RUNS
+ * times, and the fastest run is used to keep the noise down.
+ */
+static double                           /* O - Seconds per page */
+RunCase(const cups_page_header2_t *header,    /* I - Page header */
+        unsigned char             *pixels,    /* I - Page pixels */
+        int                       gmode,      /* I - Graphics mode */
+        int                       threads,    /* I - Threads or 0 for lines */
+        size_t                    *out_bytes) /* O - Output per page */
+{
+  tpcl_settings_t   settings;           /* Job settings */
+  tpcl_job_t        *job;               /* Encoder job */
+  struct timespec   start, now;         /* Timestamps */
+  double            elapsed;            /* Seconds */
+  double            best;               /* Best seconds per page */
+  int               run;                /* Current run */
+  size_t            count;              /* Output bytes */
+  unsigned          y;                  /* Line */
+  int               pages;              /* Pages encoded */
+  unsigned char     *line;              /* Job line buffer */
+
+
+  tpclDefaultSettings(&settings);
+  settings.graphics_mode = gmode;
+
+  count = 0;
+  job   = tpclJobNew(&settings, CountOutput, &count);
+  best  = 0.0;
+
+  tpclJobSetThreads(job, threads);
+
+  for (run = 0; run < NUM_RUNS; run ++)
+  {
+    pages = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do
+    {
+      count = 0;
+
+      tpclPageStart(job, header);
+      if (threads)
+        tpclPageWriteLines(job, pixels, (int)header->cupsHeight);
+      else
+      {
+        for (y = 0; y < header->cupsHeight; y++)
+        {
+          line = tpclPageBuffer(job);
+          memcpy(line, pixels + (size_t)y * header->cupsBytesPerLine,
+                 header->cupsBytesPerLine);
+          tpclPageWriteLine(job, line);
+        }
+      }
+      tpclPageEnd(job);
+
+      pages ++;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    while (elapsed < MIN_SECONDS);
+
+    if (run == 0 || elapsed / pages < best)
+      best = elapsed / pages;
+  }
+
+  tpclJobDelete(job);
+
+  *out_bytes = count;
+
+  return (best);
+}
+
+
+/*
+ * 'ReadBaseline()' - Load the baseline results.
+ */
+static int                              /* O - Number of results */
+ReadBaseline(const char     *filename,  /* I - Baseline file */
+             bench_result_t **results)  /* O - Results */
+{
+  FILE            *fp;                  /* Baseline file */
+  char            line[256];            /* Line from file */
+  int             num = 0, alloc = 0;   /* Number of results */
+  bench_result_t  r, *temp;             /* Result */
+
+
+  *results = NULL;
+
+  if ((fp = fopen(filename, "r")) == NULL)
+    return (-1);
+
+  while (fgets(line, sizeof(line), fp))
+  {
+    if (line[0] == '#' ||
+        sscanf(line, "%63s%lf%lf", r.key, &r.lines_per_sec, &r.out_bytes) != 3)
+      continue;
+
+    if (num >= alloc)
+    {
+      alloc += 64;
+      if ((temp = realloc(*results, alloc * sizeof(bench_result_t))) == NULL)
+        break;
+      *results = temp;
+    }
+
+    (*results)[num++] = r;
+  }
+
+  fclose(fp);
+
+  return (num);
+}
+
+
+/*
+ * 'main()' - Main entry for the benchmark.
+ */
+int                                     /* O - Exit status */
+main(int  argc,                         /* I - Number of command-line arguments */
+     char *argv[])                      /* I - Command-line arguments */
+{
+  const char          *dir = "bench-data";  /* Corpus directory */
+  const char          *baseline = "bench.baseline";
+                                        /* Baseline file */
+  const char          *only_model = NULL;   /* Model filter */
+  const char          *only_work = NULL;    /* Workload filter */
+  double              tolerance = 0.25; /* Allowed slowdown */
+  int                 threads = 0;      /* Band threads, 0 = line by line */
+  int                 write_baseline = 0;   /* Write a new baseline? */
+  int                 readers = 0;      /* Test the raster readers? */
+  int                 encoders = 0;     /* Test the TOPIX line encoders? */
+  topix_kernel_t      encode;           /* Encoder for the width */
+  unsigned char       *encoded[2];      /* Lines from each encoder */
+  size_t              encoded_bytes[2]; /* Bytes from each encoder */
+  double              generic_sec, width_sec; /* Seconds per encode */
+  bench_result_t      *base;            /* Baseline results */
+  int                 num_base;         /* Number of baseline results */
+  FILE                *out = NULL;      /* New baseline */
+  int                 i, m, w, g, b;    /* Looping vars */
+  int                 failures = 0;     /* Regressions */
+  char                filename[1024];   /* Raster file */
+  char                rawname[1024];    /* Uncompressed raster file */
+  const char          *files[2];        /* Files read by the readers */
+  double              cups_sec, native_sec; /* Seconds per read */
+  int                 cups_same, native_same; /* Pixels the same? */
+  char                key[64];          /* Result key */
+  struct stat         st;               /* File info */
+  cups_page_header2_t header;           /* Page header */
+  unsigned char       *pixels;          /* Page pixels */
+  double              seconds;          /* Time per page */
+  size_t              size;             /* Bytes per page */
+  double              lines_per_sec;    /* Throughput */
+  size_t              out_bytes;        /* Output per page */
+  const char          *status;          /* Result status */
+
+
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-d") && i + 1 < argc)
+      dir = argv[++i];
+    else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+      baseline = argv[++i];
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+      tolerance = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+      only_model = argv[++i];
+    else if (!strcmp(argv[i], "-k") && i + 1 < argc)
+      only_work = argv[++i];
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+      threads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-w"))
+      write_baseline = 1;
+    else if (!strcmp(argv[i], "-r"))
+      readers = 1;
+    else if (!strcmp(argv[i], "-e"))
+      encoders = 1;
+    else
+    {
+      fputs("Usage: tpclbench [-d dir] [-b baseline] [-w] [-t tolerance] "
+            "[-m model] [-k workload] [-j threads] [-r] [-e]\n", stderr);
+      return (1);
+    }
+  }
+
+  mkdir(dir, 0755);
+
+  if (readers)
+  {
+    num_base = 0;
+    base     = NULL;
+
+    printf("%-9s %4s %-8s %-6s %12s %12s %7s\n", "model", "dpi", "workload",
+           "format", "libcups MB/s", "native MB/s", "speedup");
+  }
+  else if (encoders)
+  {
+    num_base = 0;
+    base     = NULL;
+
+    TOPIXSelectKernel();
+
+    printf("Kernel %s\n", TOPIXKernelName());
+    printf("%-9s %4s %-8s %5s %-7s %12s %12s %7s\n", "model", "dpi",
+           "workload", "bytes", "encoder", "generic MB/s", "width MB/s",
+           "speedup");
+  }
+  else if ((num_base = ReadBaseline(baseline, &base)) < 0)
+    write_baseline = 1;
+
+  if (!readers && !encoders && write_baseline &&
+      (out = fopen(baseline, "w")) == NULL)
+  {
+    perror(baseline);
+    return (1);
+  }
+
+  if (out)
+    fputs("# key lines/s output-bytes\n", out);
+
+  if (!readers && !encoders)
+    printf("%-9s %4s %-8s %-7s %10s %8s %10s %7s\n", "model", "dpi",
+           "workload", "mode", "lines/s", "MB/s", "out bytes", "ratio");
+
+  for (m = 0; m < NUM_MODELS; m++)
+  {
+    if (only_model && strcmp(only_model, Models[m].name))
+      continue;
+
+    for (w = 0; w < NUM_WORKLOADS; w++)
+    {
+      if (only_work && strcmp(only_work, Workloads[w]))
+        continue;
+
+      snprintf(filename, sizeof(filename), "%s/%s-%d-%s.ras", dir,
+               Models[m].name, Models[m].dpi, Workloads[w]);
+
+      if (stat(filename, &st) &&
+          MakeRaster(filename, Models + m, 1, Workloads[w]))
+      {
+        perror(filename);
+        return (1);
+      }
+
+      if ((pixels = LoadRaster(filename, &header)) == NULL)
+      {
+        fprintf(stderr, "tpclbench: Unable to read %s\n", filename);
+        return (1);
+      }
+
+      if (encoders)
+      {
+        size       = (size_t)header.cupsHeight * (TOPIX_MAX_LINE + TOPIX_SLACK);
+        encoded[0] = malloc(size);
+        encoded[1] = malloc(size);
+        encode     = TOPIXLineEncoder((int)header.cupsBytesPerLine);
+
+        generic_sec = EncodeCase(&header, pixels, TOPIXEncodeLine, encoded[0],
+                                 encoded_bytes + 0);
+        width_sec   = EncodeCase(&header, pixels, encode, encoded[1],
+                                 encoded_bytes + 1);
+
+        size = (size_t)header.cupsBytesPerLine * header.cupsHeight;
+
+        if (encoded_bytes[0] != encoded_bytes[1] ||
+            memcmp(encoded[0], encoded[1], encoded_bytes[0]))
+        {
+          failures ++;
+          status = " MISMATCH";
+        }
+        else
+          status = "";
+
+        printf("%-9s %4d %-8s %5u %-7s %12.1f %12.1f %6.2fx%s\n",
+               Models[m].name, Models[m].dpi, Workloads[w],
+               header.cupsBytesPerLine,
+               encode == TOPIXEncodeLine ? "generic" : "width",
+               size / generic_sec / 1048576.0, size / width_sec / 1048576.0,
+               generic_sec / width_sec, status);
+
+        free(encoded[0]);
+        free(encoded[1]);
+        free(pixels);
+        continue;
+      }
+      else if (readers)
+      {
+        snprintf(rawname, sizeof(rawname), "%s/%s-%d-%s-v3.ras", dir,
+                 Models[m].name, Models[m].dpi, Workloads[w]);
+
+        if (stat(rawname, &st) &&
+            MakeRaster(rawname, Models + m, 0, Workloads[w]))
+        {
+          perror(rawname);
+          return (1);
+        }
+
+        files[0] = filename;
+        files[1] = rawname;
+
+        for (g = 0; g < 2; g ++)
+        {
+          size       = (size_t)header.cupsBytesPerLine * header.cupsHeight;
+          cups_sec   = ReadCase(files[g], 0, pixels, size, &cups_same);
+          native_sec = ReadCase(files[g], 1, pixels, size, &native_same);
+
+          if (!cups_same || !native_same)
+            failures ++;
+
+          printf("%-9s %4d %-8s %-6s %12.1f %12.1f %6.1fx%s\n", Models[m].name,
+                 Models[m].dpi, Workloads[w], g ? "raw" : "rle",
+                 size / cups_sec / 1048576.0, size / native_sec / 1048576.0,
+                 cups_sec / native_sec,
+                 cups_same && native_same ? "" : " MISMATCH");
+        }
+
+        free(pixels);
+        continue;
+      }
+
+      for (g = 0; g < NUM_MODES; g++)
+      {
+        seconds       = RunCase(&header, pixels, Modes[g].gmode, threads,
+                                &out_bytes);
+        lines_per_sec = header.cupsHeight / seconds;
+
+        snprintf(key, sizeof(key), "%s/%d/%s/%s", Models[m].name, Models[m].dpi,
+                 Workloads[w], Modes[g].name);
+
+        status = "";
+        if (out)
+          fprintf(out, "%s %.0f %lu\n", key, lines_per_sec, (unsigned long)out_bytes);
+        else
+        {
+          for (b = 0; b < num_base; b++)
+            if (!strcmp(base[b].key, key))
+              break;
+
+          if (b >= num_base)
+            status = " (new)";
+          else if (out_bytes > base[b].out_bytes)
+          {
+            status = " RATIO REGRESSION";
+            failures ++;
+          }
+          else if (lines_per_sec < base[b].lines_per_sec * (1.0 - tolerance))
+          {
+            status = " SLOWER";
+            failures ++;
+          }
+        }
+
+        printf("%-9s %4d %-8s %-7s %10.0f %8.1f %10lu %7.2f%s\n", Models[m].name,
+               Models[m].dpi, Workloads[w], Modes[g].name, lines_per_sec,
+               lines_per_sec * header.cupsBytesPerLine / 1048576.0,
+               (unsigned long)out_bytes,
+               (double)header.cupsBytesPerLine * header.cupsHeight / out_bytes,
+               status);
+      }
+
+      free(pixels);
+    }
+  }
+
+  if (out)
+  {
+    fclose(out);
+    printf("Baseline written to %s\n", baseline);
+  }
+  else if (failures && encoders)
+    printf("%d page(s) encoded differently\n", failures);
+  else if (failures && readers)
+    printf("%d file(s) read differently\n", failures);
+  else if (failures)
+    printf("%d regression(s) against %s\n", failures, baseline);
+
+  free(base);
+
+  return (failures ? 1 : 0);
+}
@@ -0,0 +1,597 @@
+/*
+ *   Virtual Toshiba TEC TPCL printer for testing the rastertotpcl filter.
+ *
+ *   Copyright 2010 by Sam Lown
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Usage:
+ *
+ *   tpclemu [-l serial[:baud]|usb|lan] [-b bytes/sec] [-r dpi]
+ *           [-c raster-file] [-o pbm-prefix] [file.tpcl]
+ *
+ * Reads a TPCL stream as produced by rastertotpcl, decodes the {SG}
+ * graphics (TOPIX or raw) into a bitmap per label and models the time
+ * the printer would take given the link speed and the {XS} print speed.
+ * With -c the labels are compared against the original CUPS raster.
+ *
+ * Contents:
+ *
+ *   ReadStream()   - Read the whole stream into memory.
+ *   ParseNumber()  - Parse a number with an optional 'D' (dots) suffix.
+ *   ImageSize()    - Grow the label bitmap.
+ *   DoGraphics()   - Handle a {SG} command.
+ *   DoIssue()      - Handle a {XS} command and model printing the labels.
+ *   ComparePage()  - Compare a label against the next raster pages.
+ *   WritePBM()     - Save a label as a PBM file.
+ *   main()         - Main entry for the emulator.
+ */
+
+#include <cups/cups.h>
+#include <cups/raster.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "tpcl.h"
+#include "topix.h"
+
+
+/*
+ * Emulator state...
+ */
+typedef struct emu_s
+{
+  int             dpi;              /* Resolution for 0.1mm positions */
+  double          link_rate;        /* Link bandwidth in bytes/sec */
+
+  unsigned char   *image;           /* Label bitmap */
+  int             bytes_per_line;   /* Width of image */
+  int             height;           /* Lines in image */
+  int             pitch;            /* Label pitch in 0.1mm from {D} */
+
+  int             labels;           /* Labels printed */
+  int             pages;            /* {XS} commands seen */
+  int             blocks;           /* {SG} commands seen */
+  int             unknown;          /* Unknown commands */
+  int             errors;           /* Decode errors */
+  double          printer_free;     /* Time the print head is idle again */
+  double          first_label;      /* Time first label is out */
+
+  cups_raster_t   *ras;             /* Raster to compare against */
+  int             mismatches;       /* Pages that differ from raster */
+  const char      *pbm_prefix;      /* Prefix for PBM output */
+} emu_t;
+
+
+/*
+ * Prototypes...
+ */
+static unsigned char  *ReadStream(const char *filename, size_t *len);
+static int            ParseNumber(emu_t *emu, const char **s);
+static int            ImageSize(emu_t *emu, int bytes_per_line, int height);
+static const unsigned char *DoGraphics(emu_t *emu, const unsigned char *p,
+                                       const unsigned char *end);
+static void           DoIssue(emu_t *emu, const char *args, double now);
+static void           ComparePage(emu_t *emu, int copies);
+static void           WritePBM(emu_t *emu);
+
+
+/*
+ * 'ReadStream()' - Read the whole stream into memory.
+ */
+static unsigned char *                  /* O - Data or NULL */
+ReadStream(const char *filename,        /* I - File or NULL for stdin */
+           size_t     *len)             /* O - Length of data */
+{
+  FILE          *fp;                    /* Input file */
+  unsigned char *data, *temp;           /* Data buffer */
+  size_t        size, bytes;            /* Buffer size, bytes read */
+
+
+  if (!filename)
+    fp = stdin;
+  else if ((fp = fopen(filename, "rb")) == NULL)
+    return (NULL);
+
+  size = 1 << 20;
+  *len = 0;
+  data = malloc(size);
+
+  while (data && (bytes = fread(data + *len, 1, size - *len, fp)) > 0)
+  {
+    *len += bytes;
+    if (*len == size)
+    {
+      size *= 2;
+      if ((temp = realloc(data, size)) == NULL)
+        free(data);
+      data = temp;
+    }
+  }
+
+  if (fp != stdin)
+    fclose(fp);
+
+  return (data);
+}
+
+
+/*
+ * 'ParseNumber()' - Parse a number with an optional 'D' (dots) suffix.
+ *
+ * Positions without the suffix are in 0.1mm and converted to dots.
+ */
+static int                              /* O - Value in dots */
+ParseNumber(emu_t      *emu,            /* I - Emulator */
+            const char **s)             /* IO - Position in command */
+{
+  int   value = 0;                      /* Value */
+
+
+  while (**s >= '0' && **s <= '9')
+    value = value * 10 + *(*s)++ - '0';
+
+  if (**s == 'D')
+    (*s)++;
+  else
+    value = value * emu->dpi / 254;
+
+  if (**s == ',')
+    (*s)++;
+
+  return (value);
+}
+
+
+/*
+ * 'ImageSize()' - Grow the label bitmap.
+ */
+static int                              /* O - 0 on success, -1 on error */
+ImageSize(emu_t *emu,                   /* I - Emulator */
+          int   bytes_per_line,         /* I - Minimum width */
+          int   height)                 /* I - Minimum height */
+{
+  unsigned char *image;                 /* New image */
+  int           y;                      /* Line */
+
+
+  if (bytes_per_line <= emu->bytes_per_line && height <= emu->height)
+    return (0);
+
+  if (bytes_per_line < emu->bytes_per_line)
+    bytes_per_line = emu->bytes_per_line;
+  if (height < emu->height)
+    height = emu->height;
+
+  if ((image = calloc((size_t)height, (size_t)bytes_per_line)) == NULL)
+    return (-1);
+
+  for (y = 0; y < emu->height; y++)
+    memcpy(image + y * bytes_per_line, emu->image + y * emu->bytes_per_line,
+           emu->bytes_per_line);
+
+  free(emu->image);
+  emu->image          = image;
+  emu->bytes_per_line = bytes_per_line;
+  emu->height         = height;
+
+  return (0);
+}
+
+
+/*
+ * 'DoGraphics()' - Handle a {SG} command.
+ *
+ * p points just after "{SG;"; returns the position after the data.
+ */
+static const unsigned char *            /* O - End of command or NULL */
+DoGraphics(emu_t               *emu,    /* I - Emulator */
+           const unsigned char *p,      /* I - Command arguments */
+           const unsigned char *end)    /* I - End of stream */
+{
+  int                 x, y, w, h, mode; /* SG fields */
+  int                 bpl;              /* Bytes per line of the object */
+  int                 len, used, i;     /* Data length, bytes used, index */
+  unsigned char       *last;            /* Previous decoded line */
+  unsigned char       *row;             /* Row in image */
+  const char          *s;               /* Position in arguments */
+
+
+  s    = (const char *)p;
+  x    = ParseNumber(emu, &s);
+  y    = ParseNumber(emu, &s);
+  w    = (int)strtol(s, (char **)&s, 10);   /* Sizes are always in dots */
+  h    = (int)strtol(s + 1, (char **)&s, 10);
+  mode = (int)strtol(s + 1, (char **)&s, 10);
+  if (*s++ != ',')
+    return (NULL);
+
+  p   = (const unsigned char *)s;
+  bpl = (w + 7) / 8;
+  x  /= 8;
+  emu->blocks ++;
+
+  if (mode == TEC_GMODE_TOPIX)
+  {
+   /*
+    * 16 bit big-endian length, then lines until the data is used up,
+    * each XORed against the previous line of this block.
+    */
+    if (end - p < 2)
+      return (NULL);
+
+    len = (p[0] << 8) | p[1];
+    p   += 2;
+    if (end - p < len)
+      return (NULL);
+
+    if ((last = calloc(1, bpl)) == NULL)
+      return (NULL);
+
+    while (len > 0)
+    {
+      if ((used = TOPIXDecodeLine(p, len, last, bpl)) < 0)
+      {
+        emu->errors ++;
+        break;
+      }
+
+      if (ImageSize(emu, x + bpl, y + 1))
+        break;
+
+      memcpy(emu->image + y * emu->bytes_per_line + x, last, bpl);
+
+      p   += used;
+      len -= used;
+      y ++;
+    }
+
+    p += len;
+    free(last);
+  }
+  else
+  {
+   /*
+    * Raw graphics, h lines of whole bytes, overwritten or ORed in.
+    */
+    if (end - p < (long)bpl * h || ImageSize(emu, x + bpl, y + h))
+      return (NULL);
+
+    for (; h > 0; h--, y++, p += bpl)
+    {
+      row = emu->image + y * emu->bytes_per_line + x;
+      if (mode == TEC_GMODE_HEX_OR)
+        for (i = 0; i < bpl; i++)
+          row[i] |= p[i];
+      else
+        memcpy(row, p, bpl);
+    }
+  }
+
+  if (end - p < 2 || p[0] != '|' || p[1] != '}')
+  {
+    emu->errors ++;
+    return (NULL);
+  }
+
+  return (p + 2);
+}
+
+
+/*
+ * 'DoIssue()' - Handle a {XS} command and model printing the labels.
+ *
+ * The label can only be printed once the whole command has arrived and
+ * the previous one has left the printer.  Speed codes are inches/sec.
+ */
+static void
+DoIssue(emu_t      *emu,                /* I - Emulator */
+        const char *args,               /* I - "I,nnnn,ccc..." */
+        double     now)                 /* I - Arrival time */
+{
+  int     copies;                       /* Number of labels */
+  char    speed;                        /* Speed code */
+  double  ips, seconds;                 /* Speed, time per label */
+
+
+  copies = atoi(args + 2);
+  speed  = strlen(args) > 12 ? args[12] : '3';
+  ips    = speed == 'A' ? 10.0 : speed - '0';
+  if (ips <= 0.0)
+    ips = 3.0;
+
+  seconds = emu->pitch / 10.0 / (ips * 25.4);
+
+  if (emu->printer_free < now)
+    emu->printer_free = now;
+
+  if (emu->labels == 0 && copies > 0)
+    emu->first_label = emu->printer_free + seconds;
+
+  emu->printer_free += seconds * copies;
+  emu->labels       += copies;
+  emu->pages ++;
+
+  if (emu->ras)
+    ComparePage(emu, copies);
+
+  if (emu->pbm_prefix)
+    WritePBM(emu);
+}
+
+
+/*
+ * 'ComparePage()' - Compare a label against the next raster pages.
+ *
+ * A label issued several times stands for as many raster pages as it
+ * takes to make up the quantity, the filter merges identical pages.
+ */
+static void
+ComparePage(emu_t *emu,                 /* I - Emulator */
+            int   copies)               /* I - Issue quantity */
+{
+  cups_page_header2_t header;           /* Raster page header */
+  unsigned char       *line;            /* Raster line */
+  unsigned char       *row;             /* Decoded line */
+  unsigned            y;                /* Line */
+  int                 bpl;              /* Bytes to compare */
+  int                 bad;              /* Differing lines */
+
+
+  do
+  {
+    if (!cupsRasterReadHeader2(emu->ras, &header))
+    {
+      fprintf(stderr, "tpclemu: label %d has no raster page\n", emu->pages);
+      emu->mismatches ++;
+      return;
+    }
+
+    if ((line = malloc(header.cupsBytesPerLine)) == NULL)
+      return;
+
+    bpl = (int)header.cupsBytesPerLine;
+    if (bpl > emu->bytes_per_line)
+      bpl = emu->bytes_per_line;
+
+    for (y = 0, bad = 0; y < header.cupsHeight; y++)
+    {
+      if (cupsRasterReadPixels(emu->ras, line, header.cupsBytesPerLine) < 1)
+        break;
+
+     /*
+      * Grayscale pages are dithered by the filter, so only 1-bit pages
+      * can be compared.
+      */
+      if (header.cupsBitsPerPixel != 1)
+        continue;
+
+     /*
+      * Lines the printer never received must be blank in the raster.
+      */
+      if ((int)y < emu->height)
+        row = emu->image + y * emu->bytes_per_line;
+      else
+        row = NULL;
+
+      if ((row && memcmp(row, line, bpl)) ||
+          (!row && (line[0] || memcmp(line, line + 1, header.cupsBytesPerLine - 1))))
+      {
+        if (!bad)
+          fprintf(stderr, "tpclemu: label %d differs from raster at line %u\n",
+                  emu->pages, y);
+        bad ++;
+      }
+    }
+
+    if (header.cupsBitsPerPixel != 1)
+      fprintf(stderr, "tpclemu: label %d is %d-bit, not compared\n",
+              emu->pages, header.cupsBitsPerPixel);
+
+    if (bad)
+      emu->mismatches ++;
+
+    free(line);
+
+    copies -= header.NumCopies > 0 ? (int)header.NumCopies : 1;
+  }
+  while (copies > 0);
+}
+
+
+/*
+ * 'WritePBM()' - Save a label as a PBM file.
+ */
+static void
+WritePBM(emu_t *emu)                    /* I - Emulator */
+{
+  char  filename[1024];                 /* Output file name */
+  FILE  *fp;                            /* Output file */
+
+
+  snprintf(filename, sizeof(filename), "%s-%d.pbm", emu->pbm_prefix, emu->pages);
+  if ((fp = fopen(filename, "wb")) == NULL)
+  {
+    perror(filename);
+    return;
+  }
+
+  fprintf(fp, "P4\n%d %d\n", emu->bytes_per_line * 8, emu->height);
+  fwrite(emu->image, (size_t)emu->bytes_per_line, (size_t)emu->height, fp);
+  fclose(fp);
+}
+
+
+/*
+ * 'main()' - Main entry for the emulator.
+ */
+int                                     /* O - Exit status */
+main(int  argc,                         /* I - Number of command-line arguments */
+     char *argv[])                      /* I - Command-line arguments */
+{
+  emu_t               emu;              /* Emulator state */
+  const char          *filename = NULL; /* TPCL file */
+  const char          *raster = NULL;   /* Raster to compare with */
+  const char          *link = "usb";    /* Link type */
+  unsigned char       *data;            /* Stream */
+  const unsigned char *p, *end, *next;  /* Position in stream */
+  char                args[256];        /* Command arguments */
+  size_t              len;              /* Stream length */
+  int                 i, fd = -1;       /* Looping var, raster file */
+  double              now;              /* Simulated time */
+
+
+  memset(&emu, 0, sizeof(emu));
+  emu.dpi = 203;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-l") && i + 1 < argc)
+      link = argv[++i];
+    else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+      emu.link_rate = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      emu.dpi = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+      raster = argv[++i];
+    else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+      emu.pbm_prefix = argv[++i];
+    else if (argv[i][0] != '-' && !filename)
+      filename = argv[i];
+    else
+    {
+      fputs("Usage: tpclemu [-l serial[:baud]|usb|lan] [-b bytes/sec] [-r dpi]\n"
+            "               [-c raster-file] [-o pbm-prefix] [file.tpcl]\n", stderr);
+      return (1);
+    }
+  }
+
+ /*
+  * Link speed, 8N1 serial sends 10 bits per byte; USB and LAN are rough
+  * effective rates for these printers.
+  */
+  if (emu.link_rate <= 0.0)
+  {
+    if (!strncmp(link, "serial", 6))
+      emu.link_rate = (link[6] == ':' ? atof(link + 7) : 9600.0) / 10.0;
+    else if (!strcmp(link, "lan"))
+      emu.link_rate = 10000000.0 / 8.0;
+    else
+      emu.link_rate = 1000000.0;
+  }
+
+  if ((data = ReadStream(filename, &len)) == NULL)
+  {
+    perror(filename ? filename : "stdin");
+    return (1);
+  }
+
+  if (raster)
+  {
+    if ((fd = open(raster, O_RDONLY)) < 0 ||
+        (emu.ras = cupsRasterOpen(fd, CUPS_RASTER_READ)) == NULL)
+    {
+      perror(raster);
+      return (1);
+    }
+  }
+
+  p   = data;
+  end = data + len;
+
+  while (p < end)
+  {
+    if (*p != '{')
+    {
+      p ++;
+      continue;
+    }
+
+    if (end - p > 4 && !memcmp(p, "{SG;", 4))
+    {
+      if ((next = DoGraphics(&emu, p + 4, end)) == NULL)
+      {
+        fprintf(stderr, "tpclemu: bad graphics command at offset %ld\n",
+                (long)(p - data));
+        emu.errors ++;
+        break;
+      }
+
+      p = next;
+      continue;
+    }
+
+   /*
+    * Text commands run up to "|}".
+    */
+    for (next = p + 1; next + 1 < end && !(next[0] == '|' && next[1] == '}'); next ++);
+    if (next + 1 >= end)
+      break;
+
+    snprintf(args, sizeof(args), "%.*s", (int)(next - p - 1), (const char *)p + 1);
+    next += 2;
+    now   = (next - data) / emu.link_rate;
+
+    if (!strncmp(args, "XS;", 3))
+      DoIssue(&emu, args + 3, now);
+    else if (args[0] == 'D' && isdigit(args[1] & 255))
+      emu.pitch = atoi(args + 1);
+    else if (!strcmp(args, "C"))
+    {
+      if (emu.image)
+        memset(emu.image, 0, (size_t)emu.bytes_per_line * emu.height);
+    }
+    else if (strncmp(args, "WS", 2) && strncmp(args, "AX;", 3) &&
+             strncmp(args, "RM;", 3) && strncmp(args, "AY;", 3) &&
+             strcmp(args, "IB") && strcmp(args, "WR") && strncmp(args, "XJ;", 3))
+    {
+      fprintf(stderr, "tpclemu: unknown command {%s|}\n", args);
+      emu.unknown ++;
+    }
+
+    p = next;
+  }
+
+  now = len / emu.link_rate;
+  if (emu.printer_free < now)
+    emu.printer_free = now;
+
+  printf("Bytes received:      %lu\n", (unsigned long)len);
+  printf("Link rate:           %.0f bytes/sec\n", emu.link_rate);
+  printf("Transfer time:       %.3f sec\n", now);
+  printf("Graphics objects:    %d\n", emu.blocks);
+  printf("Labels:              %d (%d issue commands)\n", emu.labels, emu.pages);
+  printf("Time to first label: %.3f sec\n", emu.first_label);
+  printf("Total time:          %.3f sec\n", emu.printer_free);
+  printf("Labels/minute:       %.1f\n",
+         emu.printer_free > 0.0 ? emu.labels * 60.0 / emu.printer_free : 0.0);
+  if (emu.ras)
+    printf("Raster mismatches:   %d\n", emu.mismatches);
+  if (emu.errors || emu.unknown)
+    printf("Errors:              %d (%d unknown commands)\n", emu.errors, emu.unknown);
+
+  if (emu.ras)
+  {
+    cupsRasterClose(emu.ras);
+    close(fd);
+  }
+
+  free(emu.image);
+  free(data);
+
+  return (emu.errors || emu.mismatches ? 1 : 0);
+}